@@ -1,7 +1,10 @@
 #!/bin/python
 import argparse
 import os
+import shlex
+import shutil
 import subprocess
+import time
 
 try:
     import build_params as bp
@@ -11,69 +14,200 @@ except ModuleNotFoundError:
 
 CWD = os.path.dirname(os.path.realpath(__file__))
 SRC = os.path.join(CWD, 'src')
+TEST = os.path.join(CWD, 'test')
 
-def main(comp64 = None, comp32 = None, dll = None, include = None, output = None, debug = None):
-    if comp64 is None:
-        comp64 = DEFAULT_PARAMS.get('COMPILER64')
-    if comp32 is None:
-        comp32 = DEFAULT_PARAMS.get('COMPILER32')
-    if dll is None:
-        dll = DEFAULT_PARAMS.get('WRAPPED_DLL')
-    if include is None:
-        include = DEFAULT_PARAMS.get('WRAPPED_DLL_INCLUDE')
-    if output is None:
-        output = DEFAULT_PARAMS.get('OUTPUT_DIR')
-    if debug is None:
-        debug = DEFAULT_PARAMS.get('DEBUG')
-
-    # Shared compiler flags for both targets
-    compiler_flags = f'-Wall -Wextra -Werror -Wfatal-errors -static -funsigned-char '
-
-    if debug:
-        debug_flags = '-g -Og -DDEBUG=1'
-    else:
-        debug_flags = '-O3 -DDEBUG=0'
-    
-    compiler_flags += debug_flags
-    compiler_flags = compiler_flags.split()
+# Number of runs of the PGO workload whose fastest one is reported
+PGO_TIMING_RUNS = 3
 
-    os.makedirs(output, exist_ok=True)
+def build_bridge(comp64, dll, include, output, flags):
+    # The bridge names its library to wrappers that host several
+    library = os.path.basename(dll).rsplit('.', 1)[0]
 
     print("Building bridge.dll")
     subprocess.check_output([comp64,
         os.path.join(SRC, 'bridge', 'bridge.cpp'),
+        os.path.join(SRC, 'common', 'async_log.cpp'),
+        os.path.join(SRC, 'common', 'capture.cpp'),
+        os.path.join(SRC, 'common', 'marshal.cpp'),
         os.path.join(SRC, 'common', 'msg_protocol.cpp'),
+        os.path.join(SRC, 'common', 'placement.cpp'),
         os.path.join(SRC, 'common', 'socket.cpp'),
+        os.path.join(SRC, 'common', 'trace.cpp'),
+        os.path.join(SRC, 'common', 'metrics.cpp'),
         '-shared',
         '-I' + include,
         '-I' + os.path.join(CWD, 'include'),
         '-I' + os.path.join(SRC),
         '-I' + os.path.join(CWD, 'vendor', 'plog'),
         '-lws2_32',
+        '-lpsapi',
+        '-DDLL32TO64_LIBRARY="' + library + '"',
         '-o' + os.path.join(output, 'bridge.dll')] +
-        compiler_flags 
+        flags
     )
 
-    dll_dir, dll_name = os.path.split(dll)
-    dll_name = dll_name.rsplit('.', 1)[0]
-
+def build_wrapper(comp32, dll, include, output, flags):
+    # The wrapper loads the library at runtime, so it must be next to wrapper.exe or on the PATH
     print("Building wrapper.exe")
     subprocess.check_output([comp32,
         os.path.join(SRC, 'wrapper', 'wrapper.cpp'),
         os.path.join(SRC, 'common', 'msg_protocol.cpp'),
+        os.path.join(SRC, 'common', 'placement.cpp'),
+        os.path.join(SRC, 'common', 'reactor.cpp'),
         os.path.join(SRC, 'common', 'socket.cpp'),
+        os.path.join(SRC, 'common', 'trace.cpp'),
+        os.path.join(SRC, 'common', 'metrics.cpp'),
         '-static', '-static-libgcc', '-static-libstdc++',
         '-I' + include,
         '-I' + os.path.join(SRC),
         '-I' + os.path.join(CWD, 'vendor', 'plog'),
         '-lws2_32',
-        '-L' + dll_dir,
-        '-Wl,-Bdynamic',
-        '-l' + dll_name,
-        '-Wl,-Bstatic',
+        '-lpsapi',
+        '-DWRAPPED_DLL="' + os.path.basename(dll) + '"',
         '-o' + os.path.join(output, 'wrapper.exe')] +
-        compiler_flags
+        flags
+    )
+
+def build_tools(comp64, output, flags):
+    print("Building dll32to64-top.exe")
+    subprocess.check_output([comp64,
+        os.path.join(SRC, 'top', 'top.cpp'),
+        os.path.join(SRC, 'common', 'msg_protocol.cpp'),
+        os.path.join(SRC, 'common', 'trace.cpp'),
+        os.path.join(SRC, 'common', 'metrics.cpp'),
+        '-static-libgcc', '-static-libstdc++',
+        '-I' + os.path.join(SRC),
+        '-I' + os.path.join(CWD, 'vendor', 'plog'),
+        '-lpsapi',
+        '-o' + os.path.join(output, 'dll32to64-top.exe')] +
+        flags
+    )
+
+    print("Building dll32to64-replay.exe")
+    subprocess.check_output([comp64,
+        os.path.join(SRC, 'replay', 'replay.cpp'),
+        os.path.join(SRC, 'common', 'capture.cpp'),
+        os.path.join(SRC, 'common', 'msg_protocol.cpp'),
+        os.path.join(SRC, 'common', 'socket.cpp'),
+        os.path.join(SRC, 'common', 'trace.cpp'),
+        '-static-libgcc', '-static-libstdc++',
+        '-I' + os.path.join(SRC),
+        '-I' + os.path.join(CWD, 'vendor', 'plog'),
+        '-lws2_32',
+        '-o' + os.path.join(output, 'dll32to64-replay.exe')] +
+        flags
+    )
+
+def build_synth_lib(comp32, output):
+    """Build test/synth_lib.cpp, a drop-in for test_lib.dll with configurable behavior. Returns the path of the DLL."""
+    print("Building synth_lib.dll")
+    dll = os.path.join(output, 'synth_lib.dll')
+    subprocess.check_output([comp32,
+        os.path.join(TEST, 'synth_lib.cpp'),
+        '-shared',
+        '-static',
+        '-O2',
+        '-funsigned-char',
+        '-o' + dll]
     )
+    return dll
+
+def run_workload(workload, output):
+    """Run the workload against the binaries in output and return its duration in seconds."""
+    args = shlex.split(workload)
+    if os.path.exists(args[0]):
+        args[0] = os.path.abspath(args[0])
+
+    # The workload loads bridge.dll from output, which starts wrapper.exe from there
+    env = dict(os.environ)
+    env['PATH'] = os.path.abspath(output) + os.pathsep + env.get('PATH', '')
+
+    start = time.perf_counter()
+    subprocess.run(args, cwd=output, env=env, check=True, stdout=subprocess.DEVNULL)
+    return time.perf_counter() - start
+
+def best_of(runs, workload, output):
+    return min(run_workload(workload, output) for _ in range(runs))
+
+def build_pgo(comp64, comp32, dll, include, output, flags, workload):
+    """
+    Profile guided build of bridge.dll and wrapper.exe.
+
+    Both are built with instrumentation first and trained by running the workload, which must call the wrapped DLL
+    through bridge.dll. They are then rebuilt with the recorded profiles and LTO. The workload is timed with a plain LTO
+    build before and with the final build after, so the effect is visible.
+    """
+    profile_dir = os.path.abspath(os.path.join(output, 'pgo'))
+    shutil.rmtree(profile_dir, ignore_errors=True)
+    bridge_profile = os.path.join(profile_dir, 'bridge')
+    wrapper_profile = os.path.join(profile_dir, 'wrapper')
+
+    lto_flags = flags + ['-flto']
+
+    print("PGO: Measuring baseline")
+    build_bridge(comp64, dll, include, output, lto_flags)
+    build_wrapper(comp32, dll, include, output, lto_flags)
+    baseline = best_of(PGO_TIMING_RUNS, workload, output)
+
+    # Callbacks and clients call from several threads, so counters are updated atomically
+    print("PGO: Training")
+    generate_flags = ['-fprofile-update=atomic']
+    build_bridge(comp64, dll, include, output, lto_flags + generate_flags + ['-fprofile-generate=' + bridge_profile])
+    build_wrapper(comp32, dll, include, output, lto_flags + generate_flags + ['-fprofile-generate=' + wrapper_profile])
+    run_workload(workload, output)
+
+    # Code the workload didn't reach has no profile, which is fine
+    print("PGO: Optimizing")
+    use_flags = ['-fprofile-correction', '-Wno-missing-profile']
+    build_bridge(comp64, dll, include, output, lto_flags + use_flags + ['-fprofile-use=' + bridge_profile])
+    build_wrapper(comp32, dll, include, output, lto_flags + use_flags + ['-fprofile-use=' + wrapper_profile])
+    optimized = best_of(PGO_TIMING_RUNS, workload, output)
+
+    print(f"PGO: Workload took {baseline * 1000:.0f} ms before and {optimized * 1000:.0f} ms after "
+          f"({(optimized - baseline) / baseline * 100:+.1f}%)")
+
+def main(comp64 = None, comp32 = None, dll = None, include = None, output = None, debug = None, pgo_workload = None,
+         synth = False):
+    if comp64 is None:
+        comp64 = DEFAULT_PARAMS.get('COMPILER64')
+    if comp32 is None:
+        comp32 = DEFAULT_PARAMS.get('COMPILER32')
+    if dll is None:
+        dll = DEFAULT_PARAMS.get('WRAPPED_DLL')
+    if include is None:
+        include = DEFAULT_PARAMS.get('WRAPPED_DLL_INCLUDE')
+    if output is None:
+        output = DEFAULT_PARAMS.get('OUTPUT_DIR')
+    if debug is None:
+        debug = DEFAULT_PARAMS.get('DEBUG')
+
+    # Profiles of unoptimized code don't help the optimized build
+    if pgo_workload is not None:
+        debug = False
+
+    # Shared compiler flags for both targets
+    compiler_flags = f'-Wall -Wextra -Werror -Wfatal-errors -static -funsigned-char '
+
+    if debug:
+        debug_flags = '-g -Og -DDEBUG=1'
+    else:
+        debug_flags = '-O3 -DDEBUG=0'
+    
+    compiler_flags += debug_flags
+    compiler_flags = compiler_flags.split()
+
+    os.makedirs(output, exist_ok=True)
+
+    if synth:
+        dll = build_synth_lib(comp32, output)
+        include = TEST
+
+    if pgo_workload is not None:
+        build_pgo(comp64, comp32, dll, include, output, compiler_flags, pgo_workload)
+    else:
+        build_bridge(comp64, dll, include, output, compiler_flags)
+        build_wrapper(comp32, dll, include, output, compiler_flags)
+    build_tools(comp64, output, compiler_flags)
 
 
 if __name__ == '__main__':
@@ -84,6 +218,12 @@ if __name__ == '__main__':
     parser.add_argument('--include', type=str, default=None, help="Path to the header(s) declaring the DLL's exported symbols.")
     parser.add_argument('--output', type=str, default=None, help='Directory where the generated binaries should be stored.')
     parser.add_argument('--debug', action='store_true', help='Build debug binaries.')
+    parser.add_argument('--synth', action='store_true',
+                        help='Wrap the synthetic test library (see test/synth_lib.cpp) instead of --dll.')
+    parser.add_argument('--pgo', type=str, default=None, metavar='WORKLOAD',
+                        help='Optimize bridge.dll and wrapper.exe with profiles recorded while running this command, which '
+                             'must call the wrapped DLL through bridge.dll. Implies a release build with LTO.')
     args = parser.parse_args()
 
-    main(comp64=args.compiler64, comp32=args.compiler32, dll=args.dll, include=args.include, output=args.output, debug=args.debug)
\ No newline at end of file
+    main(comp64=args.compiler64, comp32=args.compiler32, dll=args.dll, include=args.include, output=args.output, debug=args.debug,
+         pgo_workload=args.pgo, synth=args.synth)
\ No newline at end of file
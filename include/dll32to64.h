@@ -17,6 +17,246 @@ extern "C"
      */
     EXPORT bool Dll32To64_EnableLogging(char const *path);
 
+    /**
+     * Like Dll32To64_EnableLogging(), but log records of the call path are formatted and written by a background thread.
+     *
+     * Calls only copy their log arguments into a lock-free ring buffer. If the background thread can't keep up, records
+     * are dropped rather than slowing down calls. Pending records are written on Dll32To64_Shutdown().
+     *
+     * @param path: 0-terminated path to directory where log files should be stored.
+     * @return True if logging was started successfully.
+     */
+    EXPORT bool Dll32To64_EnableAsyncLogging(char const *path);
+
+    /**
+     * Start recording a timeline of all calls in bridge.dll and wrapper.exe.
+     *
+     * The trace is written to `dll32to64.trace.json` in the Chrome Trace Event format when Dll32To64_Shutdown() is
+     * called. Open it in chrome://tracing or https://ui.perfetto.dev.
+     *
+     * @param path: 0-terminated path to directory where the trace file should be stored.
+     * @return True if tracing was started successfully.
+     */
+    EXPORT bool Dll32To64_EnableTracing(char const *path);
+
+    /**
+     * Record all frames exchanged with the wrapper into a capture file, which can be replayed with dll32to64-replay.
+     *
+     * Capturing stops when Dll32To64_StopCapture() or Dll32To64_Shutdown() is called, or the file is full.
+     *
+     * @param path: 0-terminated path of the capture file. An existing file is overwritten.
+     * @param maxSizeMb: Maximum size of the capture file in MB, 0 for the default of 256MB.
+     * @return True if capturing was started successfully.
+     */
+    EXPORT bool Dll32To64_StartCapture(char const *path, unsigned maxSizeMb);
+
+    /**
+     * Stop capturing and finalize the capture file.
+     */
+    EXPORT void Dll32To64_StopCapture();
+
+    /* Errors reported by Dll32To64_GetLastError(). */
+    enum Dll32To64_Error
+    {
+        DLL32TO64_ERROR_NONE = 0,
+        DLL32TO64_ERROR_CONNECTION,  // The wrapper could not be started or the connection to it broke
+        DLL32TO64_ERROR_TIMEOUT,     // The call didn't complete before its deadline
+        DLL32TO64_ERROR_PROTOCOL,    // The wrapper sent an unexpected or invalid response
+        DLL32TO64_ERROR_OVERLOADED,  // The call was rejected because too many calls are in flight and queued
+        DLL32TO64_ERROR_ARGUMENTS,   // The arguments don't fit into a request, or the wrapper rejected them
+    };
+
+    /**
+     * Error of the last call of a wrapped function by the calling thread.
+     *
+     * Wrapped functions keep their original signatures, so this is the only way to tell a failed call from a regular
+     * return value.
+     */
+    EXPORT Dll32To64_Error Dll32To64_GetLastError();
+
+    /**
+     * Set a deadline for all following calls of wrapped functions by the calling thread.
+     *
+     * A call that doesn't complete before the deadline returns right away, and Dll32To64_GetLastError() reports
+     * DLL32TO64_ERROR_TIMEOUT. If the wrapper didn't start executing the call yet, it is cancelled. Otherwise, its
+     * result is discarded when it arrives.
+     *
+     * @param timeoutMs: Deadline in milliseconds from now, 0 to remove the deadline.
+     */
+    EXPORT void Dll32To64_SetDeadline(unsigned timeoutMs);
+
+    /**
+     * Set the timeout applied to every call of a wrapped function. A deadline set with Dll32To64_SetDeadline() takes
+     * precedence if it is earlier.
+     *
+     * @param function: 0-terminated name of the wrapped function, or NULL for all functions.
+     * @param timeoutMs: Timeout in milliseconds, 0 to wait forever (the default).
+     * @return False if there is no wrapped function of that name.
+     */
+    EXPORT bool Dll32To64_SetDefaultTimeout(char const *function, unsigned timeoutMs);
+
+    /**
+     * Terminate wrapper.exe when a call times out, instead of waiting for it to finish the call. The next call starts a
+     * new wrapper. A shared wrapper daemon is never terminated; only this process's session with it is closed.
+     */
+    EXPORT void Dll32To64_SetRestartOnTimeout(bool restart);
+
+    /* How calls of a wrapped function that has a local implementation in bridge.dll are served. */
+    enum Dll32To64_ShimMode
+    {
+        DLL32TO64_SHIM_OFF = 0,  // Forward every call to the wrapped DLL
+        DLL32TO64_SHIM_VERIFY,   // Forward calls and compare their results with the local implementation
+        DLL32TO64_SHIM_ON,       // Serve calls locally, without a round trip to the wrapper
+    };
+
+    /**
+     * Select how a wrapped function with a local implementation is served.
+     *
+     * In DLL32TO64_SHIM_VERIFY mode, the next `verifyCalls` calls are forwarded and the local implementation must return
+     * the same results. The function then switches to DLL32TO64_SHIM_ON, or to DLL32TO64_SHIM_OFF on the first
+     * mismatch.
+     *
+     * @param function: 0-terminated name of the wrapped function, or NULL for all functions with a local implementation.
+     * @param mode: How calls are served from now on.
+     * @param verifyCalls: Number of calls to compare in DLL32TO64_SHIM_VERIFY mode, 0 to switch on right away.
+     * @return False if there is no wrapped function of that name with a local implementation.
+     */
+    EXPORT bool Dll32To64_SetShimMode(char const *function, Dll32To64_ShimMode mode, unsigned verifyCalls);
+
+    /* Priority classes of calls, see Dll32To64_SetLane(). */
+    enum Dll32To64_Lane
+    {
+        DLL32TO64_LANE_CONTROL = 0,  // Small, latency critical calls, which go before all bulk calls
+        DLL32TO64_LANE_BULK,         // Calls that transfer a lot of data
+    };
+
+    /**
+     * Select the lane of a wrapped function's calls. By default, functions that transfer data use the bulk lane and all
+     * others the control lane.
+     *
+     * Control calls are sent, executed and answered before bulk calls that are still queued, so they only ever wait for
+     * a single bulk request. Large transfers are split into requests of a few KB, so that is a short wait. To keep bulk
+     * calls from starving, one of them is executed after every few control calls.
+     *
+     * @param function: 0-terminated name of the wrapped function, or NULL for all functions.
+     * @param lane: Lane of the calls started from now on.
+     * @return False if there is no wrapped function of that name.
+     */
+    EXPORT bool Dll32To64_SetLane(char const *function, Dll32To64_Lane lane);
+
+    /**
+     * Pin the threads of bridge.dll and wrapper.exe to CPUs and set their priorities, e.g. to keep them in the cache
+     * domain of the calling threads. Overrides the environment variable DLL32TO64_PLACEMENT.
+     *
+     * The placement applies to threads started afterwards, so call this before the first call of a wrapped function.
+     * A shared wrapper daemon is placed by its own --placement option.
+     *
+     * @param spec: 0-terminated placement like "bridge-reader=2;wrapper-worker=3:highest", see README.md. An empty spec
+     *              leaves all threads to the scheduler.
+     * @return False if spec is invalid, e.g. it names an unknown thread or CPU.
+     */
+    EXPORT bool Dll32To64_SetPlacement(char const *spec);
+
+    /**
+     * Replace wrapper.exe with a new one after a number of calls or once it uses too much memory, e.g. because the
+     * wrapped DLL leaks. Overrides the environment variable DLL32TO64_RECYCLE ("calls=<n>;memory=<mb>").
+     *
+     * The new wrapper is started in the background. Then, calls are held back until the old one has answered all
+     * pending calls, and the callbacks registered with it are registered with the new one. No calls fail; only the calls
+     * started during the switch are delayed. The wrapper is not recycled while the client holds objects of the DLL, such
+     * as buffers, because they live in the wrapper. A shared wrapper daemon is never recycled.
+     *
+     * @param maxCalls: Calls after which the wrapper is replaced, 0 for no limit.
+     * @param maxMemoryMb: Address space in MB the wrapper may use before it is replaced, 0 for no limit. Memory usage
+     *                     is reported by the wrapper twice a second while it executes calls.
+     */
+    EXPORT void Dll32To64_SetRecyclePolicy(unsigned maxCalls, unsigned maxMemoryMb);
+
+    /**
+     * Limit the calls of a wrapped function, or of all functions together, that are in flight at the same time.
+     *
+     * A call that exceeds a limit waits in the bridge until an earlier call is done, and counts towards the deadline of
+     * a synchronous call. If `maxQueued` calls are waiting already, the call returns right away, and
+     * Dll32To64_GetLastError() reports DLL32TO64_ERROR_OVERLOADED. Without limits, calls are sent right away, up to the
+     * number of requests the wrapper accepts per session; beyond that, they wait in the bridge for responses, without
+     * blocking the callers of asynchronous calls.
+     *
+     * @param function: 0-terminated name of the wrapped function, or NULL for the limit on all calls together.
+     * @param maxInFlight: Calls that may be in flight, 0 for no limit (the default).
+     * @param maxQueued: Calls that may wait for admission beyond that, 0 to reject them right away. For the limit on all
+     *                   calls, this counts the calls waiting for any limit.
+     * @return False if there is no wrapped function of that name.
+     */
+    EXPORT bool Dll32To64_SetAdmissionLimit(char const *function, unsigned maxInFlight, unsigned maxQueued);
+
+    /* Load of a wrapped function or of all functions, see Dll32To64_GetLoad(). */
+    typedef struct Dll32To64_Load
+    {
+        unsigned inFlight;            // Calls that were admitted and aren't done
+        unsigned queued;              // Calls waiting for admission
+        unsigned long long rejected;  // Calls rejected with DLL32TO64_ERROR_OVERLOADED so far
+    } Dll32To64_Load;
+
+    /**
+     * Current load of a wrapped function, e.g. to shed load before calls are rejected. The same numbers are published in
+     * the live metrics, see dll32to64-top.
+     *
+     * @param function: 0-terminated name of the wrapped function, or NULL for all functions together.
+     * @return False if there is no wrapped function of that name.
+     */
+    EXPORT bool Dll32To64_GetLoad(char const *function, Dll32To64_Load *load);
+
+    /**
+     * Asynchronous call of a wrapped function, as returned by the <Function>Async() variants in dll32to64_async.h.
+     *
+     * The call's outputs are written by the time it is done. Until then, the arguments it points to must stay valid.
+     * Every call must be released with Dll32To64_Release(), whether it is done or not.
+     */
+    typedef struct Dll32To64_Call Dll32To64_Call;
+
+    /**
+     * Invoked once a call is done.
+     *
+     * Completions run on the thread of bridge.dll that receives the responses of all calls. They must return quickly
+     * and must not wait for calls or call wrapped functions synchronously, but they may start asynchronous calls.
+     */
+    typedef void (*Dll32To64_Completion)(Dll32To64_Call *call, void *context);
+
+    // Timeout of Dll32To64_Wait() to wait until the call is done
+    unsigned const DLL32TO64_INFINITE = 0xFFFFFFFF;
+
+    /**
+     * @return True if the call is done and its outputs have been written.
+     */
+    EXPORT bool Dll32To64_IsDone(Dll32To64_Call *call);
+
+    /**
+     * Wait until a call is done. Unlike synchronous calls, the thread's deadline and the default timeouts don't apply,
+     * and the call keeps going if the wait times out.
+     *
+     * @param timeoutMs: Maximum time to wait in milliseconds, DLL32TO64_INFINITE to wait until the call is done.
+     * @return True if the call is done.
+     */
+    EXPORT bool Dll32To64_Wait(Dll32To64_Call *call, unsigned timeoutMs);
+
+    /**
+     * Invoke `completion` once the call is done. Only one completion can be set per call.
+     *
+     * @return False if the call is already done, in which case `completion` is not invoked.
+     */
+    EXPORT bool Dll32To64_OnComplete(Dll32To64_Call *call, Dll32To64_Completion completion, void *context);
+
+    /**
+     * Error of a call that is done, like Dll32To64_GetLastError() for synchronous calls.
+     */
+    EXPORT Dll32To64_Error Dll32To64_GetCallError(Dll32To64_Call *call);
+
+    /**
+     * Release a call. If it isn't done yet, it is cancelled: its outputs are no longer written and its completion is
+     * not invoked. The wrapper drops the request if it didn't start executing it yet.
+     */
+    EXPORT void Dll32To64_Release(Dll32To64_Call *call);
+
     /**
      * Shutdown the Wrapper executable.
      */
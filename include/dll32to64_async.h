@@ -0,0 +1,38 @@
+#ifndef DLL32TO64_ASYNC_H
+#define DLL32TO64_ASYNC_H
+
+#include "dll32to64.h"
+
+/*
+ * Asynchronous variants of the wrapped DLL's functions.
+ *
+ * Each takes the arguments of the original function and returns right away with a call that is pending in the wrapper,
+ * see Dll32To64_Call. Results and outputs that the original function returns are written to the pointers passed after
+ * its arguments once the call is done. A call is never NULL; if the wrapper can't be reached, it is done right away and
+ * Dll32To64_GetCallError() reports the error.
+ *
+ * Calls of all threads share one connection, so a single thread can keep many calls in flight. The wrapper executes them
+ * in the order they were started.
+ */
+// TODO: AUTOGEN
+#include "test_lib.h"
+
+extern "C" {
+EXPORT Dll32To64_Call *InvertAsync(bool input, bool *result);
+
+EXPORT Dll32To64_Call *InterleaveAsync(char const* s1, int size1, char const* s2, int size2, char* out);
+
+EXPORT Dll32To64_Call *SetCallbackAsync(TCallback cb);
+
+EXPORT Dll32To64_Call *ScaleRecordsAsync(Record* records, int count, double factor);
+
+EXPORT Dll32To64_Call *CreateBufferAsync(int size, Buffer** result);
+
+EXPORT Dll32To64_Call *WriteBufferAsync(Buffer* buffer, int offset, char const* data, int size, int* written);
+
+EXPORT Dll32To64_Call *ReadBufferAsync(Buffer* buffer, int offset, char* out, int size, int* read);
+
+EXPORT Dll32To64_Call *DestroyBufferAsync(Buffer* buffer);
+}
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef DLL32TO64_ASYNC_HPP
+#define DLL32TO64_ASYNC_HPP
+
+/*
+ * C++20 coroutine support for the asynchronous calls of dll32to64_async.h. Inside a coroutine:
+ *
+ *     bool inverted;
+ *     if (co_await dll32to64::Await(InvertAsync(true, &inverted)) != DLL32TO64_ERROR_NONE) ...
+ *
+ * A coroutine that has to wait is resumed on the thread of bridge.dll that receives responses, so the rules for
+ * completions apply to the code up to its next co_await (see Dll32To64_Completion).
+ */
+
+#include <coroutine>
+#include <utility>
+
+#include "dll32to64_async.h"
+
+namespace dll32to64 {
+
+/* Awaits a call and releases it afterwards. co_await returns the call's error. */
+class Awaitable
+{
+public:
+    explicit Awaitable(Dll32To64_Call *call) : call_(call) {}
+    Awaitable(Awaitable &&other) noexcept : call_(std::exchange(other.call_, nullptr)) {}
+    Awaitable &operator=(Awaitable &&) = delete;
+    ~Awaitable() { if (call_ != nullptr) Dll32To64_Release(call_); }
+
+    bool await_ready() const { return Dll32To64_IsDone(call_); }
+
+    bool await_suspend(std::coroutine_handle<> handle)
+    {
+        // Not suspending if the call completed in the meantime
+        return Dll32To64_OnComplete(call_, &Resume, handle.address());
+    }
+
+    Dll32To64_Error await_resume() const { return Dll32To64_GetCallError(call_); }
+
+private:
+    static void Resume(Dll32To64_Call *, void *context)
+    {
+        std::coroutine_handle<>::from_address(context).resume();
+    }
+
+    Dll32To64_Call *call_;
+};
+
+inline Awaitable Await(Dll32To64_Call *call)
+{
+    return Awaitable(call);
+}
+
+} // end namespace
+
+#endif
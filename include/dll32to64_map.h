@@ -0,0 +1,26 @@
+#ifndef DLL32TO64_MAP_H
+#define DLL32TO64_MAP_H
+
+#include "dll32to64.h"
+
+/*
+ * Map variants of the wrapped DLL's scalar functions.
+ *
+ * Each calls the original function once per element of its argument arrays and writes the results to `results`, in
+ * the same order. Arguments and results are transferred as whole arrays, so a map call costs one round trip per few
+ * thousand elements instead of one per element. The wrapper calls the function in a tight loop, split across several
+ * threads if the function is declared thread-safe (see wrapper.exe --thread-safe and --map-threads).
+ *
+ * The <Function>MapAsync() variants return right away with a pending call, like those of dll32to64_async.h. The arrays
+ * must stay valid until it is done.
+ */
+// TODO: AUTOGEN
+#include "test_lib.h"
+
+extern "C" {
+EXPORT void InvertMap(bool const* inputs, bool* results, int count);
+
+EXPORT Dll32To64_Call *InvertMapAsync(bool const* inputs, bool* results, int count);
+}
+
+#endif
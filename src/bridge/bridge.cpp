@@ -1,19 +1,86 @@
 #include "common/common.h"
+#include "common/async_log.h"
+#include "common/capture.h"
+#include "common/marshal.h"
+#include "common/metrics.h"
+#include "common/placement.h"
+#include "common/trace.h"
 
 #include <plog/Log.h>
 #include <plog/Initializers/RollingFileInitializer.h>
 
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
 #include <cstring>
 #include <cstdio>
+#include <deque>
+#include <functional>
 #include <mutex>
+#include <optional>
 #include <thread>
 #include <string>
-#include <sstream>
+#include <unordered_map>
+#include <vector>
 
 #include "dll32to64.h"
 
 // TODO: AUTOGEN
 #include "test_lib.h"
+#include "dll32to64_async.h"
+#include "dll32to64_map.h"
+
+// Name of the wrapped library in a wrapper that hosts several, set by build.py. Empty for the wrapper's first library.
+// TODO: AUTOGEN
+#ifndef DLL32TO64_LIBRARY
+#define DLL32TO64_LIBRARY ""
+#endif
+
+/*
+ * A call that was sent to the wrapper. It is referenced by the caller until it is released and by the pending calls
+ * until it is done.
+ */
+struct Dll32To64_Call
+{
+    /* What to do after a response was decoded. */
+    enum Step
+    {
+        STEP_Done,
+        STEP_Continue,  // The call sends another request, e.g. the next chunk of a large write
+        STEP_Failed,    // The response is invalid, the call fails with DLL32TO64_ERROR_PROTOCOL
+    };
+
+    /* Decodes a response into the caller's outputs. To continue, it initializes `next` with the following request. */
+    typedef std::function<Step(msg::MessageData const &response, msg::MessageData &next)> ResponseHandler;
+
+    Dll32To64_Call(msg::MsgId id, msg::Lane lane, ResponseHandler onResponse)
+        : id(id), lane(lane), onResponse(std::move(onResponse)), callScope(std::in_place, id, lane)
+    {}
+
+    msg::MsgId const id;
+    // Lane of all requests of the call
+    msg::Lane const lane;
+    ResponseHandler const onResponse;
+    // CallId of the request the call is waiting for
+    std::atomic<uint32_t> callId{0};
+    std::atomic<int> references{2};
+
+    // Guards the following members and the caller's outputs
+    std::mutex mutex;
+    std::condition_variable doneChanged;
+    bool done = false;
+    bool released = false;
+    Dll32To64_Error error = DLL32TO64_ERROR_NONE;
+    Dll32To64_Completion completion = NULL;
+    void *context = NULL;
+    std::optional<metrics::CallScope> callScope;
+    // Set once the call holds a slot of its export's and the global admission limit, see Admit()
+    bool admitted = false;
+};
 
 namespace {
 
@@ -23,383 +90,2210 @@ bool winSockStartup = false;
 SOCKET requestSocket = INVALID_SOCKET;
 // Socket to maintain callback connection
 SOCKET callbackSocket = INVALID_SOCKET;
-// Handle to wrapper.exe once it was launched
+// Handle to wrapper.exe once it was launched. Stays invalid when using a daemon.
 HANDLE wrapperProcess = INVALID_HANDLE_VALUE;
+// Transport to a wrapper.exe we start ourselves (from environment variable DLL32TO64_TRANSPORT)
+sock::Transport transport = sock::TRANSPORT_Tcp;
+// Address the wrapper listens on
+sock::Address wrapperAddress;
+// True if using the shared wrapper daemon at daemonAddress (from environment variable DLL32TO64_DAEMON_PORT or
+// DLL32TO64_DAEMON_SOCKET) instead of starting our own wrapper.exe
+bool useDaemon = false;
+sock::Address daemonAddress;
+// Number of wrapper.exe started so far, which makes their socket files unique
+unsigned wrapperStarts = 0;
+// Session the wrapper assigned to this process
+uint32_t sessionId = 0;
+// Token of the session, which the wrapper requires on the callback connection
+uint64_t sessionToken = 0;
+// True once Dll32To64_SetPlacement() was called, which overrides the environment variable DLL32TO64_PLACEMENT
+std::atomic<bool> placementSet(false);
+
+// Time to wait for our wrapper.exe to exit after its session was closed
+DWORD const WRAPPER_EXIT_TIMEOUT_MS = 5000;
+
+// Serializes ConnectWrapper() and the switch to a recycled wrapper, which both replace the connections
+std::mutex connectMutex;
+
+// Recycling policy, see Dll32To64_SetRecyclePolicy(). 0 for no limit.
+std::atomic<unsigned> recycleMaxCalls(0);
+std::atomic<unsigned> recycleMaxMemoryMb(0);
+// True once Dll32To64_SetRecyclePolicy() was called, which overrides the environment variable DLL32TO64_RECYCLE
+std::atomic<bool> recyclePolicySet(false);
+// Calls started since our wrapper.exe was started
+std::atomic<uint64_t> wrapperCalls(0);
+// Address space used by our wrapper.exe as of its last memory report, in KB
+std::atomic<uint32_t> wrapperAddressSpaceKb(0);
+// Objects of the wrapped DLL the client holds in the current session. They live in the wrapper, so it isn't recycled
+// while there are any.
+std::atomic<int> liveHandles(0);
+// Thread executing RecycleWrapper()
+std::thread recycleThread;
+// True while recycleThread runs. Guarded by connectMutex.
+bool recycling = false;
+// No new recycling is started before this time, after one failed. Guarded by connectMutex.
+std::chrono::steady_clock::time_point nextRecycle;
+// Time to wait for the calls sent to a wrapper that is being replaced
+std::chrono::milliseconds const RECYCLE_DRAIN_TIMEOUT(10000);
+// Time to wait before trying again after recycling failed
+std::chrono::milliseconds const RECYCLE_RETRY_DELAY(5000);
 
 // User defined callback functions
 // TODO: AUTOGEN
 TCallback callback = NULL;
 
+// Layouts of structs passed to the wrapped DLL
+// TODO: AUTOGEN
+msg::StructLayout const recordLayout({{msg::FIELD_SizeT}, {msg::FIELD_Double}, {msg::FIELD_Long}, {msg::FIELD_SizeT}});
+
 // Thread executing CallbackTask
 std::thread callbackThread;
 
-bool ConnectToWrapper(SOCKET &socket, int port)
-{
-    PLOG_INFO << "Establishing Socket connection to wrapper on port " << port;
-
-    if (INVALID_SOCKET != socket)
-    {
-        closesocket(socket);
-        socket = INVALID_SOCKET;
-    }
-
-    if (!sock::CreateSocket(socket))
-    {
-        return false;
-    }
-
-	sockaddr_in hint;
-	hint.sin_family = AF_INET;
-	hint.sin_port = htons(port);
-	inet_pton(AF_INET, sock::ipAddress, &hint.sin_addr);
+// CallId of the next request sent to the wrapper. 0 is reserved for "no call".
+std::atomic<uint32_t> nextCallId(1);
 
-	int connResult = connect(socket, (sockaddr*)&hint, sizeof(hint));
-	if (connResult == SOCKET_ERROR)
-	{
-        PLOG_ERROR << "Can't connect to wrapper exe on port " << port << ", Err: " << WSAGetLastError();
-		closesocket(socket);
-        socket = INVALID_SOCKET;
-		return false;
-	}
-
-    return true;
-}
+// Guards requestSocket and sending on it. Requests of all threads are sent on the same connection without waiting for
+// the responses of earlier ones.
+std::mutex sendMutex;
 
-/* Connect to Wrapper via callbackPort and wait for forwarded Callback executions. */
-void CallbackTask()
+/* A call waiting for admission or a credit, with its next request. */
+struct QueuedCall
 {
-    PLOG_INFO << "Starting Callback Thread";
-
-    if (!sock::StartupWinSock())
+    Dll32To64_Call *call;
+    msg::MessageData message;
+};
+
+/*
+ * Order in which threads get to send requests: Control requests go before bulk requests that wait for their turn.
+ * Senders only take turns if they have to wait, so this adds no wait to an idle connection.
+ *
+ * Every request also takes one of the credits the wrapper granted the session (see msg::StaticData::Hello), which its
+ * response returns. A request without a credit is parked instead of blocking its caller, and the response thread sends
+ * it once a response returns a credit. Parked control requests go first.
+ */
+class SendTurns
+{
+public:
+    /*
+     * Take a credit and wait for our turn. Returns false if there is no credit left, or earlier requests of the lane are
+     * parked already. Then, `request` is parked and must not be sent.
+     */
+    bool Take(msg::Lane lane, QueuedCall const &request)
     {
-        PLOG_WARNING << "Exiting Callback Thread due to previous error";
-        return;
-    }
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (limit_ != 0 && (credits_ <= 0 || !parked_[msg::LANE_Control].empty() || !parked_[lane].empty()))
+        {
+            parked_[lane].push_back(request);
+            return false;
+        }
 
-    if (!ConnectToWrapper(callbackSocket, sock::callbackPort))
-    {
-        WSACleanup();
-        PLOG_WARNING << "Exiting Callback Thread due to previous error";
-        return;
+        if (limit_ != 0) metrics::SetCredits(--credits_, limit_);
+        WaitForTurn(lock, lane);
+        return true;
     }
 
-    char incoming[msg::MSG_MAX_SIZE];
-    while (true)
+    void Give()
     {
-        int recvBytes;
-        if (!sock::Receive(callbackSocket, incoming, sizeof(incoming), recvBytes))
+        bool others;
         {
-            PLOG_INFO << "Stop waiting for callbacks because connection was closed";
-            break;
+            std::lock_guard<std::mutex> guard(mutex_);
+            busy_ = false;
+            others = waiting_[msg::LANE_Control] + waiting_[msg::LANE_Bulk] > 0;
         }
+        if (others) turnChanged_.notify_all();
+    }
 
-        msg::MessageData message;
-        if (!msg::ParseMessage(message, msg::DIRECTION_Response, incoming, sizeof(incoming)))
+    /*
+     * Return the credit of a response received on socket. Credits of an earlier connection are ignored. If a request is
+     * parked, it takes the credit and our turn, and is moved to `next`. Then, the caller must send it and Give().
+     */
+    bool ReturnCredit(SOCKET socket, QueuedCall &next)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (socket != socket_ || limit_ == 0) return false;
+
+        msg::Lane const lane = parked_[msg::LANE_Control].empty() ? msg::LANE_Bulk : msg::LANE_Control;
+        if (parked_[lane].empty())
         {
-            continue;
+            metrics::SetCredits(++credits_, limit_);
+            return false;
         }
 
-        PLOG_DEBUG << "Callback " << message.id;
+        next = std::move(parked_[lane].front());
+        parked_[lane].pop_front();
+        WaitForTurn(lock, lane);
+        return true;
+    }
 
-        switch (message.id)
+    /* Remove a parked request of the call. Returns false if none is parked. */
+    bool Unpark(Dll32To64_Call *call)
+    {
+        std::lock_guard<std::mutex> guard(mutex_);
+        for (auto &parked : parked_)
         {
-            case msg::MSGID_Callback:
+            auto const it = std::find_if(parked.begin(), parked.end(),
+                                         [call](QueuedCall const &queued) { return queued.call == call; });
+            if (it != parked.end())
             {
-                if (callback != NULL)
-                {
-                    callback(message.staticData.CallbackResponse.val);
-                }
-            } break;
-            default:
-                break;
+                parked.erase(it);
+                return true;
+            }
         }
+        return false;
     }
 
-    if (callbackSocket != INVALID_SOCKET)
+    /*
+     * Start counting the credits granted on a new request connection, 0 for none. Parked requests are dropped; their
+     * calls are still pending and fail with the connection they were started on.
+     */
+    void Reset(SOCKET socket, uint32_t credits)
     {
-        closesocket(callbackSocket);
-        callbackSocket = INVALID_SOCKET;
+        std::lock_guard<std::mutex> guard(mutex_);
+        socket_ = socket;
+        limit_ = credits;
+        credits_ = credits;
+        for (auto &parked : parked_) parked.clear();
+        metrics::SetCredits(credits_, limit_);
     }
 
-    WSACleanup();
-}
+private:
+    void WaitForTurn(std::unique_lock<std::mutex> &lock, msg::Lane lane)
+    {
+        waiting_[lane]++;
+        turnChanged_.wait(lock, [this, lane]
+        {
+            return !busy_ && (lane == msg::LANE_Control || waiting_[msg::LANE_Control] == 0);
+        });
+        waiting_[lane]--;
+        busy_ = true;
+    }
 
-bool EnsureWrapperConnection()
+    std::mutex mutex_;
+    std::condition_variable turnChanged_;
+    bool busy_ = false;
+    unsigned waiting_[msg::LANE_COUNT] = {};
+    // Request connection the credits were granted for
+    SOCKET socket_ = INVALID_SOCKET;
+    // Credits granted by the wrapper, 0 for no flow control, and credits left
+    uint32_t limit_ = 0;
+    int64_t credits_ = 0;
+    // Requests waiting for a credit per lane, in the order they were started
+    std::deque<QueuedCall> parked_[msg::LANE_COUNT];
+};
+
+SendTurns sendTurns;
+// Thread executing ResponseTask for the current request connection
+std::thread responseThread;
+// True on the response thread, which runs the completions of calls
+thread_local bool isResponseThread = false;
+
+// Calls waiting for a response, by CallId
+std::mutex pendingMutex;
+std::unordered_map<uint32_t, Dll32To64_Call*> pendingCalls;
+// Notified when the last pending call is done, see RecycleWrapper()
+std::condition_variable pendingDrained;
+// Request connection of a wrapper that was replaced after it answered all calls. Its response thread doesn't fail the
+// calls that are pending by then, which were sent to the new one. Guarded by sendMutex.
+SOCKET retiredRequestSocket = INVALID_SOCKET;
+
+using Clock = std::chrono::steady_clock;
+
+// Deadline for calls of the current thread, see Dll32To64_SetDeadline()
+thread_local Clock::time_point threadDeadline = Clock::time_point::max();
+// Outcome of the current thread's last call, see Dll32To64_GetLastError()
+thread_local Dll32To64_Error callError = DLL32TO64_ERROR_NONE;
+/* True for the MsgIds of wrapped functions, the only ones clients can name, e.g. in Dll32To64_SetLane(). */
+// TODO: AUTOGEN
+bool IsExport(unsigned id)
 {
-    // This function accesses/modifies some persistent state so we only allow execution of it
-    // by a single thread at a time
-    static std::mutex mut;
-    std::lock_guard<std::mutex> guard(mut);
+    return id < msg::MSGID_Callback || id == msg::MSGID_InvertMap;
+}
 
-    if (!winSockStartup)
+/* MsgId of the wrapped function with the given name. Returns false for an unknown function. */
+bool FindExport(char const *function, unsigned &id)
+{
+    for (id = 0; id <= msg::MSGID_LAST; id++)
     {
-        // We need to do this once after the DLL was loaded
-        if (!sock::StartupWinSock())
-        {
-            return false;
-        }
-        winSockStartup = true;
+        if (IsExport(id) && std::strcmp(function, msg::MsgIdName((msg::MsgId)id)) == 0) return true;
     }
+    return false;
+}
 
-    // Check if wrapper exe is already running
-    bool wasRunning = false;
-    if (wrapperProcess != INVALID_HANDLE_VALUE)
-    {
-        DWORD exitCode;
-        if (!GetExitCodeProcess(wrapperProcess, &exitCode))
-        {
-            int const lastError = GetLastError();
-            PLOG_ERROR << "GetExitCodeProcess() Error: " << lastError;
-            return false;
-        }
+// Timeout of every call per MsgId in ms, 0 for none
+std::atomic<unsigned> defaultTimeoutMs[msg::MSGID_LAST + 1] = {};
+// Terminate wrapper.exe when a call times out
+std::atomic<bool> restartOnTimeout(false);
+// Lane of the calls per MsgId, see Dll32To64_SetLane()
+std::atomic<msg::Lane> exportLanes[msg::MSGID_LAST + 1];
 
-        if (STILL_ACTIVE == exitCode)
-        {
-            wasRunning = true;
-        }
-        else
-        {
-            PLOG_INFO << "Wrapper exited with exitcode " << exitCode;
-            WaitForSingleObject(wrapperProcess, INFINITE);
-            CloseHandle(wrapperProcess);
-            wrapperProcess = INVALID_HANDLE_VALUE;
-        }
+bool InitLanes()
+{
+    for (unsigned id = 0; id <= msg::MSGID_LAST; id++)
+    {
+        exportLanes[id].store(msg::DefaultLane((msg::MsgId)id));
     }
+    return true;
+}
 
-    if (!wasRunning)
-    {
-        PLOG_INFO << "Starting Wrapper";
+bool const lanesInitialized = InitLanes();
 
-        // First, get full path to directory where this DLL lies
-        // See https://stackoverflow.com/a/6924332
-        HMODULE hm = NULL;
-        if (!GetModuleHandleExA(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT,
-                               (LPCSTR)&Dll32To64_EnableLogging, &hm))
-        {
-            int const lastError = GetLastError();
-            PLOG_ERROR << "GetModuleHandleEx() Error: " << lastError;
-            return false;
-        }
-        static char path[4096];
-        if (!GetModuleFileNameA(hm, path, sizeof(path)))
-        {
-            int const lastError = GetLastError();
-            PLOG_ERROR << "GetModuleFileName() Error: " << lastError;
-            return false;
-        }
+msg::Lane LaneOf(msg::MsgId id)
+{
+    return exportLanes[id].load(std::memory_order_relaxed);
+}
 
-        // Remove Filename from path
-        std::string const pathS(path);
-        int const lastSlashPos = pathS.find_last_of("\\/");
+/* Admission limit of the calls of an export or of all calls together, see Dll32To64_SetAdmissionLimit(). */
+struct AdmissionLimit
+{
+    // Calls that may be in flight, 0 for no limit, and calls that may wait for admission beyond that
+    std::atomic<unsigned> maxInFlight{0};
+    std::atomic<unsigned> maxQueued{0};
+    // Calls that were admitted and aren't done, calls waiting for admission and calls that were turned away
+    std::atomic<unsigned> inFlight{0};
+    std::atomic<unsigned> queued{0};
+    std::atomic<uint64_t> rejected{0};
+};
+
+// Admission limits per MsgId and of all calls together
+AdmissionLimit exportAdmission[msg::MSGID_LAST + 1];
+AdmissionLimit totalAdmission;
+// Set once a limit was configured. Until then, calls are only counted, without taking admissionMutex.
+std::atomic<bool> admissionLimited(false);
+// Guards admissionQueue and the admission of calls while admissionLimited is set
+std::mutex admissionMutex;
+// Calls waiting for admission, in the order they were started
+std::deque<QueuedCall> admissionQueue;
+// Calls the current thread is sending after they were admitted, see SendAdmittedCalls()
+thread_local std::deque<QueuedCall> *sendingAdmitted = nullptr;
+
+// Wrapped function that can be served by a local implementation, see Dll32To64_SetShimMode()
+struct Shim
+{
+    bool available = false;
+    std::atomic<int> mode{DLL32TO64_SHIM_OFF};
+    // Calls left to compare in DLL32TO64_SHIM_VERIFY mode
+    std::atomic<int> verifyRemaining{0};
+};
+Shim shims[msg::MSGID_LAST + 1];
+
+// Directory where trace files are written, empty if tracing is disabled
+char traceDir[LOG_DIR_MAXLEN] = "";
+// True if tracing has been started in the currently running wrapper
+bool wrapperTracing = false;
+
+// File names of the merged trace and the wrapper's part of it inside traceDir
+char const traceFileName[] = "/dll32to64.trace.json";
+char const wrapperTraceFileName[] = "/dll32to64_wrapper.trace.part";
+
+bool SendAndWaitForResponse(msg::MessageData &message, msg::MessageData &response);
+void ReleaseAdmission(Dll32To64_Call *call);
+
+bool ConnectToWrapper(SOCKET &socket, sock::Address const &address)
+{
+    ALOG_INFO("Establishing Socket connection to wrapper on {}", sock::ToString(address).c_str());
 
-        // Append exe name to path
-        // TODO: Respect different filename depending on wrapping direction
-        std::strcpy(&path[lastSlashPos + 1], "wrapper.exe");
+    if (INVALID_SOCKET != socket)
+    {
+        closesocket(socket);
+        socket = INVALID_SOCKET;
+    }
 
-        PLOG_DEBUG << "Running " << path;
+    if (!sock::Connect(socket, address))
+    {
+        ALOG_ERROR("Can't connect to wrapper exe on {}", sock::ToString(address).c_str());
+        return false;
+    }
 
-        STARTUPINFOA si = {};
-        PROCESS_INFORMATION pi = {};
+    return true;
+}
 
-        if (!CreateProcessA(path,
-                NULL,
-                NULL,
-                NULL,
-                false,
-                0,
-                NULL,
-                NULL,
-                &si,
-                &pi
-            )
-        )
-        {
-            int const lastError = GetLastError();
-            PLOG_ERROR << "CreateProcess() Error: " << lastError;
-            return false;
-        }
+/* Send a request on a connection that has no response thread yet and receive its response. */
+bool Exchange(SOCKET socket, msg::MessageData const &message, msg::MessageData &response)
+{
+    char buf[msg::MSG_MAX_SIZE];
+    int size;
+    msg::SerializeMessage(message, buf, size);
+    return sock::Send(socket, buf, size) && sock::ReceiveFrame(socket, buf, sizeof(buf), size) &&
+           msg::ParseMessage(response, msg::DIRECTION_Response, buf, size) && response.id == message.id;
+}
 
-        wrapperProcess = pi.hProcess;
-        CloseHandle(pi.hThread);  // Don't need this handle
+/*
+ * Send the Hello message that identifies a new connection to the wrapper.
+ *
+ * The request connection opens a new session for DLL32TO64_LIBRARY, whose id is stored in `session` and the credits the
+ * wrapper granted it in `credits`. The callback connection joins that session.
+ */
+bool Handshake(SOCKET socket, msg::Channel channel, uint32_t &session, uint64_t &token, uint32_t *credits = nullptr)
+{
+    msg::MessageData message = {};
+    msg::InitMessageData(message, msg::MSGID_Hello, msg::DIRECTION_Request);
+    message.staticData.Hello.sessionId = channel == msg::CHANNEL_Request ? 0 : session;
+    message.staticData.Hello.token = channel == msg::CHANNEL_Request ? 0 : token;
+    message.staticData.Hello.clientPid = GetCurrentProcessId();
+    message.staticData.Hello.channel = channel;
+    if (channel == msg::CHANNEL_Request)
+    {
+        int const libraryLen = sizeof(DLL32TO64_LIBRARY) - 1;
+        std::memcpy(&message.variableData[0], DLL32TO64_LIBRARY, libraryLen);
+        message.staticData.Hello.library.byte_offset = 0;
+        message.staticData.Hello.library.byte_length = libraryLen;
+        message.variableDataLength = libraryLen;
     }
 
-    // (Re)connect to wrapper if it was just started or we don't have a socket handle yet
-    if (!wasRunning || requestSocket == INVALID_SOCKET)
+    msg::MessageData response = {};
+    if (!Exchange(socket, message, response))
     {
-        if (!ConnectToWrapper(requestSocket, sock::requestPort))
-        {
-            return false;
-        }
+        ALOG_ERROR("Wrapper refused connection for session {}", message.staticData.Hello.sessionId);
+        return false;
     }
 
-    // Same for callback connection
-    if (!wasRunning || callbackSocket == INVALID_SOCKET)
+    if (channel == msg::CHANNEL_Request)
     {
-        if (callbackThread.joinable())
-        {
-            PLOG_INFO << "Joining Callback Thread";
-            callbackThread.join();
-        }
-
-        callbackThread = std::thread(CallbackTask);
+        session = response.staticData.HelloResponse.sessionId;
+        token = response.staticData.HelloResponse.token;
+        if (credits != nullptr) *credits = response.staticData.HelloResponse.credits;
+        metrics::SetPeerPid(response.staticData.HelloResponse.wrapperPid);
+        ALOG_INFO("Opened session {} in wrapper process {}", session, response.staticData.HelloResponse.wrapperPid);
     }
 
     return true;
 }
 
-bool SendAndWaitForResponse(msg::MessageData const &message, msg::MessageData &response)
+/* Invoke the client's function for a callback forwarded by the wrapper. */
+// TODO: AUTOGEN
+void DispatchCallback(msg::MessageData const &message)
 {
-    static char messageBuffer[msg::MSG_MAX_SIZE];
-    static char responseBuffer[msg::MSG_MAX_SIZE];
+    trace::Span span("Callback", message.callId);
+    trace::FlowStep(message.callId, span.Start());
+
+    switch (message.id)
+    {
+        case msg::MSGID_Callback:
+        {
+            if (callback != NULL)
+            {
+                callback(message.staticData.CallbackResponse.val);
+            }
+        } break;
+        default:
+            break;
+    }
+    metrics::CallbackDelivered();
+}
 
-    // Ensure that only one thread at a time can send a message and wait for its response
-    static std::mutex mut;
-    std::lock_guard<std::mutex> guard(mut);
+/*
+ * Wait for Callback executions forwarded by the wrapper on a callback connection, until it is closed.
+ *
+ * Each callback is dispatched as soon as it was received. The ones that arrive meanwhile wait in the socket, which holds
+ * back the wrapper once it is full.
+ *
+ * @param replayedRequests: Requests the session started with, which ReplayRegistrations() replayed from the previous
+ *                          one. The client got the callbacks they fire from the previous session already.
+ */
+void CallbackTask(SOCKET socket, uint32_t replayedRequests)
+{
+    ALOG_INFO("Starting Callback Thread");
 
-    PLOG_DEBUG << "Sending Messsage " << message.id;
+    if (!placement::Apply(placement::ROLE_BridgeDispatcher))
+    {
+        ALOG_WARNING("Could not place Callback Thread, Err: {}", GetLastError());
+    }
 
-    int messageSize;
-    msg::SerializeMessage(message, messageBuffer, messageSize);
-    if (!sock::Send(requestSocket, messageBuffer, messageSize))
+    if (!sock::StartupWinSock())
     {
-        return false;
+        ALOG_WARNING("Exiting Callback Thread due to previous error");
+        return;
     }
 
+    char incoming[msg::MSG_MAX_SIZE];
     while (true)
     {
         int recvBytes;
-        if (!sock::Receive(requestSocket, responseBuffer, sizeof(responseBuffer), recvBytes))
+        if (!sock::ReceiveFrame(socket, incoming, sizeof(incoming), recvBytes))
         {
-            return false;
+            ALOG_INFO("Stop waiting for callbacks because connection was closed");
+            break;
         }
 
-        if (!msg::ParseMessage(response, msg::DIRECTION_Response, responseBuffer, sizeof(responseBuffer)))
+        capture::Record(capture::RECORD_Callback, incoming, recvBytes);
+
+        msg::MessageData message;
+        if (!msg::ParseMessage(message, msg::DIRECTION_Response, incoming, recvBytes))
         {
-            return false;
+            continue;
+        }
+
+        if (message.id == msg::MSGID_MemoryReport)
+        {
+            auto const &report = message.staticData.MemoryReportResponse;
+            ALOG_DEBUG("Wrapper uses {} KB working set, {} KB private, {} of {} KB address space", report.workingSetKb,
+                       report.privateKb, report.addressSpaceUsedKb, report.addressSpaceTotalKb);
+            // A replaced wrapper may still report while its last calls drain
+            if (socket == callbackSocket) wrapperAddressSpaceKb.store(report.addressSpaceUsedKb);
+            continue;
+        }
+
+        // TODO: AUTOGEN (one per callback type)
+        if (message.id == msg::MSGID_Callback && message.staticData.CallbackResponse.requests <= replayedRequests)
+        {
+            ALOG_DEBUG("Dropping callback {} fired by a replayed request", message.id);
+            continue;
         }
 
-        PLOG_DEBUG << "Received Response " << response.id;
+        ALOG_DEBUG("Callback {} (call {})", message.id, message.callId);
+        metrics::CallbackQueued();
 
-        if (response.id != message.id)
+        // The callbacks behind this one are waiting in the socket
+        u_long unreadBytes = 0;
+        if (ioctlsocket(socket, FIONREAD, &unreadBytes) == 0)
         {
-            PLOG_ERROR <<  "Waiting for MsgId " << message.id << ", but received " << response.id;
-            return false;
+            metrics::CallbacksUnread(unreadBytes / (msg::MSG_HEADER_SIZE + sizeof(message.staticData.CallbackResponse)));
         }
 
-        return true;
+        DispatchCallback(message);
     }
-}
+    metrics::CallbacksUnread(0);
 
-template <typename T>
-std::string StringifyArray(const T* arr, size_t num)
-{
-    std::ostringstream stream(std::ios_base::ate | std::ios_base::out);
+    // Unless the wrapper was replaced in the meantime
+    if (callbackSocket == socket) callbackSocket = INVALID_SOCKET;
+    closesocket(socket);
 
-    stream << "[";
+    WSACleanup();
+}
 
-    for (unsigned i = 0; i < num; i++)
-    {
-        stream << arr[i] << ", ";
-    }
+/* Close the request connection. Must hold sendMutex. The response thread closes the handle once it stopped receiving. */
+void CloseRequestSocket()
+{
+    if (requestSocket == INVALID_SOCKET) return;
 
-    stream << "]";
+    ALOG_WARNING("Closing session {}", sessionId);
+    shutdown(requestSocket, SD_BOTH);
+    requestSocket = INVALID_SOCKET;
+    // Requests waiting for credits are dropped, their calls fail with the connection
+    sendTurns.Reset(INVALID_SOCKET, 0);
+}
 
-    return stream.str();
+/*
+ * Give up the session after a transport or protocol error. The wrapper ends the session when the connection closes, and
+ * the next call opens a new one.
+ */
+void DropSession()
+{
+    std::lock_guard<std::mutex> guard(sendMutex);
+    CloseRequestSocket();
 }
 
-template <size_t N>
-std::string StringifyArrayOfStrings(const char (*arr)[N], size_t num)
+bool IsConnected()
 {
-    std::ostringstream stream(std::ios_base::ate | std::ios_base::out);
+    std::lock_guard<std::mutex> guard(sendMutex);
+    return requestSocket != INVALID_SOCKET;
+}
 
-    stream << "[";
+uint32_t NextCallId()
+{
+    uint32_t callId = nextCallId.fetch_add(1);
+    if (callId == 0) callId = nextCallId.fetch_add(1);
+    return callId;
+}
 
-    for (unsigned i = 0; i < num; i++)
+void ReleaseReference(Dll32To64_Call *call)
+{
+    if (call->references.fetch_sub(1) == 1)
     {
-        stream << std::string(arr[i], strnlen(arr[i], N)) << ", ";
+        delete call;
     }
-
-    stream << "]";
-
-    return stream.str();
 }
 
-} // end anonymous namespace
+/* Remove a call from the pending calls. Returns nullptr if no call waits for callId. */
+Dll32To64_Call *TakePendingCall(uint32_t callId)
+{
+    std::lock_guard<std::mutex> guard(pendingMutex);
+    auto const it = pendingCalls.find(callId);
+    if (it == pendingCalls.end()) return nullptr;
+
+    Dll32To64_Call *const call = it->second;
+    pendingCalls.erase(it);
+    if (pendingCalls.empty()) pendingDrained.notify_all();
+    return call;
+}
 
-bool Dll32To64_EnableLogging(char const *path)
+/* Mark a call that is no longer pending as done and invoke its completion. */
+void CompleteCall(Dll32To64_Call *call, Dll32To64_Error error)
 {
-    if (path == nullptr)
+    // Free the call's slot before the caller learns that it is done, so it can start its next call right away
+    if (call->admitted) ReleaseAdmission(call);
+
+    Dll32To64_Completion completion;
+    void *context;
     {
-        return false;
+        std::lock_guard<std::mutex> guard(call->mutex);
+        call->error = error;
+        call->done = true;
+        if (error == DLL32TO64_ERROR_NONE) call->callScope->Succeeded();
+        call->callScope.reset();
+        completion = call->completion;
+        context = call->context;
     }
+    call->doneChanged.notify_all();
 
-    unsigned const pathLen = strnlen(path, LOG_DIR_MAXLEN);
+    if (completion != NULL) completion(call, context);
+    ReleaseReference(call);
+}
 
-    if (LOG_DIR_MAXLEN == pathLen)
+/* Complete all pending calls after the request connection was closed. */
+void FailPendingCalls(Dll32To64_Error error)
+{
+    std::unordered_map<uint32_t, Dll32To64_Call*> failed;
     {
-        // Path is not 0-terminated
-        return false;
+        std::lock_guard<std::mutex> guard(pendingMutex);
+        failed.swap(pendingCalls);
     }
+    pendingDrained.notify_all();
 
-    char const logFileName[] = "/dll32to64.log";
+    for (auto const &entry : failed)
+    {
+        CompleteCall(entry.second, error);
+    }
+}
 
-    char fullPath[LOG_DIR_MAXLEN + sizeof(logFileName)];
-    strcpy(fullPath, path);
+/*
+ * Send a request that took a credit and our turn, see SendTurns. If that fails, its call is done. The call may be done
+ * and released by another thread already, so only its pending entry is used.
+ */
+void TransmitRequest(msg::MessageData const &message)
+{
+    ALOG_DEBUG("Sending Messsage {} (call {})", message.id, message.callId);
 
-    // Append logfile name to path
-    std::strcpy(&fullPath[pathLen], logFileName);
+    trace::Span span(msg::MsgIdName(message.id), message.callId);
+    trace::FlowStart(message.callId, span.Start());
 
-#if DEBUG == 1
-    plog::Severity const severity = plog::debug;
-#else
-    plog::Severity const severity = plog::info;
-#endif
+    char buffer[msg::MSG_MAX_SIZE];
+    int size;
+    msg::SerializeMessage(message, buffer, size);
+    capture::Record(capture::RECORD_Request, buffer, size);
 
-    // Rotate up to 10 logfiles of 10MB each
-    plog::init(severity, fullPath, 10000000, 10);
+    bool sent;
+    {
+        std::lock_guard<std::mutex> guard(sendMutex);
+        // The session may have been dropped by another thread's call since we connected
+        sent = requestSocket != INVALID_SOCKET && sock::Send(requestSocket, buffer, size);
+        if (!sent) CloseRequestSocket();
+    }
+    sendTurns.Give();
 
-    printf("dll32to64 Logfile: %s\n", fullPath);
-    return true;
+    // Unless the response thread already failed it
+    Dll32To64_Call *const call = sent ? nullptr : TakePendingCall(message.callId);
+    if (call != nullptr)
+    {
+        CompleteCall(call, DLL32TO64_ERROR_CONNECTION);
+    }
 }
 
-void Dll32To64_Shutdown()
+/*
+ * Send a request of the call. If that fails, the call is done. Without a credit, the request is parked and sent by the
+ * response thread, so callers never wait for the wrapper here.
+ */
+void SendRequest(Dll32To64_Call *call, msg::MessageData &message)
 {
-    PLOG_INFO << "Shutdown";
+    message.lane = call->lane;
+    message.callId = NextCallId();
+    call->callId.store(message.callId);
 
-    // This will initiate shutdown in wrapper.exe
-    if (requestSocket != INVALID_SOCKET) closesocket(requestSocket);
-
-    // Wait until wrapper has shut down (peer will close callback connection)
-    if (wrapperProcess != INVALID_HANDLE_VALUE)
+    // The response may arrive before Send() returns
     {
-        WaitForSingleObject(wrapperProcess, INFINITE);
-        CloseHandle(wrapperProcess);
+        std::lock_guard<std::mutex> guard(pendingMutex);
+        pendingCalls[message.callId] = call;
     }
 
-    // Callback thread should have exited know and join immediately
-    if (callbackThread.joinable()) callbackThread.join();
-
-    WSACleanup();
+    if (sendTurns.Take(call->lane, QueuedCall{call, message})) TransmitRequest(message);
 }
 
+/* True if the limit allows another call in flight. */
+bool HasRoom(AdmissionLimit const &limit)
+{
+    unsigned const max = limit.maxInFlight.load();
+    return max == 0 || limit.inFlight.load() < max;
+}
 
-// wrapped dll implementation
-// TODO: AUTOGEN
+/* Count an admitted call against its export's and the global limit. */
+void TakeSlots(Dll32To64_Call *call)
+{
+    exportAdmission[call->id].inFlight++;
+    totalAdmission.inFlight++;
+    call->admitted = true;
+}
 
-bool Invert(bool input) {
-    if (!EnsureWrapperConnection()) return false;
+/* Admit the queued calls that fit the limits now, in the order they were started. Must hold admissionMutex. */
+void AdmitQueuedCalls(std::deque<QueuedCall> &admitted)
+{
+    for (auto it = admissionQueue.begin(); it != admissionQueue.end() && HasRoom(totalAdmission); )
+    {
+        AdmissionLimit &limit = exportAdmission[it->call->id];
+        if (!HasRoom(limit))
+        {
+            ++it;
+            continue;
+        }
 
-    msg::MessageData message = {};
-    msg::InitMessageData(message, msg::MSGID_Invert, msg::DIRECTION_Request);
-    message.staticData.Invert.input = input;
+        limit.queued--;
+        totalAdmission.queued--;
+        metrics::Dequeued(it->call->id);
+        TakeSlots(it->call);
+        admitted.push_back(std::move(*it));
+        it = admissionQueue.erase(it);
+    }
+}
 
-    msg::MessageData response = {};
-    if (!SendAndWaitForResponse(message, response)) return false;
-    return response.staticData.InvertResponse;
+/*
+ * Send the first requests of calls admitted by AdmitQueuedCalls(), without holding admissionMutex. Calls that are
+ * admitted while we send, because one of ours failed right away, are appended instead of sent recursively.
+ */
+void SendAdmittedCalls(std::deque<QueuedCall> &admitted)
+{
+    std::deque<QueuedCall> *const outer = sendingAdmitted;
+    sendingAdmitted = &admitted;
+    while (!admitted.empty())
+    {
+        QueuedCall next = std::move(admitted.front());
+        admitted.pop_front();
+        SendRequest(next.call, next.message);
+    }
+    sendingAdmitted = outer;
 }
 
-void Interleave(char const* s1, int size1, char const* s2, int size2, char* out) {
-    if (!EnsureWrapperConnection()) return;
+/*
+ * Decide whether a call may be sent now, see Dll32To64_SetAdmissionLimit(). A call that exceeds its export's or the
+ * global limit waits in admissionQueue until calls are done, unless that limit's queue is full. Then, it is rejected
+ * right away with DLL32TO64_ERROR_OVERLOADED rather than adding to a backlog that would only time out.
+ *
+ * @return True if the call was admitted and its request must be sent.
+ */
+bool Admit(Dll32To64_Call *call, msg::MessageData const &message)
+{
+    if (!admissionLimited.load(std::memory_order_relaxed))
+    {
+        TakeSlots(call);
+        return true;
+    }
+
+    AdmissionLimit &limit = exportAdmission[call->id];
+    {
+        std::lock_guard<std::mutex> guard(admissionMutex);
+        // Calls don't overtake earlier calls of their export that wait for admission
+        bool const exportWaits = limit.maxInFlight.load() != 0 && (!HasRoom(limit) || limit.queued.load() > 0);
+        bool const totalWaits = !HasRoom(totalAdmission);
+        if (!exportWaits && !totalWaits)
+        {
+            TakeSlots(call);
+            return true;
+        }
+
+        bool const full = (exportWaits && limit.queued.load() >= limit.maxQueued.load()) ||
+                          (totalWaits && totalAdmission.queued.load() >= totalAdmission.maxQueued.load());
+        if (!full)
+        {
+            limit.queued++;
+            totalAdmission.queued++;
+            metrics::Queued(call->id);
+            admissionQueue.push_back(QueuedCall{call, message});
+            return false;
+        }
+
+        limit.rejected++;
+        totalAdmission.rejected++;
+    }
+
+    ALOG_DEBUG("Rejecting call of {}, too many calls in flight", msg::MsgIdName(call->id));
+    metrics::Rejected(call->id);
+    CompleteCall(call, DLL32TO64_ERROR_OVERLOADED);
+    return false;
+}
+
+/* Free the slots of a call that is done and send the queued calls that fit now. */
+void ReleaseAdmission(Dll32To64_Call *call)
+{
+    call->admitted = false;
+    if (!admissionLimited.load(std::memory_order_relaxed))
+    {
+        exportAdmission[call->id].inFlight--;
+        totalAdmission.inFlight--;
+        return;
+    }
+
+    std::deque<QueuedCall> admitted;
+    {
+        std::lock_guard<std::mutex> guard(admissionMutex);
+        exportAdmission[call->id].inFlight--;
+        totalAdmission.inFlight--;
+        if (!admissionQueue.empty()) AdmitQueuedCalls(sendingAdmitted != nullptr ? *sendingAdmitted : admitted);
+    }
+    SendAdmittedCalls(admitted);
+}
+
+/* Remove a call that waits for admission from the queue. Returns false if it isn't queued. */
+bool UnqueueCall(Dll32To64_Call *call)
+{
+    std::lock_guard<std::mutex> guard(admissionMutex);
+    auto const it = std::find_if(admissionQueue.begin(), admissionQueue.end(),
+                                 [call](QueuedCall const &queued) { return queued.call == call; });
+    if (it == admissionQueue.end()) return false;
+
+    exportAdmission[call->id].queued--;
+    totalAdmission.queued--;
+    metrics::Dequeued(call->id);
+    admissionQueue.erase(it);
+    return true;
+}
+
+/* Admission limit of a wrapped function, or the global one for NULL. Returns nullptr for an unknown function. */
+AdmissionLimit *FindAdmissionLimit(char const *function)
+{
+    if (function == nullptr) return &totalAdmission;
+
+    unsigned id;
+    return FindExport(function, id) ? &exportAdmission[id] : nullptr;
+}
+
+/* Decode a response into the outputs of its call. Returns false if it doesn't match the call. */
+bool HandleResponse(msg::MessageData const &response)
+{
+    Dll32To64_Call *const call = TakePendingCall(response.callId);
+    if (call == nullptr)
+    {
+        // The call has been cancelled
+        ALOG_INFO("Discarding late response {} (call {})", response.id, response.callId);
+        return true;
+    }
+
+    if (response.id == msg::MSGID_Error)
+    {
+        ALOG_ERROR("Wrapper rejected the arguments of MsgId {} (call {})", call->id, response.callId);
+        CompleteCall(call, DLL32TO64_ERROR_ARGUMENTS);
+        return true;
+    }
+
+    if (response.id != call->id)
+    {
+        ALOG_ERROR("Waiting for MsgId {} (call {}), but received {}", call->id, response.callId, response.id);
+        CompleteCall(call, DLL32TO64_ERROR_PROTOCOL);
+        return false;
+    }
+
+    trace::Span span("Response", response.callId);
+    trace::FlowStep(response.callId, span.Start());
+
+    Dll32To64_Call::Step step = Dll32To64_Call::STEP_Done;
+    msg::MessageData next;
+    {
+        // A released call's outputs may not be valid anymore
+        std::lock_guard<std::mutex> guard(call->mutex);
+        if (!call->released) step = call->onResponse(response, next);
+    }
+
+    if (step == Dll32To64_Call::STEP_Continue)
+    {
+        SendRequest(call, next);
+    }
+    else
+    {
+        CompleteCall(call, step == Dll32To64_Call::STEP_Failed ? DLL32TO64_ERROR_PROTOCOL : DLL32TO64_ERROR_NONE);
+    }
+    return true;
+}
+
+/* Receive the responses to the calls of all threads on the request connection, until it is closed. */
+void ResponseTask(SOCKET socket)
+{
+    ALOG_INFO("Starting Response Thread");
+    isResponseThread = true;
+
+    if (!placement::Apply(placement::ROLE_BridgeReader))
+    {
+        ALOG_WARNING("Could not place Response Thread, Err: {}", GetLastError());
+    }
+
+    char incoming[msg::MSG_MAX_SIZE];
+    msg::MessageData response;
+    Dll32To64_Error error = DLL32TO64_ERROR_CONNECTION;
+    while (true)
+    {
+        int recvBytes;
+        if (!sock::ReceiveFrame(socket, incoming, sizeof(incoming), recvBytes))
+        {
+            ALOG_INFO("Stop waiting for responses because connection was closed");
+            break;
+        }
+
+        capture::Record(capture::RECORD_Response, incoming, recvBytes);
+
+        if (!msg::ParseMessage(response, msg::DIRECTION_Response, incoming, recvBytes))
+        {
+            error = DLL32TO64_ERROR_PROTOCOL;
+            break;
+        }
+
+        ALOG_DEBUG("Received Response {} (call {})", response.id, response.callId);
+
+        QueuedCall parked;
+        if (sendTurns.ReturnCredit(socket, parked)) TransmitRequest(parked.message);
+        if (response.id == msg::MSGID_Cancel)
+        {
+            // The wrapper dropped a cancelled request, which was completed when it was cancelled
+            continue;
+        }
+
+        if (!HandleResponse(response))
+        {
+            error = DLL32TO64_ERROR_PROTOCOL;
+            break;
+        }
+    }
+
+    bool retired;
+    {
+        std::lock_guard<std::mutex> guard(sendMutex);
+        if (requestSocket == socket) CloseRequestSocket();
+        retired = socket == retiredRequestSocket;
+        if (retired) retiredRequestSocket = INVALID_SOCKET;
+    }
+    closesocket(socket);
+
+    if (!retired) FailPendingCalls(error);
+}
+
+/*
+ * Estimate the offset between the trace clocks of wrapper and bridge and start tracing in the wrapper.
+ *
+ * The offset is estimated like in NTP by assuming that request and response take the same time. We use the sample with the
+ * smallest roundtrip time as it has the smallest error bound.
+ */
+bool StartWrapperTracing()
+{
+    int const numSamples = 8;
+    int64_t bestRoundtrip = INT64_MAX;
+    int64_t clockOffset = 0;
+
+    for (int i = 0; i < numSamples; i++)
+    {
+        msg::MessageData message = {};
+        msg::InitMessageData(message, msg::MSGID_ClockSync, msg::DIRECTION_Request);
+
+        msg::MessageData response = {};
+        int64_t const sent = trace::Now();
+        if (!SendAndWaitForResponse(message, response)) return false;
+        int64_t const received = trace::Now();
+
+        if (received - sent < bestRoundtrip)
+        {
+            bestRoundtrip = received - sent;
+            clockOffset = response.staticData.ClockSyncResponse.wrapperTime - (sent + received) / 2;
+        }
+    }
+
+    PLOG_INFO << "Wrapper clock offset: " << clockOffset << "us (roundtrip " << bestRoundtrip << "us)";
+
+    msg::MessageData message = {};
+    msg::InitMessageData(message, msg::MSGID_TraceStart, msg::DIRECTION_Request);
+    message.staticData.TraceStart.clockOffset = clockOffset;
+
+    int const traceDirLen = strlen(traceDir);
+    int const pathLen = traceDirLen + sizeof(wrapperTraceFileName);
+    if (pathLen > (int)sizeof(message.variableData))
+    {
+        PLOG_ERROR << "Trace path too long for wrapper (" << pathLen << ">" << sizeof(message.variableData) << ")";
+        return false;
+    }
+
+    std::memcpy(&message.variableData[0], traceDir, traceDirLen);
+    std::memcpy(&message.variableData[traceDirLen], wrapperTraceFileName, sizeof(wrapperTraceFileName));
+    message.staticData.TraceStart.path.byte_offset = 0;
+    message.staticData.TraceStart.path.byte_length = pathLen;
+    message.variableDataLength = pathLen;
+
+    msg::MessageData response = {};
+    return SendAndWaitForResponse(message, response);
+}
+
+/* Merge the events of bridge and wrapper into a single trace file. Must be called after the wrapper exited. */
+void WriteTraceFile()
+{
+    char path[LOG_DIR_MAXLEN + sizeof(traceFileName)];
+    std::strcpy(path, traceDir);
+    std::strcat(path, traceFileName);
+
+    FILE *file = fopen(path, "wb");
+    if (file == nullptr)
+    {
+        PLOG_ERROR << "Can't open trace file " << path;
+        return;
+    }
+
+    fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n", file);
+    bool needSeparator = false;
+    trace::WriteEvents(file, needSeparator);
+
+    // Append the wrapper's events, which are already separated by commas
+    char wrapperPath[LOG_DIR_MAXLEN + sizeof(wrapperTraceFileName)];
+    std::strcpy(wrapperPath, traceDir);
+    std::strcat(wrapperPath, wrapperTraceFileName);
+
+    FILE *wrapperFile = fopen(wrapperPath, "rb");
+    if (wrapperFile != nullptr)
+    {
+        char buf[4096];
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), wrapperFile)) > 0)
+        {
+            fwrite(buf, 1, n, file);
+        }
+        fclose(wrapperFile);
+        remove(wrapperPath);
+    }
+
+    fputs("\n]}\n", file);
+    fclose(file);
+
+    printf("dll32to64 Tracefile: %s\n", path);
+}
+
+/*
+ * Start wrapper.exe and wait until it accepts connections on `address`.
+ *
+ * The wrapper listens on a free port, so several client processes can each run their own. It reports the port through
+ * a pipe, whose write end is the only handle it inherits from us.
+ */
+bool StartWrapperProcess(char const *path, HANDLE &process, sock::Address &address)
+{
+    SECURITY_ATTRIBUTES inheritable = {sizeof(SECURITY_ATTRIBUTES), NULL, TRUE};
+    HANDLE readPipe;
+    HANDLE writePipe;
+    if (!CreatePipe(&readPipe, &writePipe, &inheritable, 0))
+    {
+        int const lastError = GetLastError();
+        ALOG_ERROR("CreatePipe() Error: {}", lastError);
+        return false;
+    }
+    SetHandleInformation(readPipe, HANDLE_FLAG_INHERIT, 0);
+
+    SIZE_T attributesSize = 0;
+    InitializeProcThreadAttributeList(NULL, 1, 0, &attributesSize);
+    std::vector<char> attributesBuffer(attributesSize);
+    LPPROC_THREAD_ATTRIBUTE_LIST const attributes = (LPPROC_THREAD_ATTRIBUTE_LIST)attributesBuffer.data();
+
+    // With AF_UNIX, every wrapper gets its own socket file, so neither ports nor paths can collide
+    address = sock::Address();
+    if (transport == sock::TRANSPORT_Unix)
+    {
+        char unixPath[UNIX_PATH_MAX];
+        char tempDir[MAX_PATH + 1];
+        DWORD const tempDirLen = GetTempPathA(sizeof(tempDir), tempDir);
+        if (tempDirLen == 0 || tempDirLen >= sizeof(tempDir) ||
+            snprintf(unixPath, sizeof(unixPath), "%sdll32to64-%lu-%u.sock", tempDir, GetCurrentProcessId(),
+                     wrapperStarts++) >= (int)sizeof(unixPath) ||
+            !sock::SetUnixPath(address, unixPath))
+        {
+            ALOG_ERROR("No socket path for wrapper in temp dir");
+            CloseHandle(readPipe);
+            CloseHandle(writePipe);
+            return false;
+        }
+    }
+
+    // The wrapper's threads are placed like ours
+    std::string const placementSpec = placement::Spec();
+    char commandLine[4096 + 64 + UNIX_PATH_MAX + placement::SPEC_MAXLEN];
+    int commandLength = snprintf(commandLine, sizeof(commandLine), "\"%s\" --ready-pipe %llu", path,
+                                 (unsigned long long)(uintptr_t)writePipe);
+    if (address.transport == sock::TRANSPORT_Unix)
+    {
+        commandLength += snprintf(&commandLine[commandLength], sizeof(commandLine) - commandLength, " --unix \"%s\"",
+                                  address.path);
+    }
+    if (!placementSpec.empty())
+    {
+        snprintf(&commandLine[commandLength], sizeof(commandLine) - commandLength, " --placement \"%s\"",
+                 placementSpec.c_str());
+    }
+
+    STARTUPINFOEXA si = {};
+    si.StartupInfo.cb = sizeof(si);
+    si.lpAttributeList = attributes;
+    PROCESS_INFORMATION pi = {};
+
+    bool started = InitializeProcThreadAttributeList(attributes, 1, 0, &attributesSize);
+    if (started)
+    {
+        started = UpdateProcThreadAttribute(attributes, 0, PROC_THREAD_ATTRIBUTE_HANDLE_LIST, &writePipe,
+                                            sizeof(writePipe), NULL, NULL) &&
+                  CreateProcessA(path, commandLine, NULL, NULL, true, EXTENDED_STARTUPINFO_PRESENT, NULL, NULL,
+                                 &si.StartupInfo, &pi);
+        DeleteProcThreadAttributeList(attributes);
+    }
+    int const lastError = GetLastError();
+
+    // Only the wrapper may hold the write end, so reading fails once it exits
+    CloseHandle(writePipe);
+
+    if (!started)
+    {
+        CloseHandle(readPipe);
+        ALOG_ERROR("CreateProcess() Error: {}", lastError);
+        return false;
+    }
+
+    process = pi.hProcess;
+    CloseHandle(pi.hThread);  // Don't need this handle
+
+    char port[16] = {};
+    DWORD bytesRead = 0;
+    bool const ready = ReadFile(readPipe, port, sizeof(port) - 1, &bytesRead, NULL) && bytesRead > 0;
+    CloseHandle(readPipe);
+    if (!ready)
+    {
+        ALOG_ERROR("Wrapper exited before accepting connections");
+        return false;
+    }
+
+    address.port = std::atoi(port);
+    ALOG_INFO("Wrapper listens on {}", sock::ToString(address).c_str());
+    return true;
+}
+
+/* Start the wrapper.exe next to this DLL. */
+bool StartWrapper(HANDLE &process, sock::Address &address)
+{
+    ALOG_INFO("Starting Wrapper");
+    trace::Span span("StartWrapper");
+
+    // First, get full path to directory where this DLL lies
+    // See https://stackoverflow.com/a/6924332
+    HMODULE hm = NULL;
+    if (!GetModuleHandleExA(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT,
+                           (LPCSTR)&Dll32To64_EnableLogging, &hm))
+    {
+        int const lastError = GetLastError();
+        ALOG_ERROR("GetModuleHandleEx() Error: {}", lastError);
+        return false;
+    }
+    char path[4096];
+    if (!GetModuleFileNameA(hm, path, sizeof(path)))
+    {
+        int const lastError = GetLastError();
+        ALOG_ERROR("GetModuleFileName() Error: {}", lastError);
+        return false;
+    }
+
+    // Remove Filename from path
+    std::string const pathS(path);
+    int const lastSlashPos = pathS.find_last_of("\\/");
+
+    // Append exe name to path
+    // TODO: Respect different filename depending on wrapping direction
+    std::strcpy(&path[lastSlashPos + 1], "wrapper.exe");
+
+    ALOG_DEBUG("Running {}", path);
+
+    return StartWrapperProcess(path, process, address);
+}
+
+/* Wait for a wrapper.exe whose session was closed to exit, or terminate it. */
+void StopWrapper(HANDLE process, sock::Address const &address)
+{
+    if (WaitForSingleObject(process, WRAPPER_EXIT_TIMEOUT_MS) != WAIT_OBJECT_0)
+    {
+        ALOG_WARNING("Terminating wrapper that didn't exit");
+        TerminateProcess(process, 1);
+        WaitForSingleObject(process, INFINITE);
+    }
+    CloseHandle(process);
+
+    // Left behind if the wrapper was terminated
+    if (address.transport == sock::TRANSPORT_Unix) DeleteFileA(address.path);
+}
+
+/*
+ * Register the client's callbacks with a new session, like the last SetCallback() did with the current one.
+ *
+ * @param replayed: Number of requests sent, whose callbacks must not reach the client again (see CallbackTask()).
+ */
+// TODO: AUTOGEN (one per callback registration export)
+bool ReplayRegistrations(SOCKET socket, uint32_t &replayed)
+{
+    replayed = 0;
+    if (callback == NULL) return true;
+
+    msg::MessageData message = {};
+    msg::InitMessageData(message, msg::MSGID_SetCallback, msg::DIRECTION_Request);
+    message.callId = NextCallId();
+
+    msg::MessageData response = {};
+    replayed++;
+    return Exchange(socket, message, response);
+}
+
+/* A wrapper.exe with an open session that takes over from the current one, see RecycleWrapper(). */
+struct Replacement
+{
+    HANDLE process = INVALID_HANDLE_VALUE;
+    sock::Address address;
+    uint32_t sessionId = 0;
+    uint64_t token = 0;
+    uint32_t credits = 0;
+    // See ReplayRegistrations()
+    uint32_t replayedRequests = 0;
+    SOCKET requestSocket = INVALID_SOCKET;
+    SOCKET callbackSocket = INVALID_SOCKET;
+};
+
+/* Close the session of a replacement that isn't used after all, which makes it exit. */
+void DiscardReplacement(Replacement &replacement)
+{
+    if (replacement.requestSocket != INVALID_SOCKET) closesocket(replacement.requestSocket);
+    if (replacement.callbackSocket != INVALID_SOCKET) closesocket(replacement.callbackSocket);
+    if (replacement.process != INVALID_HANDLE_VALUE) StopWrapper(replacement.process, replacement.address);
+}
+
+/* Start a new wrapper.exe, open a session and register the client's callbacks with it. */
+bool PrepareReplacement(Replacement &replacement)
+{
+    if (!StartWrapper(replacement.process, replacement.address) ||
+        !ConnectToWrapper(replacement.requestSocket, replacement.address) ||
+        !Handshake(replacement.requestSocket, msg::CHANNEL_Request, replacement.sessionId, replacement.token,
+                   &replacement.credits) ||
+        !ConnectToWrapper(replacement.callbackSocket, replacement.address) ||
+        !Handshake(replacement.callbackSocket, msg::CHANNEL_Callback, replacement.sessionId, replacement.token) ||
+        !ReplayRegistrations(replacement.requestSocket, replacement.replayedRequests))
+    {
+        DiscardReplacement(replacement);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Replace our wrapper.exe with a new one without failing any calls, see Dll32To64_SetRecyclePolicy().
+ *
+ * The replacement is started and its session prepared while the current wrapper keeps executing calls. Then, new calls
+ * are held back until the current wrapper answered all pending ones, and the connections are switched over. The old
+ * wrapper exits once its session is closed. Callers only wait for the calls that were pending, up to
+ * RECYCLE_DRAIN_TIMEOUT. If they don't drain in time or the client acquired objects of the DLL, the replacement is
+ * discarded and the current wrapper kept.
+ */
+void RecycleWrapper()
+{
+    ALOG_INFO("Recycling wrapper after {} calls, {} KB address space", wrapperCalls.load(), wrapperAddressSpaceKb.load());
+    trace::Span span("RecycleWrapper");
+
+    Replacement replacement;
+    bool const prepared = PrepareReplacement(replacement);
+
+    std::unique_lock<std::mutex> connectLock(connectMutex);
+    bool switched = false;
+    SOCKET oldRequestSocket = INVALID_SOCKET;
+    if (prepared)
+    {
+        // Holding connectMutex keeps new calls from being started. Responses may still start some, which are sent to the
+        // current wrapper and waited for, too.
+        auto const deadline = Clock::now() + RECYCLE_DRAIN_TIMEOUT;
+        while (true)
+        {
+            {
+                std::unique_lock<std::mutex> lock(pendingMutex);
+                if (!pendingDrained.wait_until(lock, deadline, [] { return pendingCalls.empty(); })) break;
+            }
+
+            // Requests are only sent under sendMutex, so none can go to the current wrapper after this check
+            std::lock_guard<std::mutex> sendGuard(sendMutex);
+            std::lock_guard<std::mutex> pendingGuard(pendingMutex);
+            if (!pendingCalls.empty()) continue;
+            if (requestSocket == INVALID_SOCKET || liveHandles.load() > 0) break;
+
+            oldRequestSocket = requestSocket;
+            retiredRequestSocket = requestSocket;
+            requestSocket = replacement.requestSocket;
+            sendTurns.Reset(requestSocket, replacement.credits);
+            switched = true;
+            break;
+        }
+    }
+
+    if (!switched)
+    {
+        ALOG_WARNING("Could not recycle wrapper, keeping the current one");
+        nextRecycle = Clock::now() + RECYCLE_RETRY_DELAY;
+        recycling = false;
+        connectLock.unlock();
+        if (prepared) DiscardReplacement(replacement);
+        return;
+    }
+
+    std::thread oldResponseThread = std::move(responseThread);
+    std::thread oldCallbackThread = std::move(callbackThread);
+    HANDLE const oldProcess = wrapperProcess;
+    sock::Address const oldAddress = wrapperAddress;
+
+    wrapperProcess = replacement.process;
+    wrapperAddress = replacement.address;
+    sessionId = replacement.sessionId;
+    sessionToken = replacement.token;
+    callbackSocket = replacement.callbackSocket;
+    responseThread = std::thread(ResponseTask, replacement.requestSocket);
+    callbackThread = std::thread(CallbackTask, replacement.callbackSocket, replacement.replayedRequests);
+    wrapperCalls.store(0);
+    wrapperAddressSpaceKb.store(0);
+    // Tracing is started with the next call
+    wrapperTracing = false;
+    metrics::Recycled();
+    connectLock.unlock();
+
+    ALOG_INFO("Switched to session {}", sessionId);
+
+    // The old wrapper answered all calls, so closing its session makes it exit
+    shutdown(oldRequestSocket, SD_BOTH);
+    StopWrapper(oldProcess, oldAddress);
+    if (oldResponseThread.joinable()) oldResponseThread.join();
+    if (oldCallbackThread.joinable()) oldCallbackThread.join();
+
+    std::lock_guard<std::mutex> guard(connectMutex);
+    recycling = false;
+}
+
+/* Parse a recycling policy like "calls=100000;memory=1500". Limits that aren't given are 0. */
+bool ParseRecyclePolicy(char const *spec, unsigned &maxCalls, unsigned &maxMemoryMb)
+{
+    maxCalls = 0;
+    maxMemoryMb = 0;
+    for (char const *p = spec; *p != '\0'; )
+    {
+        unsigned *limit;
+        if (std::strncmp(p, "calls=", 6) == 0) limit = &maxCalls;
+        else if (std::strncmp(p, "memory=", 7) == 0) limit = &maxMemoryMb;
+        else return false;
+
+        p = std::strchr(p, '=') + 1;
+        char *end;
+        if (!std::isdigit(*p)) return false;
+        *limit = std::strtoul(p, &end, 10);
+        if (*end != ';' && *end != '\0') return false;
+        p = *end == ';' ? end + 1 : end;
+    }
+    return true;
+}
+
+/* True if our wrapper.exe should be recycled now. Must hold connectMutex. */
+bool RecycleDue()
+{
+    unsigned const maxCalls = recycleMaxCalls.load();
+    unsigned const maxMemoryMb = recycleMaxMemoryMb.load();
+    if (maxCalls == 0 && maxMemoryMb == 0) return false;
+
+    // A shared daemon is not ours to replace
+    if (useDaemon || wrapperProcess == INVALID_HANDLE_VALUE || recycling || Clock::now() < nextRecycle) return false;
+
+    bool const due = (maxCalls != 0 && wrapperCalls.load() >= maxCalls) ||
+                     (maxMemoryMb != 0 && wrapperAddressSpaceKb.load() / 1024 >= maxMemoryMb);
+    return due && liveHandles.load() <= 0;
+}
+
+/* Recycle our wrapper.exe in the background. Must hold connectMutex. */
+void StartRecycling()
+{
+    // The previous one has finished, as recycling is false
+    if (recycleThread.joinable()) recycleThread.join();
+
+    recycling = true;
+    recycleThread = std::thread(RecycleWrapper);
+}
+
+bool ConnectWrapper()
+{
+    // This function accesses/modifies some persistent state so we only allow execution of it
+    // by a single thread at a time
+    std::lock_guard<std::mutex> guard(connectMutex);
+
+    if (!winSockStartup)
+    {
+        // We need to do this once after the DLL was loaded
+        if (!sock::StartupWinSock())
+        {
+            return false;
+        }
+        winSockStartup = true;
+
+        if (!metrics::StartPublishing("bridge"))
+        {
+            ALOG_WARNING("Could not create metrics segment, Err: {}", GetLastError());
+        }
+
+        char transportName[16];
+        DWORD const transportLen = GetEnvironmentVariableA("DLL32TO64_TRANSPORT", transportName, sizeof(transportName));
+        if (transportLen > 0 && transportLen < sizeof(transportName))
+        {
+            if (std::strcmp(transportName, "unix") == 0)
+            {
+                transport = sock::TRANSPORT_Unix;
+            }
+            else if (std::strcmp(transportName, "tcp") != 0)
+            {
+                ALOG_WARNING("Ignoring unknown DLL32TO64_TRANSPORT {}", transportName);
+            }
+        }
+
+        char port[16];
+        DWORD const portLen = GetEnvironmentVariableA("DLL32TO64_DAEMON_PORT", port, sizeof(port));
+        char daemonSocket[UNIX_PATH_MAX];
+        DWORD const daemonSocketLen = GetEnvironmentVariableA("DLL32TO64_DAEMON_SOCKET", daemonSocket, sizeof(daemonSocket));
+        if (daemonSocketLen > 0 && daemonSocketLen < sizeof(daemonSocket))
+        {
+            useDaemon = sock::SetUnixPath(daemonAddress, daemonSocket);
+        }
+        else if (portLen > 0 && portLen < sizeof(port))
+        {
+            daemonAddress.port = std::atoi(port);
+            useDaemon = true;
+        }
+
+        if (useDaemon)
+        {
+            ALOG_INFO("Using wrapper daemon on {}", sock::ToString(daemonAddress).c_str());
+        }
+
+        char spec[placement::SPEC_MAXLEN];
+        DWORD const specLen = GetEnvironmentVariableA("DLL32TO64_PLACEMENT", spec, sizeof(spec));
+        if (specLen > 0 && specLen < sizeof(spec) && !placementSet.load())
+        {
+            if (placement::Configure(spec))
+            {
+                ALOG_INFO("Placing threads by {}", spec);
+            }
+            else
+            {
+                ALOG_WARNING("Ignoring invalid DLL32TO64_PLACEMENT {}", spec);
+            }
+        }
+
+        char policy[64];
+        DWORD const policyLen = GetEnvironmentVariableA("DLL32TO64_RECYCLE", policy, sizeof(policy));
+        if (policyLen > 0 && policyLen < sizeof(policy) && !recyclePolicySet.load())
+        {
+            unsigned maxCalls;
+            unsigned maxMemoryMb;
+            if (ParseRecyclePolicy(policy, maxCalls, maxMemoryMb))
+            {
+                recycleMaxCalls.store(maxCalls);
+                recycleMaxMemoryMb.store(maxMemoryMb);
+                ALOG_INFO("Recycling wrapper by {}", policy);
+            }
+            else
+            {
+                ALOG_WARNING("Ignoring invalid DLL32TO64_RECYCLE {}", policy);
+            }
+        }
+    }
+
+    // Check if wrapper exe is already running
+    bool const connected = IsConnected();
+    bool wasRunning = false;
+    if (useDaemon)
+    {
+        // The daemon is not ours to start. A closed request connection means that our session has ended.
+        wasRunning = connected;
+        wrapperAddress = daemonAddress;
+    }
+    else if (wrapperProcess != INVALID_HANDLE_VALUE)
+    {
+        // After an error, the request connection is closed, which makes our wrapper exit
+        if (!connected)
+        {
+            WaitForSingleObject(wrapperProcess, WRAPPER_EXIT_TIMEOUT_MS);
+        }
+
+        DWORD exitCode;
+        if (!GetExitCodeProcess(wrapperProcess, &exitCode))
+        {
+            int const lastError = GetLastError();
+            ALOG_ERROR("GetExitCodeProcess() Error: {}", lastError);
+            return false;
+        }
+
+        if (STILL_ACTIVE == exitCode)
+        {
+            wasRunning = true;
+        }
+        else
+        {
+            ALOG_INFO("Wrapper exited with exitcode {}", exitCode);
+            WaitForSingleObject(wrapperProcess, INFINITE);
+            CloseHandle(wrapperProcess);
+            wrapperProcess = INVALID_HANDLE_VALUE;
+            wrapperTracing = false;
+
+            // Left behind if the wrapper was terminated
+            if (wrapperAddress.transport == sock::TRANSPORT_Unix) DeleteFileA(wrapperAddress.path);
+        }
+    }
+
+    if (!wasRunning && !useDaemon)
+    {
+        if (!StartWrapper(wrapperProcess, wrapperAddress))
+        {
+            return false;
+        }
+        wrapperCalls.store(0);
+        wrapperAddressSpaceKb.store(0);
+    }
+
+    // (Re)connect to wrapper if it was just started or we don't have a socket handle yet
+    if (!wasRunning || !connected)
+    {
+        trace::Span span("Connect");
+
+        // The previous connection is closed, so its response thread exits
+        if (responseThread.joinable())
+        {
+            ALOG_INFO("Joining Response Thread");
+            responseThread.join();
+        }
+
+        SOCKET socket = INVALID_SOCKET;
+        uint32_t credits = 0;
+        if (!ConnectToWrapper(socket, wrapperAddress) ||
+            !Handshake(socket, msg::CHANNEL_Request, sessionId, sessionToken, &credits))
+        {
+            if (socket != INVALID_SOCKET) closesocket(socket);
+            return false;
+        }
+
+        {
+            std::lock_guard<std::mutex> guard(sendMutex);
+            requestSocket = socket;
+            sendTurns.Reset(socket, credits);
+        }
+        responseThread = std::thread(ResponseTask, socket);
+
+        static bool connectedBefore = false;
+        if (connectedBefore) metrics::Reconnected();
+        connectedBefore = true;
+
+        // A new session starts without tracing and objects, and needs its own callback connection
+        wrapperTracing = false;
+        liveHandles.store(0);
+        wasRunning = false;
+    }
+
+    // Tracing may have been enabled after the wrapper was started
+    if (trace::IsEnabled() && !wrapperTracing)
+    {
+        if (!StartWrapperTracing())
+        {
+            return false;
+        }
+        wrapperTracing = true;
+    }
+
+    // Same for callback connection
+    if (!wasRunning || callbackSocket == INVALID_SOCKET)
+    {
+        if (callbackThread.joinable())
+        {
+            ALOG_INFO("Joining Callback Thread");
+            callbackThread.join();
+        }
+
+        SOCKET socket = INVALID_SOCKET;
+        if (!ConnectToWrapper(socket, wrapperAddress) ||
+            !Handshake(socket, msg::CHANNEL_Callback, sessionId, sessionToken))
+        {
+            if (socket != INVALID_SOCKET) closesocket(socket);
+            return false;
+        }
+
+        callbackSocket = socket;
+        callbackThread = std::thread(CallbackTask, socket, 0);
+    }
+
+    if (RecycleDue())
+    {
+        StartRecycling();
+    }
+
+    return true;
+}
+
+/* Connect to the wrapper if needed. Completions can only use the current connection, as connecting blocks. */
+bool EnsureWrapperConnection()
+{
+    return isResponseThread ? IsConnected() : ConnectWrapper();
+}
+
+/* Give up on a wrapper that doesn't finish its current call. The next call starts a new one. */
+void RestartWrapper()
+{
+    if (wrapperProcess != INVALID_HANDLE_VALUE)
+    {
+        ALOG_WARNING("Terminating unresponsive wrapper");
+        TerminateProcess(wrapperProcess, 1);
+    }
+    else
+    {
+        ALOG_WARNING("Not terminating shared wrapper daemon, only closing the session");
+    }
+
+    DropSession();
+}
+
+/* Start a call of a wrapped function. `onResponse` runs on the response thread and writes the call's outputs. */
+Dll32To64_Call *StartCall(msg::MessageData &message, Dll32To64_Call::ResponseHandler onResponse)
+{
+    Dll32To64_Call *const call = new Dll32To64_Call(message.id, LaneOf(message.id), std::move(onResponse));
+    if (!EnsureWrapperConnection())
+    {
+        CompleteCall(call, DLL32TO64_ERROR_CONNECTION);
+        return call;
+    }
+
+    wrapperCalls.fetch_add(1, std::memory_order_relaxed);
+    if (Admit(call, message))
+    {
+        SendRequest(call, message);
+    }
+    return call;
+}
+
+/* A call that is done without being sent, because it was served locally or there is nothing to send. */
+Dll32To64_Call *CompletedCall(msg::MsgId id, Dll32To64_Error error)
+{
+    Dll32To64_Call *const call = new Dll32To64_Call(id, LaneOf(id), nullptr);
+    CompleteCall(call, error);
+    return call;
+}
+
+/* Wait until the call is done or the deadline passed. Returns true if it is done. */
+bool WaitForCall(Dll32To64_Call *call, Clock::time_point deadline)
+{
+    // The response thread would wait for itself
+    assert(!isResponseThread);
+
+    std::unique_lock<std::mutex> guard(call->mutex);
+    auto const isDone = [call] { return call->done; };
+    if (deadline == Clock::time_point::max())
+    {
+        call->doneChanged.wait(guard, isDone);
+        return true;
+    }
+
+    return call->doneChanged.wait_until(guard, deadline, isDone);
+}
+
+/*
+ * Stop waiting for a call that isn't done. The wrapper drops the request if it is still queued. Otherwise, its response
+ * is discarded when it arrives.
+ */
+void CancelCall(Dll32To64_Call *call)
+{
+    // A call waiting for admission was never sent
+    if (admissionLimited.load() && UnqueueCall(call))
+    {
+        CompleteCall(call, DLL32TO64_ERROR_TIMEOUT);
+        return;
+    }
+
+    uint32_t const callId = call->callId.load();
+    // Neither was a request waiting for a credit
+    if (sendTurns.Unpark(call))
+    {
+        if (TakePendingCall(callId) != nullptr) CompleteCall(call, DLL32TO64_ERROR_TIMEOUT);
+        return;
+    }
+
+    if (TakePendingCall(callId) == nullptr)
+    {
+        // The response thread is completing it right now
+        return;
+    }
+
+    msg::MessageData cancel = {};
+    msg::InitMessageData(cancel, msg::MSGID_Cancel, msg::DIRECTION_Request);
+    cancel.callId = callId;
+
+    char buf[msg::MSG_HEADER_SIZE];
+    int size;
+    msg::SerializeMessage(cancel, buf, size);
+    capture::Record(capture::RECORD_Request, buf, size);
+    {
+        std::lock_guard<std::mutex> guard(sendMutex);
+        if (requestSocket != INVALID_SOCKET && !sock::Send(requestSocket, buf, size))
+        {
+            CloseRequestSocket();
+        }
+    }
+
+    CompleteCall(call, DLL32TO64_ERROR_TIMEOUT);
+}
+
+/* Stop waiting for a synchronous call that ran out of time. It is cancelled when released. */
+void AbandonCall(Dll32To64_Call const *call)
+{
+    ALOG_WARNING("Call {} ({}) timed out", call->callId.load(), msg::MsgIdName(call->id));
+
+    if (restartOnTimeout.load())
+    {
+        RestartWrapper();
+    }
+}
+
+/*
+ * Wait for a call of a synchronous export and release it. Applies the thread's deadline and the export's timeout and
+ * reports the outcome through Dll32To64_GetLastError(). Returns true if the call succeeded.
+ */
+bool FinishCall(Dll32To64_Call *call)
+{
+    // The earlier of the thread's deadline and the export's timeout
+    Clock::time_point deadline = threadDeadline;
+    unsigned const timeoutMs = defaultTimeoutMs[call->id].load(std::memory_order_relaxed);
+    if (timeoutMs > 0)
+    {
+        deadline = std::min(deadline, Clock::now() + std::chrono::milliseconds(timeoutMs));
+    }
+
+    bool done;
+    {
+        trace::Span span("WaitForResponse", call->callId.load());
+        done = WaitForCall(call, deadline);
+    }
+
+    if (done)
+    {
+        callError = call->error;
+    }
+    else
+    {
+        AbandonCall(call);
+        callError = DLL32TO64_ERROR_TIMEOUT;
+    }
+
+    Dll32To64_Release(call);
+    return callError == DLL32TO64_ERROR_NONE;
+}
+
+/* Send an internal message on the current connection and wait for its response. */
+bool SendAndWaitForResponse(msg::MessageData &message, msg::MessageData &response)
+{
+    Dll32To64_Call *const call = new Dll32To64_Call(message.id, message.lane,
+        [&response](msg::MessageData const &received, msg::MessageData &)
+        {
+            response = received;
+            return Dll32To64_Call::STEP_Done;
+        });
+
+    SendRequest(call, message);
+    return FinishCall(call);
+}
+
+void SetShimMode(Shim &shim, Dll32To64_ShimMode mode, unsigned verifyCalls)
+{
+    if (mode == DLL32TO64_SHIM_VERIFY && verifyCalls == 0)
+    {
+        mode = DLL32TO64_SHIM_ON;
+    }
+
+    shim.verifyRemaining.store(verifyCalls);
+    shim.mode.store(mode);
+}
+
+/* Make a local implementation available for a wrapped function. */
+void RegisterShim(msg::MsgId id, Dll32To64_ShimMode mode, unsigned verifyCalls)
+{
+    shims[id].available = true;
+    SetShimMode(shims[id], mode, verifyCalls);
+}
+
+// Wrapped functions with a local implementation (see namespace local below) and how they are served by default
+// TODO: AUTOGEN
+bool RegisterShims()
+{
+    RegisterShim(msg::MSGID_Invert, DLL32TO64_SHIM_VERIFY, 100);
+    return true;
+}
+
+bool const shimsRegistered = RegisterShims();
+
+/*
+ * Call a wrapped function that may have a local implementation.
+ *
+ * `forward` sends the call to the wrapper. In DLL32TO64_SHIM_VERIFY mode, the local implementation runs after each
+ * successful forwarded call and must return the same result, otherwise the shim is turned off.
+ */
+template <typename Result, typename... Params, typename... Args>
+Result CallWithShim(msg::MsgId id, Result (*local)(Params...), Result (*forward)(Params...), Args... args)
+{
+    Shim &shim = shims[id];
+    int const mode = shim.mode.load(std::memory_order_relaxed);
+
+    if (mode == DLL32TO64_SHIM_ON)
+    {
+        metrics::CallScope callScope(id, LaneOf(id));
+        callError = DLL32TO64_ERROR_NONE;
+        Result const result = local(args...);
+        callScope.Succeeded();
+        return result;
+    }
+
+    Result const result = forward(args...);
+    if (mode != DLL32TO64_SHIM_VERIFY || callError != DLL32TO64_ERROR_NONE)
+    {
+        return result;
+    }
+
+    if (!(local(args...) == result))
+    {
+        int expected = DLL32TO64_SHIM_VERIFY;
+        if (shim.mode.compare_exchange_strong(expected, DLL32TO64_SHIM_OFF))
+        {
+            ALOG_WARNING("Local implementation of {} returned a different result, calls are forwarded",
+                         msg::MsgIdName(id));
+        }
+    }
+    else if (shim.verifyRemaining.fetch_sub(1) == 1)
+    {
+        int expected = DLL32TO64_SHIM_VERIFY;
+        if (shim.mode.compare_exchange_strong(expected, DLL32TO64_SHIM_ON))
+        {
+            ALOG_INFO("Local implementation of {} verified, calls are served locally", msg::MsgIdName(id));
+        }
+    }
+
+    return result;
+}
+
+/* Handle of a wrapper object, which the client holds in place of the DLL's pointer. */
+msg::Handle HandleOf(void const *object)
+{
+    return (msg::Handle)(uintptr_t)object;
+}
+
+template <typename T>
+T *FromHandle(msg::Handle handle)
+{
+    return (T*)(uintptr_t)handle;
+}
+
+bool InitLogging(char const *path, bool async)
+{
+    if (path == nullptr)
+    {
+        return false;
+    }
+
+    unsigned const pathLen = strnlen(path, LOG_DIR_MAXLEN);
+
+    if (LOG_DIR_MAXLEN == pathLen)
+    {
+        // Path is not 0-terminated
+        return false;
+    }
+
+    char const logFileName[] = "/dll32to64.log";
+
+    char fullPath[LOG_DIR_MAXLEN + sizeof(logFileName)];
+    strcpy(fullPath, path);
+
+    // Append logfile name to path
+    std::strcpy(&fullPath[pathLen], logFileName);
+
+#if DEBUG == 1
+    plog::Severity const severity = plog::debug;
+#else
+    plog::Severity const severity = plog::info;
+#endif
+
+    // Rotate up to 10 logfiles of 10MB each
+    plog::init(severity, fullPath, 10000000, 10);
+
+    // The background thread writes to the appender created above
+    if (async) alog::Start();
+
+    printf("dll32to64 Logfile: %s\n", fullPath);
+    return true;
+}
+
+} // end anonymous namespace
+
+bool Dll32To64_EnableLogging(char const *path)
+{
+    return InitLogging(path, false);
+}
+
+bool Dll32To64_EnableAsyncLogging(char const *path)
+{
+    return InitLogging(path, true);
+}
+
+bool Dll32To64_EnableTracing(char const *path)
+{
+    if (path == nullptr)
+    {
+        return false;
+    }
+
+    unsigned const pathLen = strnlen(path, LOG_DIR_MAXLEN);
+
+    if (LOG_DIR_MAXLEN == pathLen)
+    {
+        // Path is not 0-terminated
+        return false;
+    }
+
+    if (trace::IsEnabled())
+    {
+        // Events are recorded until shutdown, so the directory can't be changed anymore
+        return std::strcmp(path, traceDir) == 0;
+    }
+
+    std::strcpy(traceDir, path);
+
+    // Remove leftovers of a previous run, the wrapper only ever appends to this file
+    char wrapperPath[LOG_DIR_MAXLEN + sizeof(wrapperTraceFileName)];
+    std::strcpy(wrapperPath, traceDir);
+    std::strcat(wrapperPath, wrapperTraceFileName);
+    remove(wrapperPath);
+
+    PLOG_INFO << "Tracing to " << traceDir;
+
+    trace::Enable("bridge.dll", 0);
+    return true;
+}
+
+bool Dll32To64_StartCapture(char const *path, unsigned maxSizeMb)
+{
+    if (path == nullptr)
+    {
+        return false;
+    }
+
+    uint64_t const capacity = maxSizeMb > 0 ? (uint64_t)maxSizeMb * 1024 * 1024 : capture::DEFAULT_CAPACITY;
+    if (!capture::Start(path, capacity))
+    {
+        PLOG_ERROR << "Can't start capture to " << path << ", Err: " << GetLastError();
+        return false;
+    }
+
+    PLOG_INFO << "Capturing to " << path;
+    return true;
+}
+
+void Dll32To64_StopCapture()
+{
+    capture::Stop();
+}
+
+Dll32To64_Error Dll32To64_GetLastError()
+{
+    return callError;
+}
+
+void Dll32To64_SetDeadline(unsigned timeoutMs)
+{
+    threadDeadline = timeoutMs > 0 ? Clock::now() + std::chrono::milliseconds(timeoutMs) : Clock::time_point::max();
+}
+
+bool Dll32To64_SetDefaultTimeout(char const *function, unsigned timeoutMs)
+{
+    bool found = false;
+    for (unsigned id = 0; id <= msg::MSGID_LAST; id++)
+    {
+        if (IsExport(id) && (function == nullptr || std::strcmp(function, msg::MsgIdName((msg::MsgId)id)) == 0))
+        {
+            defaultTimeoutMs[id].store(timeoutMs);
+            found = true;
+        }
+    }
+
+    return found;
+}
+
+void Dll32To64_SetRestartOnTimeout(bool restart)
+{
+    restartOnTimeout.store(restart);
+}
+
+bool Dll32To64_SetShimMode(char const *function, Dll32To64_ShimMode mode, unsigned verifyCalls)
+{
+    bool found = false;
+    for (unsigned id = 0; id <= msg::MSGID_LAST; id++)
+    {
+        if (IsExport(id) && shims[id].available &&
+            (function == nullptr || std::strcmp(function, msg::MsgIdName((msg::MsgId)id)) == 0))
+        {
+            SetShimMode(shims[id], mode, verifyCalls);
+            found = true;
+        }
+    }
+
+    return found;
+}
+
+bool Dll32To64_IsDone(Dll32To64_Call *call)
+{
+    std::lock_guard<std::mutex> guard(call->mutex);
+    return call->done;
+}
+
+bool Dll32To64_Wait(Dll32To64_Call *call, unsigned timeoutMs)
+{
+    Clock::time_point const deadline = timeoutMs == DLL32TO64_INFINITE
+        ? Clock::time_point::max()
+        : Clock::now() + std::chrono::milliseconds(timeoutMs);
+    return WaitForCall(call, deadline);
+}
+
+bool Dll32To64_OnComplete(Dll32To64_Call *call, Dll32To64_Completion completion, void *context)
+{
+    std::lock_guard<std::mutex> guard(call->mutex);
+    if (call->done) return false;
+
+    call->completion = completion;
+    call->context = context;
+    return true;
+}
+
+Dll32To64_Error Dll32To64_GetCallError(Dll32To64_Call *call)
+{
+    std::lock_guard<std::mutex> guard(call->mutex);
+    return call->error;
+}
+
+void Dll32To64_Release(Dll32To64_Call *call)
+{
+    bool pending;
+    {
+        std::lock_guard<std::mutex> guard(call->mutex);
+        call->released = true;
+        call->completion = NULL;
+        pending = !call->done;
+    }
+
+    if (pending) CancelCall(call);
+    ReleaseReference(call);
+}
+
+bool Dll32To64_SetLane(char const *function, Dll32To64_Lane lane)
+{
+    if (lane != DLL32TO64_LANE_CONTROL && lane != DLL32TO64_LANE_BULK)
+    {
+        return false;
+    }
+
+    bool found = false;
+    for (unsigned id = 0; id <= msg::MSGID_LAST; id++)
+    {
+        if (IsExport(id) && (function == nullptr || std::strcmp(function, msg::MsgIdName((msg::MsgId)id)) == 0))
+        {
+            exportLanes[id].store(lane == DLL32TO64_LANE_CONTROL ? msg::LANE_Control : msg::LANE_Bulk);
+            found = true;
+        }
+    }
+
+    return found;
+}
+
+bool Dll32To64_SetAdmissionLimit(char const *function, unsigned maxInFlight, unsigned maxQueued)
+{
+    AdmissionLimit *const limit = FindAdmissionLimit(function);
+    if (limit == nullptr)
+    {
+        return false;
+    }
+
+    // Calls that fit a raised limit don't wait for the next call to be done
+    std::deque<QueuedCall> admitted;
+    {
+        std::lock_guard<std::mutex> guard(admissionMutex);
+        limit->maxInFlight.store(maxInFlight);
+        limit->maxQueued.store(maxQueued);
+        admissionLimited.store(true);
+        AdmitQueuedCalls(admitted);
+    }
+    SendAdmittedCalls(admitted);
+    return true;
+}
+
+bool Dll32To64_GetLoad(char const *function, Dll32To64_Load *load)
+{
+    AdmissionLimit const *const limit = FindAdmissionLimit(function);
+    if (limit == nullptr || load == NULL)
+    {
+        return false;
+    }
+
+    load->inFlight = limit->inFlight.load();
+    load->queued = limit->queued.load();
+    load->rejected = limit->rejected.load();
+    return true;
+}
+
+bool Dll32To64_SetPlacement(char const *spec)
+{
+    if (!placement::Configure(spec))
+    {
+        return false;
+    }
+
+    placementSet.store(true);
+    PLOG_INFO << "Placing threads by " << spec;
+    return true;
+}
+
+void Dll32To64_SetRecyclePolicy(unsigned maxCalls, unsigned maxMemoryMb)
+{
+    recycleMaxCalls.store(maxCalls);
+    recycleMaxMemoryMb.store(maxMemoryMb);
+    recyclePolicySet.store(true);
+    PLOG_INFO << "Recycling wrapper after " << maxCalls << " calls or " << maxMemoryMb << " MB";
+}
+
+void Dll32To64_Shutdown()
+{
+    PLOG_INFO << "Shutdown";
+
+    // A recycling that is under way switches to the new wrapper first
+    if (recycleThread.joinable()) recycleThread.join();
+
+    // This ends our session and, unless we use a daemon, shuts down wrapper.exe. Pending calls fail.
+    {
+        std::lock_guard<std::mutex> guard(sendMutex);
+        if (requestSocket != INVALID_SOCKET) shutdown(requestSocket, SD_BOTH);
+        requestSocket = INVALID_SOCKET;
+        sendTurns.Reset(INVALID_SOCKET, 0);
+    }
+    if (responseThread.joinable()) responseThread.join();
+
+    // Wait until wrapper has shut down (peer will close callback connection)
+    if (wrapperProcess != INVALID_HANDLE_VALUE)
+    {
+        WaitForSingleObject(wrapperProcess, INFINITE);
+        CloseHandle(wrapperProcess);
+    }
+
+    // Callback thread exits once the wrapper closed the session's callback connection
+    if (callbackThread.joinable()) callbackThread.join();
+
+    // Wrapper has written its events on exit, so both can be merged now
+    if (trace::IsEnabled()) WriteTraceFile();
+
+    metrics::StopPublishing();
+    capture::Stop();
+
+    // Flush pending log records
+    alog::Stop();
+
+    WSACleanup();
+}
+
+
+// Local implementations of wrapped functions, see RegisterShims()
+// TODO: AUTOGEN
+namespace local {
+
+bool Invert(bool input) {
+    return !input;
+}
+
+} // end namespace
+
+// wrapped dll implementation
+// TODO: AUTOGEN
+
+Dll32To64_Call *InvertAsync(bool input, bool *result) {
+    if (shims[msg::MSGID_Invert].mode.load(std::memory_order_relaxed) == DLL32TO64_SHIM_ON)
+    {
+        *result = local::Invert(input);
+        return CompletedCall(msg::MSGID_Invert, DLL32TO64_ERROR_NONE);
+    }
+
+    msg::MessageData message = {};
+    msg::InitMessageData(message, msg::MSGID_Invert, msg::DIRECTION_Request);
+    message.staticData.Invert.input = input;
+
+    return StartCall(message, [result](msg::MessageData const &response, msg::MessageData &)
+    {
+        *result = response.staticData.InvertResponse;
+        return Dll32To64_Call::STEP_Done;
+    });
+}
+
+static bool ForwardInvert(bool input) {
+    bool result = false;
+    FinishCall(InvertAsync(input, &result));
+    return result;
+}
+
+bool Invert(bool input) {
+    return CallWithShim(msg::MSGID_Invert, &local::Invert, &ForwardInvert, input);
+}
+
+// Elements of a map call that fit into one request
+int const INVERT_MAP_CHUNK = msg::MSG_MAX_VARIABLE_SIZE / sizeof(bool);
+
+static void InvertMapChunk(msg::MessageData &message, bool const* inputs, int count, int done) {
+    int const chunk = std::min(count - done, INVERT_MAP_CHUNK);
+    msg::InitMessageData(message, msg::MSGID_InvertMap, msg::DIRECTION_Request);
+    message.staticData.InvertMap.count = chunk;
+    message.staticData.InvertMap.input.byte_offset = 0;
+    message.staticData.InvertMap.input.byte_length = chunk * sizeof(bool);
+    std::memcpy(message.variableData, &inputs[done], chunk * sizeof(bool));
+    message.variableDataLength = chunk * sizeof(bool);
+}
+
+Dll32To64_Call *InvertMapAsync(bool const* inputs, bool* results, int count) {
+    if (count <= 0)
+    {
+        return CompletedCall(msg::MSGID_InvertMap, DLL32TO64_ERROR_NONE);
+    }
+
+    if (shims[msg::MSGID_Invert].mode.load(std::memory_order_relaxed) == DLL32TO64_SHIM_ON)
+    {
+        for (int i = 0; i < count; i++) results[i] = local::Invert(inputs[i]);
+        return CompletedCall(msg::MSGID_InvertMap, DLL32TO64_ERROR_NONE);
+    }
+
+    msg::MessageData message = {};
+    InvertMapChunk(message, inputs, count, 0);
+
+    ALOG_DEBUG("InvertMap count={}", count);
+
+    // `done` counts the elements whose results arrived
+    return StartCall(message, [=, done = 0](msg::MessageData const &response, msg::MessageData &next) mutable
+    {
+        int const chunk = std::min(count - done, INVERT_MAP_CHUNK);
+        msg::VariableArray const out = response.staticData.InvertMapResponse.result;
+        if (out.byte_length != (int)(chunk * sizeof(bool)) || out.byte_offset < 0 ||
+            out.byte_offset + out.byte_length > (int)response.variableDataLength)
+        {
+            ALOG_ERROR("Invalid InvertMap response ({} bytes for {} elements)", out.byte_length, chunk);
+            return Dll32To64_Call::STEP_Failed;
+        }
+
+        std::memcpy(&results[done], &response.variableData[out.byte_offset], out.byte_length);
+        done += chunk;
+        if (done == count) return Dll32To64_Call::STEP_Done;
+
+        InvertMapChunk(next, inputs, count, done);
+        return Dll32To64_Call::STEP_Continue;
+    });
+}
+
+void InvertMap(bool const* inputs, bool* results, int count) {
+    FinishCall(InvertMapAsync(inputs, results, count));
+}
+
+Dll32To64_Call *InterleaveAsync(char const* s1, int size1, char const* s2, int size2, char* out) {
+    // Both strings have to fit into a single message
+    if (size1 < 0 || size2 < 0 || (unsigned)size1 + (unsigned)size2 > msg::MSG_MAX_VARIABLE_SIZE)
+    {
+        ALOG_ERROR("Data length exceeded ({}+{}>{})", size1, size2, msg::MSG_MAX_VARIABLE_SIZE);
+        return CompletedCall(msg::MSGID_Interleave, DLL32TO64_ERROR_ARGUMENTS);
+    }
 
     msg::MessageData message = {};
     msg::InitMessageData(message, msg::MSGID_Interleave, msg::DIRECTION_Request);
@@ -409,34 +2303,33 @@ void Interleave(char const* s1, int size1, char const* s2, int size2, char* out)
     message.staticData.Interleave.s2.byte_length = size2;
 
     message.variableDataLength = size1 + size2;
-    if (message.variableDataLength > sizeof(message.variableData))
-    {
-        PLOG_ERROR << "Data length exceeded (" << message.variableDataLength << ">" << sizeof(message.variableData) << ")";
-        return;
-    }
 
     memcpy(&message.variableData[0], s1, size1);
     memcpy(&message.variableData[size1], s2, size2);
 
-    msg::MessageData responseMessage = {};
-    if (!SendAndWaitForResponse(message, responseMessage)) return;
+    ALOG_DEBUG("Interleave s1={} s2={}", alog::Chars{s1, (size_t)size1}, alog::Chars{s2, (size_t)size2});
 
-    size_t const responseVdSize = responseMessage.staticData.InterleaveResponse.out.byte_length;
-    if (responseVdSize > sizeof(responseMessage.variableData))
+    return StartCall(message, [out](msg::MessageData const &response, msg::MessageData &)
     {
-        PLOG_ERROR << "Response data length exceeded (" << responseVdSize << ">" << sizeof(responseMessage.variableData) << ")";
-        return;
-    }
+        msg::VariableArray const result = response.staticData.InterleaveResponse.out;
+        if (result.byte_length < 0 || result.byte_offset < 0 ||
+            result.byte_offset + result.byte_length > (int)response.variableDataLength)
+        {
+            ALOG_ERROR("Response data length exceeded ({}>{})", result.byte_length, response.variableDataLength);
+            return Dll32To64_Call::STEP_Failed;
+        }
 
-    std::memcpy(out,
-                &responseMessage.variableData[responseMessage.staticData.InterleaveResponse.out.byte_offset],
-                responseVdSize);
+        std::memcpy(out, &response.variableData[result.byte_offset], result.byte_length);
+        return Dll32To64_Call::STEP_Done;
+    });
 }
 
-void SetCallback(TCallback cb)
-{
-    if (!EnsureWrapperConnection()) return;
+void Interleave(char const* s1, int size1, char const* s2, int size2, char* out) {
+    FinishCall(InterleaveAsync(s1, size1, s2, size2, out));
+}
 
+Dll32To64_Call *SetCallbackAsync(TCallback cb)
+{
     // Store callback pointer before sending message, in case the first callback arrives before SetCallback's response
     // arrives
     callback = cb;
@@ -444,6 +2337,192 @@ void SetCallback(TCallback cb)
     msg::MessageData message = {};
     msg::InitMessageData(message, msg::MSGID_SetCallback, msg::DIRECTION_Request);
 
-    msg::MessageData response = {};
-    if (!SendAndWaitForResponse(message, response)) return;
+    return StartCall(message, [](msg::MessageData const &, msg::MessageData &)
+    {
+        return Dll32To64_Call::STEP_Done;
+    });
+}
+
+void SetCallback(TCallback cb)
+{
+    FinishCall(SetCallbackAsync(cb));
+}
+
+Dll32To64_Call *ScaleRecordsAsync(Record* records, int count, double factor)
+{
+    assert(recordLayout.Size(msg::ABI_NATIVE) == sizeof(Record));
+    size_t const dataSize = count < 0 ? 0 : (size_t)count * recordLayout.Size(msg::ABI_32);
+
+    msg::MessageData message = {};
+    msg::InitMessageData(message, msg::MSGID_ScaleRecords, msg::DIRECTION_Request);
+    if (dataSize > msg::MSG_MAX_VARIABLE_SIZE)
+    {
+        ALOG_ERROR("Data length exceeded ({}>{})", dataSize, msg::MSG_MAX_VARIABLE_SIZE);
+        return CompletedCall(msg::MSGID_ScaleRecords, DLL32TO64_ERROR_ARGUMENTS);
+    }
+
+    message.staticData.ScaleRecords.count = count;
+    message.staticData.ScaleRecords.factor = factor;
+    message.staticData.ScaleRecords.records.byte_offset = 0;
+    message.staticData.ScaleRecords.records.byte_length = dataSize;
+    message.variableDataLength = dataSize;
+    recordLayout.Narrow(records, message.variableData, count);
+
+    ALOG_DEBUG("ScaleRecords count={} factor={}", count, factor);
+
+    return StartCall(message, [records, count, dataSize](msg::MessageData const &response, msg::MessageData &)
+    {
+        msg::VariableArray const out = response.staticData.ScaleRecordsResponse.records;
+        if ((size_t)out.byte_length != dataSize || out.byte_offset < 0 ||
+            out.byte_offset + dataSize > response.variableDataLength)
+        {
+            ALOG_ERROR("Unexpected response data length {} (expected {})", out.byte_length, dataSize);
+            return Dll32To64_Call::STEP_Failed;
+        }
+
+        recordLayout.Widen(&response.variableData[out.byte_offset], records, count);
+        return Dll32To64_Call::STEP_Done;
+    });
+}
+
+void ScaleRecords(Record* records, int count, double factor)
+{
+    FinishCall(ScaleRecordsAsync(records, count, factor));
+}
+
+Dll32To64_Call *CreateBufferAsync(int size, Buffer** result)
+{
+    msg::MessageData message = {};
+    msg::InitMessageData(message, msg::MSGID_CreateBuffer, msg::DIRECTION_Request);
+    message.staticData.CreateBuffer.size = size;
+
+    return StartCall(message, [result](msg::MessageData const &response, msg::MessageData &)
+    {
+        *result = FromHandle<Buffer>(response.staticData.CreateBufferResponse.buffer);
+        if (*result != NULL) liveHandles.fetch_add(1);
+        return Dll32To64_Call::STEP_Done;
+    });
+}
+
+Buffer* CreateBuffer(int size)
+{
+    Buffer* result = NULL;
+    FinishCall(CreateBufferAsync(size, &result));
+    return result;
+}
+
+/* Request to write the part of data that starts at `written`. Writes that don't fit into a single message are split. */
+static void WriteBufferChunk(msg::MessageData &message, Buffer* buffer, int offset, char const* data, int size, int written)
+{
+    int const chunk = std::min(size - written, (int)msg::MSG_MAX_VARIABLE_SIZE);
+
+    msg::InitMessageData(message, msg::MSGID_WriteBuffer, msg::DIRECTION_Request);
+    message.staticData.WriteBuffer.buffer = HandleOf(buffer);
+    message.staticData.WriteBuffer.offset = offset + written;
+    message.staticData.WriteBuffer.data.byte_offset = 0;
+    message.staticData.WriteBuffer.data.byte_length = chunk;
+    message.variableDataLength = chunk;
+    std::memcpy(message.variableData, &data[written], chunk);
+}
+
+Dll32To64_Call *WriteBufferAsync(Buffer* buffer, int offset, char const* data, int size, int* written)
+{
+    *written = 0;
+    if (size <= 0)
+    {
+        return CompletedCall(msg::MSGID_WriteBuffer, DLL32TO64_ERROR_NONE);
+    }
+
+    msg::MessageData message = {};
+    WriteBufferChunk(message, buffer, offset, data, size, 0);
+
+    return StartCall(message, [=](msg::MessageData const &response, msg::MessageData &next)
+    {
+        int const chunk = std::min(size - *written, (int)msg::MSG_MAX_VARIABLE_SIZE);
+        int const chunkWritten = response.staticData.WriteBufferResponse.written;
+        *written += std::max(std::min(chunkWritten, chunk), 0);
+        if (chunkWritten < chunk || *written == size) return Dll32To64_Call::STEP_Done;
+
+        WriteBufferChunk(next, buffer, offset, data, size, *written);
+        return Dll32To64_Call::STEP_Continue;
+    });
+}
+
+int WriteBuffer(Buffer* buffer, int offset, char const* data, int size)
+{
+    int written = 0;
+    FinishCall(WriteBufferAsync(buffer, offset, data, size, &written));
+    return written;
+}
+
+/* Request to read the part of out that starts at `read`. Reads that don't fit into a single message are split. */
+static void ReadBufferChunk(msg::MessageData &message, Buffer* buffer, int offset, int size, int read)
+{
+    msg::InitMessageData(message, msg::MSGID_ReadBuffer, msg::DIRECTION_Request);
+    message.staticData.ReadBuffer.buffer = HandleOf(buffer);
+    message.staticData.ReadBuffer.offset = offset + read;
+    message.staticData.ReadBuffer.size = std::min(size - read, (int)msg::MSG_MAX_VARIABLE_SIZE);
+}
+
+Dll32To64_Call *ReadBufferAsync(Buffer* buffer, int offset, char* out, int size, int* read)
+{
+    *read = 0;
+    if (size <= 0)
+    {
+        return CompletedCall(msg::MSGID_ReadBuffer, DLL32TO64_ERROR_NONE);
+    }
+
+    msg::MessageData message = {};
+    ReadBufferChunk(message, buffer, offset, size, 0);
+
+    return StartCall(message, [=](msg::MessageData const &response, msg::MessageData &next)
+    {
+        int const chunk = std::min(size - *read, (int)msg::MSG_MAX_VARIABLE_SIZE);
+        msg::VariableArray const data = response.staticData.ReadBufferResponse.data;
+        int const chunkRead = response.staticData.ReadBufferResponse.read;
+        if (chunkRead < 0 || chunkRead > chunk || data.byte_length != chunkRead || data.byte_offset < 0 ||
+            data.byte_offset + data.byte_length > (int)response.variableDataLength)
+        {
+            ALOG_ERROR("Invalid ReadBuffer response ({} bytes for {} requested)", chunkRead, chunk);
+            return Dll32To64_Call::STEP_Failed;
+        }
+
+        std::memcpy(&out[*read], &response.variableData[data.byte_offset], chunkRead);
+        *read += chunkRead;
+        if (chunkRead < chunk || *read == size) return Dll32To64_Call::STEP_Done;
+
+        ReadBufferChunk(next, buffer, offset, size, *read);
+        return Dll32To64_Call::STEP_Continue;
+    });
+}
+
+int ReadBuffer(Buffer* buffer, int offset, char* out, int size)
+{
+    int read = 0;
+    FinishCall(ReadBufferAsync(buffer, offset, out, size, &read));
+    return read;
+}
+
+Dll32To64_Call *DestroyBufferAsync(Buffer* buffer)
+{
+    if (buffer == NULL)
+    {
+        return CompletedCall(msg::MSGID_DestroyBuffer, DLL32TO64_ERROR_NONE);
+    }
+
+    msg::MessageData message = {};
+    msg::InitMessageData(message, msg::MSGID_DestroyBuffer, msg::DIRECTION_Request);
+    message.staticData.DestroyBuffer.buffer = HandleOf(buffer);
+
+    return StartCall(message, [](msg::MessageData const &, msg::MessageData &)
+    {
+        // Only once the wrapper freed it. A call that fails or is cancelled may have left it alive.
+        liveHandles.fetch_sub(1);
+        return Dll32To64_Call::STEP_Done;
+    });
+}
+
+void DestroyBuffer(Buffer* buffer)
+{
+    FinishCall(DestroyBufferAsync(buffer));
 }
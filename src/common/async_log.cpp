@@ -0,0 +1,367 @@
+#include "async_log.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace alog {
+
+namespace {
+
+/* Time the background thread sleeps when the ring is empty. */
+unsigned const IDLE_SLEEP_MS = 5;
+
+/* Argument as stored in a record. Strings and arrays are copied into the record's payload. */
+struct StoredArg
+{
+    ArgType type;
+    uint8_t elementSize;
+    uint16_t payloadOffset;
+    uint32_t count;
+    union {
+        int64_t i;
+        uint64_t u;
+        double d;
+        void const *p;
+    } value;
+};
+
+struct Slot
+{
+    // Position in the ring this slot is ready for, see Push() and Pop()
+    std::atomic<uint32_t> sequence;
+
+    plog::Severity severity;
+    plog::util::Time time;
+    unsigned int tid;
+    unsigned line;
+    char const *func;
+    char const *format;
+    unsigned numArgs;
+    StoredArg args[MAX_ARGS];
+    char payload[PAYLOAD_SIZE];
+};
+
+/* Record that reports the time and thread of the original call instead of those of the background thread. */
+class AsyncRecord : public plog::Record
+{
+public:
+    AsyncRecord(Slot const &slot)
+        : plog::Record(slot.severity, slot.func, slot.line, "", nullptr, PLOG_DEFAULT_INSTANCE_ID),
+          time_(slot.time), tid_(slot.tid)
+    {}
+
+    plog::util::Time const& getTime() const override { return time_; }
+    unsigned int getTid() const override { return tid_; }
+
+private:
+    plog::util::Time time_;
+    unsigned int tid_;
+};
+
+/*
+ * Bounded multi-producer single-consumer ring (after D. Vyukov's bounded MPMC queue).
+ *
+ * Each slot's sequence tells whether it can be written for a given enqueue position (sequence == position) or read for a
+ * given dequeue position (sequence == position + 1). Producers claim a position with a CAS and never wait for each other.
+ */
+Slot ring[RING_CAPACITY];
+std::atomic<uint32_t> enqueuePos(0);
+uint32_t dequeuePos = 0;  // Only accessed by the background thread
+
+// Serializes Start() and Stop(), which may be called by different threads
+std::mutex controlMutex;
+std::atomic<bool> asyncMode(false);
+std::atomic<bool> stopRequested(false);
+std::atomic<uint64_t> dropped(0);
+std::thread writerThread;
+
+void Store(Slot &slot, plog::Severity severity, char const *func, unsigned line, char const *format, Arg const *args,
+           unsigned numArgs)
+{
+    slot.severity = severity;
+    plog::util::ftime(&slot.time);
+    slot.tid = plog::util::gettid();
+    slot.line = line;
+    slot.func = func;
+    slot.format = format;
+    slot.numArgs = numArgs;
+
+    unsigned payloadUsed = 0;
+    for (unsigned i = 0; i < numArgs; i++)
+    {
+        Arg const &arg = args[i];
+        StoredArg &stored = slot.args[i];
+        stored.type = arg.type;
+        stored.elementSize = arg.elementSize;
+        stored.count = arg.count;
+        stored.value.u = arg.value.u;
+
+        if (arg.type == ARG_String || arg.type >= ARG_SignedArray)
+        {
+            // Copy as many characters/elements as fit into the remaining payload
+            unsigned const elementSize = arg.type == ARG_String ? 1 : arg.elementSize;
+            unsigned const fitting = std::min<size_t>(arg.count, (PAYLOAD_SIZE - payloadUsed) / elementSize);
+            std::memcpy(&slot.payload[payloadUsed], arg.value.p, fitting * elementSize);
+            stored.payloadOffset = payloadUsed;
+            stored.count = fitting;
+            // Remember the original count, so truncation is visible in the output
+            stored.value.u = arg.count;
+            payloadUsed += fitting * elementSize;
+        }
+    }
+}
+
+bool Push(plog::Severity severity, char const *func, unsigned line, char const *format, Arg const *args,
+          unsigned numArgs)
+{
+    uint32_t pos = enqueuePos.load(std::memory_order_relaxed);
+    Slot *slot;
+    while (true)
+    {
+        slot = &ring[pos & (RING_CAPACITY - 1)];
+        uint32_t const sequence = slot->sequence.load(std::memory_order_acquire);
+        int32_t const diff = (int32_t)(sequence - pos);
+        if (diff == 0)
+        {
+            if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+        }
+        else if (diff < 0)
+        {
+            // Ring is full
+            return false;
+        }
+        else
+        {
+            pos = enqueuePos.load(std::memory_order_relaxed);
+        }
+    }
+
+    Store(*slot, severity, func, line, format, args, numArgs);
+    slot->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+}
+
+template <typename T>
+void AppendArray(std::string &out, char const *data, uint32_t count, uint64_t originalCount, char const *fmt)
+{
+    char buf[32];
+    out += "[";
+    for (uint32_t i = 0; i < count; i++)
+    {
+        T value;
+        std::memcpy(&value, &data[i * sizeof(T)], sizeof(T));
+        snprintf(buf, sizeof(buf), fmt, value);
+        out += buf;
+        out += ", ";
+    }
+    if (originalCount > count) out += "..., ";
+    out += "]";
+}
+
+/*
+ * Append an argument to out. For strings and arrays, data holds arg.count of the arg.value.u characters/elements of the
+ * original argument.
+ */
+void AppendArg(std::string &out, StoredArg const &arg, char const *data)
+{
+    char buf[32];
+
+    switch (arg.type)
+    {
+        case ARG_Signed:   snprintf(buf, sizeof(buf), "%" PRId64, arg.value.i); out += buf; break;
+        case ARG_Unsigned: snprintf(buf, sizeof(buf), "%" PRIu64, arg.value.u); out += buf; break;
+        case ARG_Double:   snprintf(buf, sizeof(buf), "%g", arg.value.d); out += buf; break;
+        case ARG_Pointer:  snprintf(buf, sizeof(buf), "%p", arg.value.p); out += buf; break;
+        case ARG_String:
+        {
+            out.append(data, strnlen(data, arg.count));
+            if (arg.value.u > arg.count) out += "...";
+        } break;
+        case ARG_SignedArray:
+        {
+            switch (arg.elementSize)
+            {
+                case 1: AppendArray<int8_t>(out, data, arg.count, arg.value.u, "%" PRId8); break;
+                case 2: AppendArray<int16_t>(out, data, arg.count, arg.value.u, "%" PRId16); break;
+                case 4: AppendArray<int32_t>(out, data, arg.count, arg.value.u, "%" PRId32); break;
+                default: AppendArray<int64_t>(out, data, arg.count, arg.value.u, "%" PRId64); break;
+            }
+        } break;
+        case ARG_UnsignedArray:
+        {
+            switch (arg.elementSize)
+            {
+                case 1: AppendArray<uint8_t>(out, data, arg.count, arg.value.u, "%" PRIu8); break;
+                case 2: AppendArray<uint16_t>(out, data, arg.count, arg.value.u, "%" PRIu16); break;
+                case 4: AppendArray<uint32_t>(out, data, arg.count, arg.value.u, "%" PRIu32); break;
+                default: AppendArray<uint64_t>(out, data, arg.count, arg.value.u, "%" PRIu64); break;
+            }
+        } break;
+        case ARG_DoubleArray:
+        {
+            if (arg.elementSize == sizeof(float)) AppendArray<float>(out, data, arg.count, arg.value.u, "%g");
+            else AppendArray<double>(out, data, arg.count, arg.value.u, "%g");
+        } break;
+    }
+}
+
+/* Replace the "{}" placeholders of format by the arguments, which appendArg(out, index) appends. */
+template <typename AppendArgFunction>
+std::string Format(char const *format, unsigned numArgs, AppendArgFunction appendArg)
+{
+    std::string out;
+    unsigned nextArg = 0;
+    for (char const *c = format; *c != '\0'; c++)
+    {
+        if (c[0] == '{' && c[1] == '}' && nextArg < numArgs)
+        {
+            appendArg(out, nextArg++);
+            c++;
+        }
+        else
+        {
+            out += *c;
+        }
+    }
+
+    return out;
+}
+
+void WriteToPlog(Slot const &slot)
+{
+    plog::Logger<PLOG_DEFAULT_INSTANCE_ID> *logger = plog::get();
+    if (logger == nullptr) return;
+
+    AsyncRecord record(slot);
+    record << Format(slot.format, slot.numArgs, [&slot](std::string &out, unsigned index)
+    {
+        StoredArg const &arg = slot.args[index];
+        AppendArg(out, arg, &slot.payload[arg.payloadOffset]);
+    });
+    logger->write(record);
+}
+
+/* Format a record from the caller's arguments and write it right away. Nothing is truncated. */
+void WriteToPlog(plog::Severity severity, char const *func, unsigned line, char const *format, Arg const *args,
+                 unsigned numArgs)
+{
+    plog::Logger<PLOG_DEFAULT_INSTANCE_ID> *logger = plog::get();
+    if (logger == nullptr) return;
+
+    plog::Record record(severity, func, line, "", nullptr, PLOG_DEFAULT_INSTANCE_ID);
+    record << Format(format, numArgs, [args](std::string &out, unsigned index)
+    {
+        Arg const &arg = args[index];
+        StoredArg stored = {};
+        stored.type = arg.type;
+        stored.elementSize = arg.elementSize;
+        stored.count = arg.count;
+        stored.value.u = arg.value.u;
+        // Strings and arrays are complete
+        if (arg.type == ARG_String || arg.type >= ARG_SignedArray) stored.value.u = arg.count;
+        AppendArg(out, stored, (char const*)arg.value.p);
+    });
+    logger->write(record);
+}
+
+/* Write the next record in the ring, if there is one. */
+bool Pop()
+{
+    Slot &slot = ring[dequeuePos & (RING_CAPACITY - 1)];
+    if (slot.sequence.load(std::memory_order_acquire) != dequeuePos + 1)
+    {
+        return false;
+    }
+
+    WriteToPlog(slot);
+
+    // Make the slot available for the producer one lap ahead
+    slot.sequence.store(dequeuePos + RING_CAPACITY, std::memory_order_release);
+    dequeuePos++;
+    return true;
+}
+
+void ReportDropped()
+{
+    uint64_t const count = dropped.exchange(0);
+    if (count > 0)
+    {
+        PLOG_WARNING << count << " log records dropped because the ring buffer was full";
+    }
+}
+
+void WriterTask()
+{
+    while (!stopRequested.load())
+    {
+        if (!Pop())
+        {
+            ReportDropped();
+            std::this_thread::sleep_for(std::chrono::milliseconds(IDLE_SLEEP_MS));
+        }
+    }
+
+    // Drain what is left, including records whose producers claimed a slot before Stop() but haven't stored them yet
+    while (dequeuePos != enqueuePos.load())
+    {
+        if (!Pop()) std::this_thread::yield();
+    }
+    ReportDropped();
+}
+
+} // end anonymous namespace
+
+void Dispatch(plog::Severity severity, char const *func, unsigned line, char const *format, Arg const *args,
+              unsigned numArgs)
+{
+    if (asyncMode.load(std::memory_order_relaxed))
+    {
+        if (!Push(severity, func, line, format, args, numArgs))
+        {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+        }
+        return;
+    }
+
+    WriteToPlog(severity, func, line, format, args, numArgs);
+}
+
+void Start()
+{
+    std::lock_guard<std::mutex> guard(controlMutex);
+    if (asyncMode.load())
+    {
+        return;
+    }
+
+    for (uint32_t i = 0; i < RING_CAPACITY; i++)
+    {
+        ring[i].sequence.store(enqueuePos.load() + i, std::memory_order_relaxed);
+    }
+    dequeuePos = enqueuePos.load();
+
+    stopRequested.store(false);
+    writerThread = std::thread(WriterTask);
+    asyncMode.store(true);
+}
+
+void Stop()
+{
+    std::lock_guard<std::mutex> guard(controlMutex);
+    // Records pushed after this are written synchronously. The writer drains everything that was pushed before.
+    if (!asyncMode.exchange(false))
+    {
+        return;
+    }
+
+    stopRequested.store(true);
+    if (writerThread.joinable()) writerThread.join();
+}
+
+} // end namespace
@@ -0,0 +1,202 @@
+/**
+ * Logging for sites on the call path, with an optional asynchronous mode.
+ *
+ * The ALOG_* macros take a format string with "{}" placeholders and its arguments:
+ *
+ *   ALOG_DEBUG("Received Response {} (call {})", response.id, response.callId);
+ *
+ * If the severity is not enabled in plog, neither the arguments are evaluated nor anything is formatted. Otherwise:
+ *
+ * * In synchronous mode, the message is formatted and written to plog right away, like with the PLOG_* macros.
+ * * In asynchronous mode (see Start()), the arguments are copied as a compact binary record into a lock-free ring buffer.
+ *   A background thread formats the records and writes them to plog, whose RollingFileAppender takes care of rotation.
+ *   If the ring is full, records are dropped instead of blocking the caller. The number of dropped records is logged.
+ *
+ * Strings and arrays are copied into the record, so they don't need to outlive the call. Use Chars() for strings that
+ * are not 0-terminated and Array() for arrays of numbers.
+ */
+
+#ifndef DLL32TO64_ASYNC_LOG_H
+#define DLL32TO64_ASYNC_LOG_H
+
+#include <plog/Log.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+namespace alog {
+
+/* Number of records in the ring buffer. Must be a power of two. */
+unsigned const RING_CAPACITY = 4096;
+/* Maximum number of arguments per record. */
+unsigned const MAX_ARGS = 8;
+/* Bytes available per record for copies of strings and arrays. Longer ones are truncated in asynchronous mode. */
+unsigned const PAYLOAD_SIZE = 192;
+
+static_assert((RING_CAPACITY & (RING_CAPACITY - 1)) == 0, "RING_CAPACITY must be a power of two");
+
+enum ArgType : uint8_t
+{
+    ARG_Signed,
+    ARG_Unsigned,
+    ARG_Double,
+    ARG_Pointer,
+    ARG_String,
+    ARG_SignedArray,
+    ARG_UnsignedArray,
+    ARG_DoubleArray,
+};
+
+/* A single argument, referring to the caller's data until it is copied into a record. */
+struct Arg
+{
+    ArgType type;
+    uint8_t elementSize;
+    uint32_t count;  // Number of characters/elements for strings and arrays
+    union {
+        int64_t i;
+        uint64_t u;
+        double d;
+        void const *p;
+    } value;
+};
+
+/* String of a given length, which does not need to be 0-terminated. */
+struct Chars
+{
+    char const *data;
+    size_t length;
+};
+
+/* Array of arithmetic values. */
+template <typename T>
+struct ArrayRef
+{
+    T const *data;
+    size_t count;
+};
+
+template <typename T>
+ArrayRef<T> Array(T const *data, size_t count)
+{
+    static_assert(std::is_arithmetic<T>::value, "Only arrays of numbers can be logged");
+    return ArrayRef<T>{data, count};
+}
+
+template <typename T, typename std::enable_if<std::is_arithmetic<T>::value || std::is_enum<T>::value, int>::type = 0>
+Arg MakeArg(T const &value)
+{
+    Arg arg = {};
+    if (std::is_floating_point<T>::value)
+    {
+        arg.type = ARG_Double;
+        arg.value.d = (double)value;
+    }
+    else if (std::is_signed<T>::value || std::is_enum<T>::value)
+    {
+        arg.type = ARG_Signed;
+        arg.value.i = (int64_t)value;
+    }
+    else
+    {
+        arg.type = ARG_Unsigned;
+        arg.value.u = (uint64_t)value;
+    }
+    return arg;
+}
+
+template <typename T>
+Arg MakeArg(T *value)
+{
+    Arg arg = {};
+    arg.type = ARG_Pointer;
+    arg.value.p = value;
+    return arg;
+}
+
+inline Arg MakeArg(char const *value)
+{
+    Arg arg = {};
+    arg.type = ARG_String;
+    // The full length, so truncation is visible in the output
+    arg.count = value != nullptr ? strlen(value) : 0;
+    arg.value.p = value;
+    return arg;
+}
+
+inline Arg MakeArg(char *value)
+{
+    return MakeArg((char const*)value);
+}
+
+template <size_t N>
+Arg MakeArg(char const (&value)[N])
+{
+    Arg arg = {};
+    arg.type = ARG_String;
+    arg.count = strnlen(value, N);
+    arg.value.p = value;
+    return arg;
+}
+
+inline Arg MakeArg(Chars const &value)
+{
+    Arg arg = {};
+    arg.type = ARG_String;
+    arg.count = value.length;
+    arg.value.p = value.data;
+    return arg;
+}
+
+template <typename T>
+Arg MakeArg(ArrayRef<T> const &value)
+{
+    Arg arg = {};
+    arg.type = std::is_floating_point<T>::value ? ARG_DoubleArray
+                                                : (std::is_signed<T>::value ? ARG_SignedArray : ARG_UnsignedArray);
+    arg.elementSize = sizeof(T);
+    arg.count = value.count;
+    arg.value.p = value.data;
+    return arg;
+}
+
+/* True if records of the given severity end up in the log. */
+inline bool ShouldLog(plog::Severity severity)
+{
+    plog::Logger<PLOG_DEFAULT_INSTANCE_ID> const *logger = plog::get();
+    return logger != nullptr && logger->checkSeverity(severity);
+}
+
+/* Write a record, either right away or via the ring buffer. Use the ALOG_* macros instead. */
+void Dispatch(plog::Severity severity, char const *func, unsigned line, char const *format, Arg const *args,
+              unsigned numArgs);
+
+template <typename... Args>
+void Write(plog::Severity severity, char const *func, unsigned line, char const *format, Args const&... args)
+{
+    static_assert(sizeof...(Args) <= MAX_ARGS, "Too many log arguments");
+
+    // Additional element, so the array is never empty
+    Arg const packed[] = { MakeArg(args)..., Arg{} };
+    Dispatch(severity, func, line, format, packed, sizeof...(Args));
+}
+
+/* Switch to asynchronous mode and start the background thread. plog must already be initialized. */
+void Start();
+
+/* Write all pending records, stop the background thread and switch back to synchronous mode. */
+void Stop();
+
+} // end namespace
+
+#define ALOG_(severity, format, ...) \
+    do { if (alog::ShouldLog(severity)) alog::Write(severity, PLOG_GET_FUNC(), __LINE__, format, ##__VA_ARGS__); } while (false)
+
+#define ALOG_DEBUG(format, ...)   ALOG_(plog::debug, format, ##__VA_ARGS__)
+#define ALOG_INFO(format, ...)    ALOG_(plog::info, format, ##__VA_ARGS__)
+#define ALOG_WARNING(format, ...) ALOG_(plog::warning, format, ##__VA_ARGS__)
+#define ALOG_ERROR(format, ...)   ALOG_(plog::error, format, ##__VA_ARGS__)
+
+#endif // DLL32TO64_ASYNC_LOG_H
@@ -0,0 +1,237 @@
+#include "capture.h"
+#include "msg_protocol.h"
+#include "trace.h"
+
+#include <windows.h>
+
+#include <atomic>
+#include <cstring>
+#include <thread>
+
+namespace capture {
+
+namespace {
+
+HANDLE file = INVALID_HANDLE_VALUE;
+HANDLE mapping = NULL;
+FileHeader *header = nullptr;
+char *data = nullptr;
+uint64_t dataCapacity = 0;
+
+std::atomic<bool> active(false);
+// Number of threads currently inside Record(), Stop() waits for them before unmapping the file
+std::atomic<unsigned> writers(0);
+std::atomic<uint64_t> writePos(0);
+std::atomic<uint64_t> dropped(0);
+
+uint64_t PaddedSize(uint64_t size)
+{
+    return (size + RECORD_ALIGNMENT - 1) & ~(uint64_t)(RECORD_ALIGNMENT - 1);
+}
+
+void Close()
+{
+    if (header != nullptr) UnmapViewOfFile(header);
+    if (mapping != NULL) CloseHandle(mapping);
+    if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+    header = nullptr;
+    data = nullptr;
+    mapping = NULL;
+    file = INVALID_HANDLE_VALUE;
+}
+
+} // end anonymous namespace
+
+bool Start(char const *path, uint64_t capacity)
+{
+    if (active.load() || capacity <= sizeof(FileHeader))
+    {
+        return false;
+    }
+
+    file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        return false;
+    }
+
+    // Mapping a file beyond its end grows it, so this reserves the whole capacity
+    mapping = CreateFileMappingA(file, NULL, PAGE_READWRITE, (DWORD)(capacity >> 32), (DWORD)capacity, NULL);
+    if (mapping == NULL)
+    {
+        Close();
+        return false;
+    }
+
+    header = (FileHeader*)MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, (SIZE_T)capacity);
+    if (header == nullptr)
+    {
+        Close();
+        return false;
+    }
+
+    std::memcpy(header->magic, FILE_MAGIC, sizeof(FILE_MAGIC));
+    header->version = FILE_VERSION;
+    header->protocolVersion = msg::PROTOCOL_VERSION;
+    header->dataSize = 0;
+    header->dropped = 0;
+
+    data = (char*)header + PaddedSize(sizeof(FileHeader));
+    dataCapacity = capacity - PaddedSize(sizeof(FileHeader));
+    writePos.store(0);
+    dropped.store(0);
+    active.store(true);
+    return true;
+}
+
+bool IsActive()
+{
+    return active.load(std::memory_order_relaxed);
+}
+
+void Record(RecordKind kind, char const *frame, int length)
+{
+    if (!IsActive() || length <= 0)
+    {
+        return;
+    }
+
+    writers.fetch_add(1);
+    if (!active.load())
+    {
+        // Stop() is already waiting for the file to become unused
+        writers.fetch_sub(1);
+        return;
+    }
+
+    int64_t const now = trace::Now();
+    uint64_t const size = PaddedSize(sizeof(RecordHeader) + length);
+    uint64_t const offset = writePos.fetch_add(size, std::memory_order_relaxed);
+
+    if (offset + size > dataCapacity)
+    {
+        dropped.fetch_add(1, std::memory_order_relaxed);
+        writers.fetch_sub(1);
+        return;
+    }
+
+    RecordHeader *record = (RecordHeader*)&data[offset];
+    record->length = length;
+    record->kind = kind;
+    record->timestamp = now;
+    std::memcpy(&data[offset + sizeof(RecordHeader)], frame, length);
+
+    writers.fetch_sub(1);
+}
+
+void Stop()
+{
+    if (!active.exchange(false))
+    {
+        return;
+    }
+
+    while (writers.load() > 0)
+    {
+        std::this_thread::yield();
+    }
+
+    // Reservations that didn't fit still advanced writePos
+    uint64_t used = writePos.load();
+    if (used > dataCapacity)
+    {
+        // Find the end of the last record that fit
+        uint64_t pos = 0;
+        while (pos < dataCapacity)
+        {
+            RecordHeader const *record = (RecordHeader const*)&data[pos];
+            uint64_t const next = pos + PaddedSize(sizeof(RecordHeader) + record->length);
+            if (record->length == 0 || next > dataCapacity) break;
+            pos = next;
+        }
+        used = pos;
+    }
+
+    header->dataSize = used;
+    header->dropped = dropped.load();
+    FlushViewOfFile(header, 0);
+
+    uint64_t const fileSize = PaddedSize(sizeof(FileHeader)) + used;
+    UnmapViewOfFile(header);
+    header = nullptr;
+    CloseHandle(mapping);
+    mapping = NULL;
+
+    LARGE_INTEGER end;
+    end.QuadPart = fileSize;
+    if (SetFilePointerEx(file, end, NULL, FILE_BEGIN)) SetEndOfFile(file);
+
+    Close();
+}
+
+Reader::~Reader()
+{
+    if (header_ != nullptr) UnmapViewOfFile(header_);
+    if (mapping_ != nullptr) CloseHandle(mapping_);
+    if (file_ != nullptr) CloseHandle(file_);
+}
+
+bool Reader::Open(char const *path)
+{
+    HANDLE const f = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (f == INVALID_HANDLE_VALUE)
+    {
+        return false;
+    }
+    file_ = f;
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(f, &size) || (uint64_t)size.QuadPart < PaddedSize(sizeof(FileHeader)))
+    {
+        return false;
+    }
+
+    mapping_ = CreateFileMappingA(f, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping_ == NULL)
+    {
+        mapping_ = nullptr;
+        return false;
+    }
+
+    header_ = (FileHeader const*)MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0);
+    if (header_ == nullptr)
+    {
+        return false;
+    }
+
+    if (std::memcmp(header_->magic, FILE_MAGIC, sizeof(FILE_MAGIC)) != 0 || header_->version != FILE_VERSION ||
+        PaddedSize(sizeof(FileHeader)) + header_->dataSize > (uint64_t)size.QuadPart)
+    {
+        return false;
+    }
+
+    data_ = (char const*)header_ + PaddedSize(sizeof(FileHeader));
+    position_ = 0;
+    return true;
+}
+
+bool Reader::Next(RecordHeader const *&record, char const *&frame)
+{
+    if (header_ == nullptr || position_ + sizeof(RecordHeader) > header_->dataSize)
+    {
+        return false;
+    }
+
+    record = (RecordHeader const*)&data_[position_];
+    uint64_t const next = position_ + PaddedSize(sizeof(RecordHeader) + record->length);
+    if (record->length == 0 || next > header_->dataSize)
+    {
+        return false;
+    }
+
+    frame = &data_[position_ + sizeof(RecordHeader)];
+    position_ = next;
+    return true;
+}
+
+} // end namespace
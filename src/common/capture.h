@@ -0,0 +1,110 @@
+/**
+ * Capture of all frames exchanged between bridge and wrapper into a memory-mapped, append-only file.
+ *
+ * The file starts with a FileHeader, followed by records. Each record consists of a RecordHeader and the serialized
+ * message exactly as it was sent or received, padded to a multiple of RECORD_ALIGNMENT bytes.
+ *
+ * The file is mapped with a fixed capacity. Writers reserve space for a record with a single atomic add, so capturing
+ * never takes a lock. Records that don't fit anymore are dropped. When the capture is stopped, the file is truncated to
+ * its used size.
+ *
+ * Captures are replayed by dll32to64-replay.
+ */
+
+#ifndef DLL32TO64_CAPTURE_H
+#define DLL32TO64_CAPTURE_H
+
+#include <cstdint>
+
+namespace capture {
+
+/* Identifies a capture file. */
+char const FILE_MAGIC[8] = {'D', '3', '2', '6', '4', 'C', 'A', 'P'};
+/* Incremented whenever the file layout changes. */
+uint32_t const FILE_VERSION = 1;
+/* Records start at multiples of this. */
+unsigned const RECORD_ALIGNMENT = 8;
+/* Capacity of a capture file if none is given. */
+uint64_t const DEFAULT_CAPACITY = 256ull * 1024 * 1024;
+
+enum RecordKind : uint8_t
+{
+    RECORD_Request,   // Bridge -> Wrapper
+    RECORD_Response,  // Wrapper -> Bridge
+    RECORD_Callback,  // Wrapper -> Bridge on the callback connection
+};
+
+#pragma pack(push, 8)
+struct FileHeader
+{
+    char magic[8];
+    uint32_t version;
+    // msg::PROTOCOL_VERSION of the captured frames
+    uint32_t protocolVersion;
+    // Number of bytes used by records after this header
+    uint64_t dataSize;
+    // Number of records dropped because the file was full
+    uint64_t dropped;
+};
+
+struct RecordHeader
+{
+    // Length of the frame following this header (without padding)
+    uint32_t length;
+    RecordKind kind;
+    uint8_t reserved[3];
+    // Time of sending/receiving the frame in microseconds (see trace::Now())
+    int64_t timestamp;
+};
+#pragma pack(pop)
+
+/*
+ * Create the capture file and start capturing.
+ *
+ * @param path: Path of the capture file. Existing files are overwritten.
+ * @param capacity: Maximum size of the capture file in bytes.
+ */
+bool Start(char const *path, uint64_t capacity);
+
+/* True if frames are currently captured. */
+bool IsActive();
+
+/* Append a frame to the capture. Does nothing if capturing is not active. */
+void Record(RecordKind kind, char const *frame, int length);
+
+/* Stop capturing and truncate the file to its used size. */
+void Stop();
+
+/* Sequential read access to a capture file. */
+class Reader
+{
+public:
+    Reader() = default;
+    ~Reader();
+
+    Reader(Reader const&) = delete;
+    Reader& operator=(Reader const&) = delete;
+
+    /* Map the capture file at path. */
+    bool Open(char const *path);
+
+    /* Header of the opened file. */
+    FileHeader const& Header() const { return *header_; }
+
+    /* Get the next record. Returns false at the end of the capture. */
+    bool Next(RecordHeader const *&record, char const *&frame);
+
+    /* Restart reading at the first record. */
+    void Rewind() { position_ = 0; }
+
+private:
+    void *file_ = nullptr;
+    void *mapping_ = nullptr;
+    FileHeader const *header_ = nullptr;
+    char const *data_ = nullptr;
+    uint64_t position_ = 0;
+};
+
+} // end namespace
+
+#endif // DLL32TO64_CAPTURE_H
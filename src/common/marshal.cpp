@@ -0,0 +1,421 @@
+#include "marshal.h"
+
+#include <immintrin.h>
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+
+namespace msg {
+
+namespace {
+
+// Shuffle plans with more chunks per period (structs with odd sizes above 64 bytes) use the scalar kernel
+unsigned const MAX_SHUFFLE_CHUNKS = 64;
+
+// Byte shuffle masks select a zero byte with the high bit set
+uint8_t const SHUFFLE_ZERO = 0x80;
+
+unsigned FieldSize(FieldType type, Abi abi)
+{
+    switch (type)
+    {
+        case FIELD_Int8: return 1;
+        case FIELD_Int16: return 2;
+        case FIELD_Int32:
+        case FIELD_Long:
+        case FIELD_Float: return 4;
+        case FIELD_Int64:
+        case FIELD_Double: return 8;
+        case FIELD_SizeT:
+        case FIELD_Pointer: return abi == ABI_64 ? 8 : 4;
+    }
+    return 0;
+}
+
+unsigned AlignUp(unsigned value, unsigned alignment)
+{
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+unsigned Gcd(unsigned a, unsigned b)
+{
+    while (b != 0)
+    {
+        unsigned const t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+bool CpuSupports(StructConversion::Kernel kernel)
+{
+    __builtin_cpu_init();
+    switch (kernel)
+    {
+        case StructConversion::KERNEL_Words: return __builtin_cpu_supports("sse2");
+        case StructConversion::KERNEL_ShuffleAvx2: return __builtin_cpu_supports("avx2");
+        case StructConversion::KERNEL_ShuffleSsse3: return __builtin_cpu_supports("ssse3");
+        default: return true;
+    }
+}
+
+/* Keep the low halves of `count` 64-bit words. Returns the number of words converted. */
+__attribute__((target("sse2")))
+size_t NarrowWordsSse2(char const *src, char *dst, size_t count)
+{
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i const a = _mm_loadu_si128((__m128i const*)(src + 8 * i));
+        __m128i const b = _mm_loadu_si128((__m128i const*)(src + 8 * i + 16));
+        // Move the low dwords of both qwords to the bottom of each register, then combine the bottoms
+        __m128i const packedA = _mm_shuffle_epi32(a, _MM_SHUFFLE(3, 1, 2, 0));
+        __m128i const packedB = _mm_shuffle_epi32(b, _MM_SHUFFLE(3, 1, 2, 0));
+        _mm_storeu_si128((__m128i*)(dst + 4 * i), _mm_unpacklo_epi64(packedA, packedB));
+    }
+    return i;
+}
+
+/* Zero-extend `count` 32-bit words. Returns the number of words converted. */
+__attribute__((target("sse2")))
+size_t WidenWordsSse2(char const *src, char *dst, size_t count)
+{
+    __m128i const zero = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i const words = _mm_loadu_si128((__m128i const*)(src + 4 * i));
+        _mm_storeu_si128((__m128i*)(dst + 8 * i), _mm_unpacklo_epi32(words, zero));
+        _mm_storeu_si128((__m128i*)(dst + 8 * i + 16), _mm_unpackhi_epi32(words, zero));
+    }
+    return i;
+}
+
+__attribute__((target("ssse3")))
+void ShuffleSsse3(char const *src, char *dst, size_t periods, unsigned inPeriod, unsigned outPeriod,
+                  uint32_t const *chunkBase, uint8_t const *loMasks, uint8_t const *hiMasks)
+{
+    unsigned const chunks = outPeriod / 16;
+    for (size_t p = 0; p < periods; p++)
+    {
+        for (unsigned c = 0; c < chunks; c++)
+        {
+            char const *in = src + chunkBase[c];
+            __m128i const lo = _mm_loadu_si128((__m128i const*)in);
+            __m128i const hi = _mm_loadu_si128((__m128i const*)(in + 16));
+            __m128i const loMask = _mm_loadu_si128((__m128i const*)&loMasks[16 * c]);
+            __m128i const hiMask = _mm_loadu_si128((__m128i const*)&hiMasks[16 * c]);
+            __m128i const out = _mm_or_si128(_mm_shuffle_epi8(lo, loMask), _mm_shuffle_epi8(hi, hiMask));
+            _mm_storeu_si128((__m128i*)(dst + 16 * c), out);
+        }
+        src += inPeriod;
+        dst += outPeriod;
+    }
+}
+
+/* Like ShuffleSsse3(), but shuffles two chunks at once, one in each 128-bit lane. */
+__attribute__((target("avx2")))
+void ShuffleAvx2(char const *src, char *dst, size_t periods, unsigned inPeriod, unsigned outPeriod,
+                 uint32_t const *chunkBase, uint8_t const *loMasks, uint8_t const *hiMasks)
+{
+    unsigned const chunks = outPeriod / 16;
+    for (size_t p = 0; p < periods; p++)
+    {
+        for (unsigned c = 0; c < chunks; c += 2)
+        {
+            char const *in0 = src + chunkBase[c];
+            char const *in1 = src + chunkBase[c + 1];
+            __m256i const lo = _mm256_inserti128_si256(
+                _mm256_castsi128_si256(_mm_loadu_si128((__m128i const*)in0)),
+                _mm_loadu_si128((__m128i const*)in1), 1);
+            __m256i const hi = _mm256_inserti128_si256(
+                _mm256_castsi128_si256(_mm_loadu_si128((__m128i const*)(in0 + 16))),
+                _mm_loadu_si128((__m128i const*)(in1 + 16)), 1);
+            __m256i const loMask = _mm256_loadu_si256((__m256i const*)&loMasks[16 * c]);
+            __m256i const hiMask = _mm256_loadu_si256((__m256i const*)&hiMasks[16 * c]);
+            __m256i const out = _mm256_or_si256(_mm256_shuffle_epi8(lo, loMask), _mm256_shuffle_epi8(hi, hiMask));
+            _mm256_storeu_si256((__m256i*)(dst + 16 * c), out);
+        }
+        src += inPeriod;
+        dst += outPeriod;
+    }
+}
+
+} // end anonymous namespace
+
+void StructConversion::Init(std::vector<int> const &byteMap, unsigned srcSize, unsigned wordsPerElement)
+{
+    srcSize_ = srcSize;
+    dstSize_ = byteMap.size();
+    wordsPerElement_ = wordsPerElement;
+
+    // Merge consecutive bytes into runs for the scalar kernel
+    runs_.clear();
+    bool identity = srcSize_ == dstSize_;
+    for (unsigned b = 0; b < dstSize_; b++)
+    {
+        identity = identity && (byteMap[b] == (int)b || byteMap[b] == StructConversion::BYTE_PADDING);
+    }
+    for (unsigned b = 0; b < dstSize_;)
+    {
+        CopyRun run;
+        run.src = byteMap[b] < 0 ? 0 : byteMap[b];
+        run.dst = b;
+        run.zero = byteMap[b] < 0;
+        run.length = 0;
+        while (b < dstSize_ && (byteMap[b] < 0) == run.zero && (run.zero || byteMap[b] == run.src + run.length))
+        {
+            run.length++;
+            b++;
+        }
+        runs_.push_back(run);
+    }
+
+    if (identity)
+    {
+        kernel_ = KERNEL_Copy;
+    }
+    else if (wordsPerElement_ > 0 && CpuSupports(KERNEL_Words))
+    {
+        kernel_ = KERNEL_Words;
+    }
+    else if (InitShuffle(byteMap) && CpuSupports(KERNEL_ShuffleAvx2))
+    {
+        kernel_ = KERNEL_ShuffleAvx2;
+    }
+    else if (!chunkBase_.empty() && CpuSupports(KERNEL_ShuffleSsse3))
+    {
+        kernel_ = KERNEL_ShuffleSsse3;
+    }
+    else
+    {
+        kernel_ = KERNEL_Scalar;
+    }
+}
+
+bool StructConversion::InitShuffle(std::vector<int> const &byteMap)
+{
+    chunkBase_.clear();
+    loMasks_.clear();
+    hiMasks_.clear();
+
+    // A period ends on an element boundary and consists of an even number of 16 byte chunks, so the AVX2 kernel can
+    // always convert two at once
+    outPeriod_ = dstSize_ / Gcd(dstSize_, 32) * 32;
+    elementsPerPeriod_ = outPeriod_ / dstSize_;
+    inPeriod_ = elementsPerPeriod_ * srcSize_;
+    maxRead_ = 0;
+
+    unsigned const chunks = outPeriod_ / 16;
+    if (chunks > MAX_SHUFFLE_CHUNKS)
+    {
+        return false;
+    }
+
+    for (unsigned c = 0; c < chunks; c++)
+    {
+        // Source bytes of this chunk, relative to the start of the period
+        int sources[16];
+        int first = INT_MAX;
+        int last = -1;
+        for (unsigned j = 0; j < 16; j++)
+        {
+            unsigned const out = 16 * c + j;
+            int const byte = byteMap[out % dstSize_];
+            sources[j] = byte < 0 ? -1 : (int)(out / dstSize_ * srcSize_) + byte;
+            if (sources[j] >= 0)
+            {
+                first = std::min(first, sources[j]);
+                last = std::max(last, sources[j]);
+            }
+        }
+
+        if (last < 0)
+        {
+            first = 0;
+        }
+        else if (last - first >= 32)
+        {
+            // Too much padding is dropped to reach all bytes with two loads
+            chunkBase_.clear();
+            return false;
+        }
+
+        chunkBase_.push_back(first);
+        maxRead_ = std::max(maxRead_, (unsigned)first + 32);
+        for (unsigned j = 0; j < 16; j++)
+        {
+            int const offset = sources[j] - first;
+            loMasks_.push_back(sources[j] >= 0 && offset < 16 ? offset : SHUFFLE_ZERO);
+            hiMasks_.push_back(sources[j] >= 0 && offset >= 16 ? offset - 16 : SHUFFLE_ZERO);
+        }
+    }
+
+    return true;
+}
+
+void StructConversion::Run(void const *src, void *dst, size_t count) const
+{
+    char const *in = (char const*)src;
+    char *out = (char*)dst;
+    size_t done = 0;
+
+    switch (kernel_)
+    {
+        case KERNEL_Copy:
+            std::memcpy(out, in, count * srcSize_);
+            return;
+
+        case KERNEL_Words:
+        {
+            size_t const words = count * wordsPerElement_;
+            size_t const converted = srcSize_ > dstSize_ ? NarrowWordsSse2(in, out, words) : WidenWordsSse2(in, out, words);
+            // The element converted partially is converted again below
+            done = converted / wordsPerElement_;
+            break;
+        }
+
+        case KERNEL_ShuffleAvx2:
+        case KERNEL_ShuffleSsse3:
+        {
+            // Chunks read up to maxRead_ bytes past the start of their period, which must stay within the input
+            size_t const inBytes = count * srcSize_;
+            size_t periods = count / elementsPerPeriod_;
+            if (inBytes < maxRead_)
+            {
+                periods = 0;
+            }
+            else
+            {
+                periods = std::min(periods, (inBytes - maxRead_) / inPeriod_ + 1);
+            }
+
+            if (kernel_ == KERNEL_ShuffleAvx2)
+            {
+                ShuffleAvx2(in, out, periods, inPeriod_, outPeriod_, chunkBase_.data(), loMasks_.data(), hiMasks_.data());
+            }
+            else
+            {
+                ShuffleSsse3(in, out, periods, inPeriod_, outPeriod_, chunkBase_.data(), loMasks_.data(), hiMasks_.data());
+            }
+            done = periods * elementsPerPeriod_;
+            break;
+        }
+
+        case KERNEL_Scalar:
+            break;
+    }
+
+    RunScalar(in, out, done, count);
+}
+
+void StructConversion::RunScalar(char const *src, char *dst, size_t first, size_t count) const
+{
+    for (size_t i = first; i < count; i++)
+    {
+        char const *in = src + i * srcSize_;
+        char *out = dst + i * dstSize_;
+        for (CopyRun const &run : runs_)
+        {
+            if (run.zero)
+            {
+                std::memset(out + run.dst, 0, run.length);
+            }
+            else
+            {
+                std::memcpy(out + run.dst, in + run.src, run.length);
+            }
+        }
+    }
+}
+
+StructLayout::StructLayout(std::vector<Field> const &fields)
+{
+    // Offsets of each field in both ABIs
+    struct Placed
+    {
+        FieldType type;
+        unsigned count;
+        unsigned offset[2];
+    };
+    std::vector<Placed> placed;
+
+    unsigned wordsPerElement = 0;
+    bool onlyWords = true;
+    for (Abi const abi : {ABI_64, ABI_32})
+    {
+        unsigned offset = 0;
+        unsigned alignment = 1;
+        size_t i = 0;
+        for (Field const &field : fields)
+        {
+            unsigned const size = FieldSize(field.type, abi);
+            offset = AlignUp(offset, size);
+            alignment = std::max(alignment, size);
+
+            if (abi == ABI_64)
+            {
+                placed.push_back(Placed{field.type, field.count, {offset, 0}});
+                bool const isWord = field.type == FIELD_SizeT || field.type == FIELD_Pointer;
+                onlyWords = onlyWords && isWord;
+                wordsPerElement += isWord ? field.count : 0;
+            }
+            else
+            {
+                placed[i].offset[abi] = offset;
+            }
+
+            offset += size * field.count;
+            i++;
+        }
+        size_[abi] = AlignUp(offset, alignment);
+    }
+
+    // Map each destination byte to its source byte. Narrowed fields keep their low bytes, widened ones are zero-extended.
+    std::vector<int> narrowMap(size_[ABI_32], StructConversion::BYTE_PADDING);
+    std::vector<int> widenMap(size_[ABI_64], StructConversion::BYTE_PADDING);
+    for (Placed const &field : placed)
+    {
+        unsigned const size64 = FieldSize(field.type, ABI_64);
+        unsigned const size32 = FieldSize(field.type, ABI_32);
+        unsigned const common = std::min(size64, size32);
+        for (unsigned k = 0; k < field.count; k++)
+        {
+            unsigned const at64 = field.offset[ABI_64] + k * size64;
+            unsigned const at32 = field.offset[ABI_32] + k * size32;
+            for (unsigned b = 0; b < common; b++)
+            {
+                narrowMap[at32 + b] = at64 + b;
+                widenMap[at64 + b] = at32 + b;
+            }
+            for (unsigned b = common; b < size64; b++)
+            {
+                widenMap[at64 + b] = StructConversion::BYTE_ZERO;
+            }
+        }
+    }
+
+    if (!onlyWords || placed.empty())
+    {
+        wordsPerElement = 0;
+    }
+    narrow_.Init(narrowMap, size_[ABI_64], wordsPerElement);
+    widen_.Init(widenMap, size_[ABI_32], wordsPerElement);
+}
+
+char const *KernelName(StructConversion::Kernel kernel)
+{
+    switch (kernel)
+    {
+        case StructConversion::KERNEL_Copy: return "Copy";
+        case StructConversion::KERNEL_Words: return "SSE2 words";
+        case StructConversion::KERNEL_ShuffleAvx2: return "AVX2 shuffle";
+        case StructConversion::KERNEL_ShuffleSsse3: return "SSSE3 shuffle";
+        case StructConversion::KERNEL_Scalar: return "Scalar";
+    }
+    return "Unknown";
+}
+
+} // end namespace
@@ -0,0 +1,150 @@
+/**
+ * Conversion of struct arrays between the layouts of the 64-bit client and the 32-bit DLL.
+ *
+ * Structs are sent in the layout of the 32-bit DLL, so the wrapper can pass them to the DLL as they are. The bridge
+ * converts them from and to the 64-bit layout of the client. A StructLayout describes a struct by its fields and derives
+ * the layout on both sides from it.
+ *
+ * Both layouts use natural alignment, as is the default on Windows for both ABIs. Since Windows is LLP64, `long` has
+ * 32 bits on both sides; only size_t and pointers change their size. Narrowing keeps their low 32 bits, so values must
+ * fit into 32 bits. Pointers are only meaningful in the process they belong to, so pointer fields are expected to carry
+ * pointers or handles of the 32-bit DLL, which the client stores and passes back.
+ *
+ * Conversions are done by the fastest kernel available on the CPU:
+ * * memcpy(), if the layouts are identical.
+ * * SSE2 pack/unpack of 64/32 bit words, if all fields are pointer-sized.
+ * * AVX2 or SSSE3 byte shuffles, which convert 32 resp. 16 output bytes per instruction, for any other struct.
+ * * A scalar fallback that copies field by field.
+ */
+
+#ifndef DLL32TO64_MARSHAL_H
+#define DLL32TO64_MARSHAL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace msg {
+
+/* Types of struct fields. */
+enum FieldType : uint8_t
+{
+    FIELD_Int8,     // char, bool, int8_t, uint8_t
+    FIELD_Int16,
+    FIELD_Int32,    // int, enums
+    FIELD_Long,     // 32 bits on Windows in both ABIs
+    FIELD_Float,
+    FIELD_Int64,    // long long
+    FIELD_Double,
+    FIELD_SizeT,    // Zero-extended when widened
+    FIELD_Pointer,  // Zero-extended when widened
+};
+
+/* A struct field. Fixed size arrays have a count > 1. */
+struct Field
+{
+    FieldType type;
+    unsigned count = 1;
+};
+
+enum Abi
+{
+    ABI_64,
+    ABI_32,
+};
+
+/* ABI of the code being compiled. */
+Abi const ABI_NATIVE = sizeof(void*) == 8 ? ABI_64 : ABI_32;
+
+/* Converts arrays of structs in one direction, see StructLayout. */
+class StructConversion
+{
+public:
+    /* Kernels, from fastest to slowest. */
+    enum Kernel
+    {
+        KERNEL_Copy,
+        KERNEL_Words,
+        KERNEL_ShuffleAvx2,
+        KERNEL_ShuffleSsse3,
+        KERNEL_Scalar,
+    };
+
+    // Entries of a byte map that don't refer to a source byte
+    static int const BYTE_ZERO = -1;     // Must be zero
+    static int const BYTE_PADDING = -2;  // May have any value
+
+    /*
+     * @param byteMap: For each byte of a destination element, the index of the byte of the source element it is copied
+     *                 from, or BYTE_ZERO or BYTE_PADDING.
+     * @param wordsPerElement: Number of pointer-sized words per element if all fields are pointer-sized, otherwise 0.
+     */
+    void Init(std::vector<int> const &byteMap, unsigned srcSize, unsigned wordsPerElement);
+
+    /* Convert count elements from src to dst. The buffers must not overlap. */
+    void Run(void const *src, void *dst, size_t count) const;
+
+    Kernel GetKernel() const { return kernel_; }
+
+private:
+    // Copy (or zero if zero is set) a run of bytes within an element
+    struct CopyRun
+    {
+        uint16_t src;
+        uint16_t dst;
+        uint16_t length;
+        bool zero;
+    };
+
+    void RunScalar(char const *src, char *dst, size_t first, size_t count) const;
+
+    unsigned srcSize_ = 0;
+    unsigned dstSize_ = 0;
+    unsigned wordsPerElement_ = 0;
+    Kernel kernel_ = KERNEL_Scalar;
+    std::vector<CopyRun> runs_;
+
+    // Shuffle plan: the output is processed in periods of whole elements that are a multiple of 32 bytes long. Each
+    // 16 byte chunk of a period is shuffled together from the 32 input bytes starting at chunkBase_.
+    unsigned elementsPerPeriod_ = 0;
+    unsigned inPeriod_ = 0;
+    unsigned outPeriod_ = 0;
+    unsigned maxRead_ = 0;  // Input bytes that must be readable after the start of a period
+    std::vector<uint32_t> chunkBase_;
+    std::vector<uint8_t> loMasks_;  // 16 bytes per chunk, selecting from the first 16 input bytes
+    std::vector<uint8_t> hiMasks_;  // 16 bytes per chunk, selecting from the second 16 input bytes
+
+    bool InitShuffle(std::vector<int> const &byteMap);
+};
+
+/* Layout of a struct in both ABIs. */
+class StructLayout
+{
+public:
+    /* Describe a struct by its fields in declaration order. */
+    StructLayout(std::vector<Field> const &fields);
+
+    /* sizeof() the struct in the given ABI. */
+    unsigned Size(Abi abi) const { return size_[abi]; }
+
+    /* Convert count structs from the 64-bit to the 32-bit layout. */
+    void Narrow(void const *src, void *dst, size_t count) const { narrow_.Run(src, dst, count); }
+
+    /* Convert count structs from the 32-bit to the 64-bit layout. */
+    void Widen(void const *src, void *dst, size_t count) const { widen_.Run(src, dst, count); }
+
+    StructConversion const& Narrowing() const { return narrow_; }
+    StructConversion const& Widening() const { return widen_; }
+
+private:
+    unsigned size_[2];
+    StructConversion narrow_;
+    StructConversion widen_;
+};
+
+/* Human readable name of a kernel. */
+char const *KernelName(StructConversion::Kernel kernel);
+
+} // end namespace
+
+#endif // DLL32TO64_MARSHAL_H
@@ -0,0 +1,441 @@
+#include "metrics.h"
+#include "trace.h"
+
+#include <windows.h>
+#include <psapi.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace metrics {
+
+namespace {
+
+/*
+ * Latency histograms have 2^SUB_BUCKET_BITS linear buckets per power of two microseconds, which bounds the relative error
+ * of the reported percentiles to 25%. Values above the last bucket (~30s) are counted in the last bucket.
+ */
+unsigned const SUB_BUCKET_BITS = 2;
+unsigned const NUM_BUCKETS = 100;
+/* Number of updates over which latency percentiles are computed. */
+unsigned const WINDOW_UPDATES = 10;
+
+struct ExportCounters
+{
+    std::atomic<uint64_t> calls;
+    std::atomic<uint64_t> errors;
+    std::atomic<int64_t> queued;
+    std::atomic<uint64_t> rejected;
+    std::atomic<uint64_t> histogram[NUM_BUCKETS];
+};
+
+// Counters updated on the call path
+ExportCounters exportCounters[MAX_EXPORTS];
+ExportCounters laneCounters[MAX_LANES];
+std::atomic<uint64_t> inFlight(0);
+std::atomic<uint64_t> callbacks(0);
+std::atomic<uint64_t> callbackQueueDepth(0);
+std::atomic<uint64_t> callbacksUnread(0);
+std::atomic<uint64_t> reconnects(0);
+std::atomic<uint64_t> recycles(0);
+std::atomic<int64_t> credits(0);
+std::atomic<uint32_t> creditLimit(0);
+std::atomic<uint32_t> peerPid(0);
+
+// Publisher state
+HANDLE mappingHandle = NULL;
+Segment *segment = nullptr;
+std::thread publisherThread;
+std::mutex stopMutex;
+std::condition_variable stopCondition;
+bool stopRequested = false;
+
+unsigned BucketIndex(uint64_t us)
+{
+    if (us < (1u << SUB_BUCKET_BITS))
+    {
+        return us;
+    }
+
+    unsigned const exponent = 63 - __builtin_clzll(us);
+    unsigned const mantissa = (us >> (exponent - SUB_BUCKET_BITS)) & ((1u << SUB_BUCKET_BITS) - 1);
+    unsigned const index = ((exponent - SUB_BUCKET_BITS + 1) << SUB_BUCKET_BITS) + mantissa;
+    return index < NUM_BUCKETS ? index : NUM_BUCKETS - 1;
+}
+
+/* Largest value that is counted in the bucket with the given index. */
+uint32_t BucketUpperBound(unsigned index)
+{
+    if (index < (1u << SUB_BUCKET_BITS))
+    {
+        return index;
+    }
+
+    unsigned const exponent = (index >> SUB_BUCKET_BITS) + SUB_BUCKET_BITS - 1;
+    unsigned const mantissa = index & ((1u << SUB_BUCKET_BITS) - 1);
+    uint64_t const lower = (uint64_t)((1u << SUB_BUCKET_BITS) + mantissa) << (exponent - SUB_BUCKET_BITS);
+    uint64_t const upper = lower + (1ull << (exponent - SUB_BUCKET_BITS)) - 1;
+    return upper > UINT32_MAX ? UINT32_MAX : (uint32_t)upper;
+}
+
+uint32_t Percentile(uint64_t const *histogram, uint64_t total, unsigned permille)
+{
+    // Smallest bucket below which at least permille of all samples lie
+    uint64_t const target = (total * permille + 999) / 1000;
+    uint64_t cumulative = 0;
+    for (unsigned i = 0; i < NUM_BUCKETS; i++)
+    {
+        cumulative += histogram[i];
+        if (cumulative >= target) return BucketUpperBound(i);
+    }
+
+    return BucketUpperBound(NUM_BUCKETS - 1);
+}
+
+/*
+ * Fill stat from counters. `newest` receives the current histogram, percentiles are computed over its difference to
+ * `oldest`.
+ */
+void Summarize(ExportCounters const &counters, uint64_t *newest, uint64_t const *oldest, ExportStats &stat)
+{
+    uint64_t window[NUM_BUCKETS];
+
+    stat.calls = counters.calls.load(std::memory_order_relaxed);
+    stat.errors = counters.errors.load(std::memory_order_relaxed);
+    int64_t const queued = counters.queued.load(std::memory_order_relaxed);
+    stat.queued = queued > 0 ? queued : 0;
+    stat.rejected = counters.rejected.load(std::memory_order_relaxed);
+
+    uint64_t total = 0;
+    unsigned highest = 0;
+    for (unsigned b = 0; b < NUM_BUCKETS; b++)
+    {
+        newest[b] = counters.histogram[b].load(std::memory_order_relaxed);
+        window[b] = newest[b] - oldest[b];
+        total += window[b];
+        if (window[b] > 0) highest = b;
+    }
+
+    if (total > 0)
+    {
+        stat.p50Us = Percentile(window, total, 500);
+        stat.p90Us = Percentile(window, total, 900);
+        stat.p99Us = Percentile(window, total, 990);
+        stat.maxUs = BucketUpperBound(highest);
+    }
+}
+
+void PublisherTask()
+{
+    unsigned const numExports = msg::MSGID_LAST + 1;
+    unsigned const numLanes = msg::LANE_COUNT;
+    // Histograms of the exports, followed by those of the lanes
+    unsigned const numHistograms = MAX_EXPORTS + MAX_LANES;
+
+    // Ring of cumulative histograms of the last WINDOW_UPDATES updates, percentiles are computed from the difference
+    // between the newest and the oldest one
+    std::vector<uint64_t> history(WINDOW_UPDATES * numHistograms * NUM_BUCKETS, 0);
+    unsigned historyPos = 0;
+
+    uint64_t lastCalls = 0;
+    int64_t lastTime = trace::Now();
+
+    std::unique_lock<std::mutex> lock(stopMutex);
+    while (!stopRequested)
+    {
+        // Collect counters before entering the seqlock to keep the time readers have to retry short
+        uint64_t calls = 0;
+        uint64_t errors = 0;
+        uint64_t queued = 0;
+        uint64_t rejected = 0;
+        ExportStats stats[MAX_EXPORTS] = {};
+        ExportStats laneStats[MAX_LANES] = {};
+
+        uint64_t *const newest = &history[historyPos * numHistograms * NUM_BUCKETS];
+        historyPos = (historyPos + 1) % WINDOW_UPDATES;
+        uint64_t const *const oldest = &history[historyPos * numHistograms * NUM_BUCKETS];
+
+        for (unsigned e = 0; e < numExports; e++)
+        {
+            ExportStats &stat = stats[e];
+            std::strncpy(stat.name, msg::MsgIdName((msg::MsgId)e), EXPORT_NAME_MAXLEN - 1);
+            Summarize(exportCounters[e], &newest[e * NUM_BUCKETS], &oldest[e * NUM_BUCKETS], stat);
+            calls += stat.calls;
+            errors += stat.errors;
+            queued += stat.queued;
+            rejected += stat.rejected;
+        }
+
+        for (unsigned l = 0; l < numLanes; l++)
+        {
+            ExportStats &stat = laneStats[l];
+            unsigned const row = MAX_EXPORTS + l;
+            std::strncpy(stat.name, msg::LaneName((msg::Lane)l), EXPORT_NAME_MAXLEN - 1);
+            Summarize(laneCounters[l], &newest[row * NUM_BUCKETS], &oldest[row * NUM_BUCKETS], stat);
+        }
+
+        int64_t const available = credits.load(std::memory_order_relaxed);
+
+        MemoryUsage memory = {};
+        SampleMemory(memory);
+
+        int64_t const now = trace::Now();
+        uint64_t const callsPerSecond = now > lastTime ? ((calls - lastCalls) * 1000000) / (now - lastTime) : 0;
+        lastCalls = calls;
+        lastTime = now;
+
+        // Seqlock write section
+        uint32_t const sequence = __atomic_load_n(&segment->sequence, __ATOMIC_RELAXED);
+        __atomic_store_n(&segment->sequence, sequence + 1, __ATOMIC_RELAXED);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        segment->peerPid = peerPid.load(std::memory_order_relaxed);
+        segment->updates++;
+        segment->calls = calls;
+        segment->callsPerSecond = callsPerSecond;
+        segment->errors = errors;
+        segment->inFlight = inFlight.load(std::memory_order_relaxed);
+        segment->callbacks = callbacks.load(std::memory_order_relaxed);
+        segment->callbackQueueDepth = callbackQueueDepth.load(std::memory_order_relaxed) +
+                                      callbacksUnread.load(std::memory_order_relaxed);
+        segment->reconnects = reconnects.load(std::memory_order_relaxed);
+        segment->recycles = recycles.load(std::memory_order_relaxed);
+        segment->queued = queued;
+        segment->rejected = rejected;
+        segment->credits = available > 0 ? available : 0;
+        segment->creditLimit = creditLimit.load(std::memory_order_relaxed);
+        segment->workingSet = memory.workingSet;
+        segment->privateBytes = memory.privateBytes;
+        segment->addressSpaceUsed = memory.addressSpaceUsed;
+        segment->addressSpaceTotal = memory.addressSpaceTotal;
+        segment->numExports = numExports;
+        std::memcpy(segment->exports, stats, sizeof(stats));
+        segment->numLanes = numLanes;
+        std::memcpy(segment->lanes, laneStats, sizeof(laneStats));
+
+        __atomic_store_n(&segment->sequence, sequence + 2, __ATOMIC_RELEASE);
+
+        stopCondition.wait_for(lock, std::chrono::milliseconds(PUBLISH_INTERVAL_MS));
+    }
+}
+
+} // end anonymous namespace
+
+CallScope::CallScope(msg::MsgId id, msg::Lane lane)
+    : id_(id), lane_(lane), start_(trace::Now()), ok_(false)
+{
+    inFlight.fetch_add(1, std::memory_order_relaxed);
+}
+
+CallScope::~CallScope()
+{
+    int64_t const duration = trace::Now() - start_;
+
+    inFlight.fetch_sub(1, std::memory_order_relaxed);
+
+    if ((unsigned)id_ >= MAX_EXPORTS || (unsigned)lane_ >= MAX_LANES) return;
+    unsigned const bucket = BucketIndex(duration > 0 ? duration : 0);
+    for (ExportCounters *counters : {&exportCounters[id_], &laneCounters[lane_]})
+    {
+        counters->calls.fetch_add(1, std::memory_order_relaxed);
+        if (!ok_) counters->errors.fetch_add(1, std::memory_order_relaxed);
+        counters->histogram[bucket].fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void CallbackQueued()
+{
+    callbackQueueDepth.fetch_add(1, std::memory_order_relaxed);
+}
+
+void CallbackDelivered()
+{
+    callbackQueueDepth.fetch_sub(1, std::memory_order_relaxed);
+    callbacks.fetch_add(1, std::memory_order_relaxed);
+}
+
+void CallbackDropped()
+{
+    callbackQueueDepth.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void CallbacksUnread(uint64_t count)
+{
+    callbacksUnread.store(count, std::memory_order_relaxed);
+}
+
+void Queued(msg::MsgId id)
+{
+    if ((unsigned)id >= MAX_EXPORTS) return;
+    exportCounters[id].queued.fetch_add(1, std::memory_order_relaxed);
+}
+
+void Dequeued(msg::MsgId id)
+{
+    if ((unsigned)id >= MAX_EXPORTS) return;
+    exportCounters[id].queued.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void Rejected(msg::MsgId id)
+{
+    if ((unsigned)id >= MAX_EXPORTS) return;
+    exportCounters[id].rejected.fetch_add(1, std::memory_order_relaxed);
+}
+
+void SetCredits(int64_t available, uint32_t limit)
+{
+    credits.store(available, std::memory_order_relaxed);
+    creditLimit.store(limit, std::memory_order_relaxed);
+}
+
+void Reconnected()
+{
+    reconnects.fetch_add(1, std::memory_order_relaxed);
+}
+
+void Recycled()
+{
+    recycles.fetch_add(1, std::memory_order_relaxed);
+}
+
+bool SampleMemory(MemoryUsage &usage)
+{
+    PROCESS_MEMORY_COUNTERS_EX counters = {};
+    counters.cb = sizeof(counters);
+    MEMORYSTATUSEX status = {};
+    status.dwLength = sizeof(status);
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), (PROCESS_MEMORY_COUNTERS*)&counters, sizeof(counters)) ||
+        !GlobalMemoryStatusEx(&status))
+    {
+        return false;
+    }
+
+    usage.workingSet = counters.WorkingSetSize;
+    usage.privateBytes = counters.PrivateUsage;
+    usage.addressSpaceUsed = status.ullTotalVirtual - status.ullAvailVirtual;
+    usage.addressSpaceTotal = status.ullTotalVirtual;
+    return true;
+}
+
+void SetPeerPid(uint32_t pid)
+{
+    peerPid.store(pid, std::memory_order_relaxed);
+}
+
+bool StartPublishing(char const *role)
+{
+    if (segment != nullptr)
+    {
+        return true;
+    }
+
+    char name[64];
+    snprintf(name, sizeof(name), "%s%lu", SEGMENT_NAME_PREFIX, GetCurrentProcessId());
+
+    mappingHandle = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, sizeof(Segment), name);
+    if (mappingHandle == NULL)
+    {
+        return false;
+    }
+
+    segment = (Segment*)MapViewOfFile(mappingHandle, FILE_MAP_WRITE, 0, 0, sizeof(Segment));
+    if (segment == nullptr)
+    {
+        CloseHandle(mappingHandle);
+        mappingHandle = NULL;
+        return false;
+    }
+
+    std::memset((void*)segment, 0, sizeof(Segment));
+    segment->magic = SEGMENT_MAGIC;
+    segment->version = SEGMENT_VERSION;
+    segment->pid = GetCurrentProcessId();
+    std::strncpy(segment->role, role, sizeof(segment->role) - 1);
+
+    stopRequested = false;
+    publisherThread = std::thread(PublisherTask);
+    return true;
+}
+
+void StopPublishing()
+{
+    if (segment == nullptr)
+    {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(stopMutex);
+        stopRequested = true;
+    }
+    stopCondition.notify_one();
+    if (publisherThread.joinable()) publisherThread.join();
+
+    UnmapViewOfFile(segment);
+    CloseHandle(mappingHandle);
+    segment = nullptr;
+    mappingHandle = NULL;
+}
+
+SegmentReader::~SegmentReader()
+{
+    if (segment_ != nullptr) UnmapViewOfFile(segment_);
+    if (mapping_ != nullptr) CloseHandle(mapping_);
+}
+
+bool SegmentReader::Open(uint32_t pid)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "%s%lu", SEGMENT_NAME_PREFIX, (unsigned long)pid);
+
+    if (segment_ != nullptr) UnmapViewOfFile(segment_);
+    if (mapping_ != nullptr) CloseHandle(mapping_);
+    segment_ = nullptr;
+
+    mapping_ = OpenFileMappingA(FILE_MAP_READ, FALSE, name);
+    if (mapping_ == NULL)
+    {
+        mapping_ = nullptr;
+        return false;
+    }
+
+    segment_ = (Segment const*)MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, sizeof(Segment));
+    return segment_ != nullptr;
+}
+
+bool SegmentReader::Read(Segment &snapshot) const
+{
+    if (segment_ == nullptr)
+    {
+        return false;
+    }
+
+    // The publisher holds the seqlock only for a few hundred nanoseconds, so this rarely needs more than one retry
+    for (int attempt = 0; attempt < 1000; attempt++)
+    {
+        uint32_t const before = __atomic_load_n(&segment_->sequence, __ATOMIC_ACQUIRE);
+        if (before & 1)
+        {
+            std::this_thread::yield();
+            continue;
+        }
+
+        std::memcpy(&snapshot, segment_, sizeof(Segment));
+        std::atomic_thread_fence(std::memory_order_acquire);
+
+        uint32_t const after = __atomic_load_n(&segment_->sequence, __ATOMIC_RELAXED);
+        if (before == after)
+        {
+            return snapshot.magic == SEGMENT_MAGIC && snapshot.version == SEGMENT_VERSION;
+        }
+    }
+
+    return false;
+}
+
+} // end namespace
@@ -0,0 +1,212 @@
+/**
+ * Live metrics of bridge and wrapper, published into a named shared memory segment.
+ *
+ * Calls only update in-process counters with relaxed atomic operations, so no locks or syscalls are added to the call
+ * path. A background thread periodically derives rates and latency percentiles from these counters and copies them into
+ * the shared memory segment, protected by a seqlock. Readers (see dll32to64-top) map the segment read-only and retry
+ * reading until they get a consistent snapshot.
+ *
+ * Each process publishes its own segment named SEGMENT_NAME_PREFIX<pid>. The bridge's segment contains the pid of its
+ * wrapper, so a reader only needs to know the pid of the client application.
+ */
+
+#ifndef DLL32TO64_METRICS_H
+#define DLL32TO64_METRICS_H
+
+#include "msg_protocol.h"
+
+#include <cstdint>
+
+namespace metrics {
+
+/* Prefix of the shared memory segment names, followed by the pid of the publishing process. */
+char const SEGMENT_NAME_PREFIX[] = "Local\\dll32to64-metrics-";
+/* Identifies a valid segment. */
+uint32_t const SEGMENT_MAGIC = 0x64333264;
+/* Incremented whenever the layout of Segment changes. */
+uint32_t const SEGMENT_VERSION = 4;
+/* Maximum number of MsgIds for which per-export statistics are kept. */
+unsigned const MAX_EXPORTS = 32;
+/* Maximum number of lanes for which per-lane statistics are kept. */
+unsigned const MAX_LANES = 4;
+/* Maximum length of an export name in the segment (including 0-terminator). */
+unsigned const EXPORT_NAME_MAXLEN = 24;
+/* Interval in which the segment is updated. */
+unsigned const PUBLISH_INTERVAL_MS = 500;
+
+static_assert(msg::MSGID_LAST < MAX_EXPORTS, "Too many MsgIds for metrics segment");
+static_assert(msg::LANE_COUNT <= MAX_LANES, "Too many lanes for metrics segment");
+
+/*
+ * Layout of the shared memory segment.
+ *
+ * Only fixed size types are used, because the segment of the 32bit wrapper is read by 64bit processes and vice versa.
+ */
+#pragma pack(push, 8)
+struct ExportStats
+{
+    char name[EXPORT_NAME_MAXLEN];
+    uint64_t calls;
+    uint64_t errors;
+    // Calls waiting in a queue right now, and calls rejected because the queue was full
+    uint64_t queued;
+    uint64_t rejected;
+    // Latency percentiles over the last few seconds in microseconds
+    uint32_t p50Us;
+    uint32_t p90Us;
+    uint32_t p99Us;
+    uint32_t maxUs;
+};
+
+struct Segment
+{
+    uint32_t magic;
+    uint32_t version;
+    // Seqlock, odd while the publisher is updating the segment. Only accessed with atomic builtins.
+    uint32_t sequence;
+    uint32_t pid;
+    // Pid of the other process (the wrapper for a bridge segment and vice versa), 0 if unknown
+    uint32_t peerPid;
+    char role[12];
+    // Number of updates so far, increases even if nothing else changes
+    uint64_t updates;
+
+    uint64_t calls;
+    uint64_t callsPerSecond;
+    uint64_t errors;
+    uint64_t inFlight;
+    uint64_t callbacks;
+    uint64_t callbackQueueDepth;
+    uint64_t reconnects;
+    // Wrappers replaced by the bridge, see Dll32To64_SetRecyclePolicy()
+    uint64_t recycles;
+
+    // Calls waiting for admission (bridge) or execution (wrapper), and calls rejected with DLL32TO64_ERROR_OVERLOADED
+    uint64_t queued;
+    uint64_t rejected;
+    // Requests the bridge may send before it has to wait for responses, out of the limit granted by the wrapper. A
+    // limit of 0 means there is no flow control.
+    uint64_t credits;
+    uint64_t creditLimit;
+
+    // Memory of the process in bytes, see MemoryUsage
+    uint64_t workingSet;
+    uint64_t privateBytes;
+    uint64_t addressSpaceUsed;
+    uint64_t addressSpaceTotal;
+
+    uint32_t numExports;
+    uint32_t reserved;
+    ExportStats exports[MAX_EXPORTS];
+
+    // Statistics of all calls per lane, named after the lane
+    uint32_t numLanes;
+    uint32_t reserved2;
+    ExportStats lanes[MAX_LANES];
+};
+#pragma pack(pop)
+
+/* Memory of a process in bytes. */
+struct MemoryUsage
+{
+    // Physical memory in use (RSS)
+    uint64_t workingSet;
+    // Committed memory that can't be shared with other processes
+    uint64_t privateBytes;
+    // Virtual address space that is reserved or committed, and the size of the user mode address space. A 32-bit process
+    // fails to allocate long before its private bytes reach the total, because its address space is fragmented.
+    uint64_t addressSpaceUsed;
+    uint64_t addressSpaceTotal;
+};
+
+/* Counts a call for the lifetime of this object. Unless Succeeded() was called, the call is counted as failed. */
+class CallScope
+{
+public:
+    CallScope(msg::MsgId id, msg::Lane lane);
+    ~CallScope();
+
+    CallScope(CallScope const&) = delete;
+    CallScope& operator=(CallScope const&) = delete;
+
+    /* Mark the call as successful. */
+    void Succeeded() { ok_ = true; }
+
+private:
+    msg::MsgId id_;
+    msg::Lane lane_;
+    int64_t start_;
+    bool ok_;
+};
+
+/* Count a callback that has been received but not yet delivered. */
+void CallbackQueued();
+
+/* Count a callback that was delivered. */
+void CallbackDelivered();
+
+/* Count a callback that was dropped before it was delivered, e.g. because its connection was lost. */
+void CallbackDropped();
+
+/* Report the callbacks that arrived, but weren't received yet, e.g. because they wait in a socket behind a slow one. */
+void CallbacksUnread(uint64_t count);
+
+/* Count a call that waits in a queue until it may be sent or executed. */
+void Queued(msg::MsgId id);
+
+/* Count a call that left its queue, whether it was started or dropped. */
+void Dequeued(msg::MsgId id);
+
+/* Count a call that was rejected because its queue was full. */
+void Rejected(msg::MsgId id);
+
+/* Set the requests that may be sent before waiting for responses. Overdrawn credits are published as 0. */
+void SetCredits(int64_t available, uint32_t limit);
+
+/* Count a reestablished connection between bridge and wrapper. */
+void Reconnected();
+
+/* Count a wrapper that was replaced by a new one. */
+void Recycled();
+
+/* Sample the memory usage of this process. */
+bool SampleMemory(MemoryUsage &usage);
+
+/* Set the pid of the other process. */
+void SetPeerPid(uint32_t pid);
+
+/*
+ * Create the shared memory segment of this process and start updating it periodically.
+ *
+ * @param role: Short name of this process, e.g. "bridge".
+ * @return False if the segment could not be created.
+ */
+bool StartPublishing(char const *role);
+
+/* Stop updating the shared memory segment and remove it. */
+void StopPublishing();
+
+/* Read-only view on the segment of another process. */
+class SegmentReader
+{
+public:
+    SegmentReader() = default;
+    ~SegmentReader();
+
+    SegmentReader(SegmentReader const&) = delete;
+    SegmentReader& operator=(SegmentReader const&) = delete;
+
+    /* Map the segment of process pid. */
+    bool Open(uint32_t pid);
+
+    /* Copy a consistent snapshot of the segment. Returns false if the segment is not valid. */
+    bool Read(Segment &snapshot) const;
+
+private:
+    void *mapping_ = nullptr;
+    Segment const *segment_ = nullptr;
+};
+
+} // end namespace
+
+#endif // DLL32TO64_METRICS_H
@@ -25,6 +25,18 @@ static int SizeOfStaticData(MsgId msgId, Direction direction)
             SIZEOF_CASE_REQUEST(Invert);
             SIZEOF_CASE_REQUEST(Interleave);
             SIZEOF_CASE_REQUEST(SetCallback);
+            SIZEOF_CASE_REQUEST(ScaleRecords);
+            SIZEOF_CASE_REQUEST(CreateBuffer);
+            SIZEOF_CASE_REQUEST(WriteBuffer);
+            SIZEOF_CASE_REQUEST(ReadBuffer);
+            SIZEOF_CASE_REQUEST(DestroyBuffer);
+            SIZEOF_CASE_REQUEST(InvertMap);
+            SIZEOF_CASE_REQUEST(ClockSync);
+            SIZEOF_CASE_REQUEST(TraceStart);
+            SIZEOF_CASE_REQUEST(Hello);
+            SIZEOF_CASE_REQUEST(Cancel);
+            SIZEOF_CASE_REQUEST(MemoryReport);
+            SIZEOF_CASE_REQUEST(Error);
         }
     }
     else if (direction == DIRECTION_Response)
@@ -35,6 +47,18 @@ static int SizeOfStaticData(MsgId msgId, Direction direction)
             SIZEOF_CASE_RESPONSE(Invert);
             SIZEOF_CASE_RESPONSE(Interleave);
             SIZEOF_CASE_RESPONSE(SetCallback);
+            SIZEOF_CASE_RESPONSE(ScaleRecords);
+            SIZEOF_CASE_RESPONSE(CreateBuffer);
+            SIZEOF_CASE_RESPONSE(WriteBuffer);
+            SIZEOF_CASE_RESPONSE(ReadBuffer);
+            SIZEOF_CASE_RESPONSE(DestroyBuffer);
+            SIZEOF_CASE_RESPONSE(InvertMap);
+            SIZEOF_CASE_RESPONSE(ClockSync);
+            SIZEOF_CASE_RESPONSE(TraceStart);
+            SIZEOF_CASE_RESPONSE(Hello);
+            SIZEOF_CASE_RESPONSE(Cancel);
+            SIZEOF_CASE_RESPONSE(MemoryReport);
+            SIZEOF_CASE_RESPONSE(Error);
         }
     }
 
@@ -46,15 +70,46 @@ void InitMessageData(MessageData& message, MsgId id, Direction direction)
 {
     message.id = id;
     message.direction = direction;
+    message.lane = DefaultLane(id);
+    message.callId = 0;
     message.variableDataLength = 0;
     std::memset(&message.staticData, 0, sizeof(message.staticData));
     std::memset(&message.variableData, 0, sizeof(message.variableData));
 }
 
+// Data transfers go to the bulk lane, everything else is a control call
+// TODO: AUTOGEN
+Lane DefaultLane(MsgId id)
+{
+    switch (id)
+    {
+        case MSGID_Interleave:
+        case MSGID_ScaleRecords:
+        case MSGID_WriteBuffer:
+        case MSGID_ReadBuffer:
+        case MSGID_InvertMap:
+            return LANE_Bulk;
+        default:
+            return LANE_Control;
+    }
+}
+
+uint32_t FrameLength(char const *buffer)
+{
+    uint32_t length;
+    std::memcpy(&length, &buffer[7], sizeof(length));
+    return length;
+}
+
+MsgId FrameId(char const *buffer)
+{
+    return (MsgId)(uint8_t)buffer[1];
+}
+
 bool ParseMessage(MessageData& message, Direction direction, char const *buffer, int bufferSize)
 {
     // Incomplete Message
-    if (bufferSize < 2)
+    if (bufferSize < (int)MSG_HEADER_SIZE)
     {
         PLOG_ERROR << "ParseMessage(): Message is incomplete";
         return false;
@@ -68,17 +123,41 @@ bool ParseMessage(MessageData& message, Direction direction, char const *buffer,
     }
 
     MsgId const id = (MsgId)(buffer[1]);
+    if (id > MSGID_LAST)
+    {
+        PLOG_ERROR << "ParseMessage() Unknown MsgId " << id;
+        return false;
+    }
+
+    Lane const lane = (Lane)(buffer[2]);
+    if (lane >= LANE_COUNT)
+    {
+        PLOG_ERROR << "ParseMessage() Unknown Lane " << (int)lane;
+        return false;
+    }
 
-    static_assert(MSG_HEADER_SIZE == 2);
+    uint32_t callId;
+    std::memcpy(&callId, &buffer[3], sizeof(callId));
+
+    static_assert(MSG_HEADER_SIZE == 11);
 
     int const sdSize = SizeOfStaticData(id, direction);
+    uint32_t const length = FrameLength(buffer);
+    if (length > (uint32_t)bufferSize || length < MSG_HEADER_SIZE + sdSize ||
+        length - (MSG_HEADER_SIZE + sdSize) > sizeof(message.variableData))
+    {
+        PLOG_ERROR << "ParseMessage() Invalid message length " << length << " for MsgId " << id;
+        return false;
+    }
 
-    // All the rest of the buffer is variable Data
-    int const vdSize = bufferSize - (MSG_HEADER_SIZE + sdSize);
+    // All the rest of the message is variable Data
+    int const vdSize = length - (MSG_HEADER_SIZE + sdSize);
     std::memcpy(&message.staticData, &buffer[MSG_HEADER_SIZE], sdSize);
     std::memcpy(&message.variableData, &buffer[MSG_HEADER_SIZE + sdSize], vdSize);
     message.id = id;
     message.direction = direction;
+    message.lane = lane;
+    message.callId = callId;
     message.variableDataLength = vdSize;
 
     return true;
@@ -88,8 +167,10 @@ void SerializeMessage(MessageData const& message, char *buffer, int &messageSize
 {
     buffer[0] = PROTOCOL_VERSION;
     buffer[1] = message.id;
+    buffer[2] = message.lane;
+    std::memcpy(&buffer[3], &message.callId, sizeof(message.callId));
 
-    static_assert(MSG_HEADER_SIZE == 2);
+    static_assert(MSG_HEADER_SIZE == 11);
 
     int const sdSize = SizeOfStaticData(message.id, message.direction);
 
@@ -97,6 +178,49 @@ void SerializeMessage(MessageData const& message, char *buffer, int &messageSize
     std::memcpy(&buffer[MSG_HEADER_SIZE + sdSize], message.variableData, message.variableDataLength);
 
     messageSize = MSG_HEADER_SIZE + sdSize + message.variableDataLength;
+    uint32_t const length = messageSize;
+    std::memcpy(&buffer[7], &length, sizeof(length));
+}
+
+#define NAME_CASE(MSG_NAME) \
+    case MSGID_##MSG_NAME: return #MSG_NAME
+
+// TODO: AUTOGEN
+char const *MsgIdName(MsgId id)
+{
+    switch (id)
+    {
+        NAME_CASE(Invert);
+        NAME_CASE(Interleave);
+        NAME_CASE(SetCallback);
+        NAME_CASE(ScaleRecords);
+        NAME_CASE(CreateBuffer);
+        NAME_CASE(WriteBuffer);
+        NAME_CASE(ReadBuffer);
+        NAME_CASE(DestroyBuffer);
+        NAME_CASE(Callback);
+        NAME_CASE(InvertMap);
+        NAME_CASE(ClockSync);
+        NAME_CASE(TraceStart);
+        NAME_CASE(Hello);
+        NAME_CASE(Cancel);
+        NAME_CASE(MemoryReport);
+        NAME_CASE(Error);
+    }
+
+    return "Unknown";
+}
+
+char const *LaneName(Lane lane)
+{
+    switch (lane)
+    {
+        case LANE_Control: return "control";
+        case LANE_Bulk: return "bulk";
+        case LANE_COUNT: break;
+    }
+
+    return "Unknown";
 }
 
 } // end namespace
@@ -1,13 +1,18 @@
 /**
  * A message of our serialization protocol has the following format:
  *
- *            <------===----HEADER-------->  <-------------------------------------------BODY------------------------------------------------->
- * BYTESIZE                  1          1     sizeof(StaticData::<MsgSpecific>)                    X                  Y                   Z...
- * CONTENT    PROTOCOL_VERSION      MsgId                            StaticData     [VariableArray1]   [VariableArray2]    [VariableArrayN...]
+ *            <------===----HEADER--------------------------------------->  <-------------------------------------------BODY------------------------------------------------->
+ * BYTESIZE                  1          1          1          4          4    sizeof(StaticData::<MsgSpecific>)                    X                  Y                   Z...
+ * CONTENT    PROTOCOL_VERSION      MsgId       Lane     CallId     Length                           StaticData     [VariableArray1]   [VariableArray2]    [VariableArrayN...]
  *
  * Each message starts with a header consisting of
  * * Message Version (1 Byte),
  * * MsgId (1 Byte). See enum MsgId below.
+ * * Lane (1 Byte). Priority class of the request, see enum Lane below. Responses repeat the lane of their request.
+ * * CallId (4 Bytes). Chosen by the Bridge for every request and repeated in the response. Callbacks carry the CallId of the
+ *   request that was being executed when the callback was triggered (or 0).
+ * * Length (4 Bytes) of the whole message including the header. This allows to split the byte stream of a connection into
+ *   messages, see sock::ReceiveFrame().
  *
  * After that, the static portion of the message data follows as a packed struct. For outgoing calls, this is the SD_<MessageName> struct
  * that corresponds to the MsgId. For incoming responses, it is the SD_<MessageName>_Response struct. All these structs are defined in this header.
@@ -27,9 +32,9 @@
 namespace msg {
 
 /* Version number of the message protocol. */
-unsigned const PROTOCOL_VERSION = 1;
+unsigned const PROTOCOL_VERSION = 14;
 /* Size of Message Header. */
-unsigned const MSG_HEADER_SIZE = 2;
+unsigned const MSG_HEADER_SIZE = 11;
 /* Maximum supported size of a message. */
 unsigned const MSG_MAX_SIZE = 2048;
 /* Maximum number of supported signals. */
@@ -49,18 +54,61 @@ struct VariableArray {
     int16_t byte_offset;
 };
 
+/*
+ * Object created by the wrapped DLL, which stays in the wrapper. Clients only see its handle, which the bridge passes off
+ * as the pointer the DLL returned. 0 is never used.
+ */
+typedef uint32_t Handle;
+
 /* Defines a unique ID for each of the DLL functions and callbacks exposed by the wrapped DLL. */
 // TODO: AUTOGEN
 enum MsgId {
     MSGID_Invert = 0,
     MSGID_Interleave,
     MSGID_SetCallback,
+    MSGID_ScaleRecords,
+    MSGID_CreateBuffer,
+    MSGID_WriteBuffer,
+    MSGID_ReadBuffer,
+    MSGID_DestroyBuffer,
     MSGID_Callback,
-    MSGID_LAST = MSGID_Callback,
+
+    // Map variants of scalar exports, which the wrapper applies to arrays of arguments
+    MSGID_InvertMap,
+
+    // Internal messages that are handled by the wrapper itself
+    MSGID_ClockSync,
+    MSGID_TraceStart,
+    MSGID_Hello,
+    MSGID_Cancel,
+    MSGID_MemoryReport,
+    MSGID_Error,
+    MSGID_LAST = MSGID_Error,
 };
 
 static_assert(MSGID_LAST <= 255, "MsgId does not fit into 1 byte.");
 
+/*
+ * Priority classes of requests.
+ *
+ * The wrapper keeps a queue per lane and executes queued control requests before bulk ones, and their responses overtake
+ * queued bulk responses. Large transfers are split into requests of at most MSG_MAX_SIZE (see WriteBuffer), so a control
+ * request never waits for more than a single bulk request.
+ */
+enum Lane : uint8_t
+{
+    LANE_Control,  // Small, latency critical calls
+    LANE_Bulk,     // Calls that transfer a lot of data
+    LANE_COUNT,
+};
+
+/* Connections a client opens to the wrapper, see StaticData::Hello. */
+enum Channel : uint8_t
+{
+    CHANNEL_Request,   // Requests and their responses
+    CHANNEL_Callback,  // Callbacks from the wrapped DLL
+};
+
 /* Direction of a message. */
 enum Direction
 {
@@ -83,8 +131,13 @@ union StaticData
     * We anyway define empty "Request" structs to allow unified parsing.
     */
     struct {} Callback;
+    /*
+     * `requests` is the number of requests of the session the wrapper had started to execute when the callback was
+     * fired. A client that replays requests to a new wrapper can tell the callbacks they fire from later ones by it.
+     */
     struct {
         int32_t val;
+        uint32_t requests;
     } CallbackResponse;
 
     struct {
@@ -102,6 +155,135 @@ union StaticData
 
     struct {} SetCallback;
     struct {} SetCallbackResponse;
+
+    // Structs are sent in the layout of the 32-bit DLL, see marshal.h
+    struct {
+        int32_t count;
+        double factor;
+        VariableArray records;
+    } ScaleRecords;
+    struct {
+        VariableArray records;
+    } ScaleRecordsResponse;
+
+    // Buffers stay in the wrapper, only the requested slices are sent
+    struct {
+        int32_t size;
+    } CreateBuffer;
+    struct {
+        Handle buffer;
+    } CreateBufferResponse;
+
+    struct {
+        Handle buffer;
+        int32_t offset;
+        VariableArray data;
+    } WriteBuffer;
+    struct {
+        int32_t written;
+    } WriteBufferResponse;
+
+    struct {
+        Handle buffer;
+        int32_t offset;
+        int32_t size;
+    } ReadBuffer;
+    struct {
+        int32_t read;
+        VariableArray data;
+    } ReadBufferResponse;
+
+    struct {
+        Handle buffer;
+    } DestroyBuffer;
+    struct {} DestroyBufferResponse;
+
+    /*
+    * Map variants call a scalar export once per element of their arguments. Arguments are sent as columns: all `count`
+    * values of the first parameter, followed by those of the next one. The results are returned the same way. Calls
+    * with more elements than fit into a message are split into several requests by the client.
+    */
+    struct {
+        int32_t count;
+        VariableArray input;
+    } InvertMap;
+    struct {
+        VariableArray result;
+    } InvertMapResponse;
+
+    /*
+    * Internal messages.
+    *
+    * ClockSync returns the current time of the wrapper's trace clock, so the bridge can estimate the offset between
+    * both clocks. TraceStart enables tracing in the wrapper. Events are written to the file given by `path` on shutdown.
+    */
+    struct {} ClockSync;
+    struct {
+        int64_t wrapperTime;
+    } ClockSyncResponse;
+
+    struct {
+        int64_t clockOffset;
+        VariableArray path;
+    } TraceStart;
+    struct {} TraceStartResponse;
+
+    /*
+    * First message on every connection to the wrapper.
+    *
+    * A client opens a session by sending Hello with sessionId 0 on its request connection. The wrapper answers with the
+    * id of the new session and a random `token`, which the client then passes in the Hello on its callback connection.
+    * Session ids are easy to guess, so only the token shows that a callback connection comes from the session's client.
+    *
+    * A wrapper can host several libraries. `library` names the one all calls of the session go to, as the file name of
+    * the DLL without extension. If it is empty, the session uses the wrapper's first library.
+    *
+    * The wrapper grants a session `credits`: the client may have at most that many requests outstanding on its request
+    * connection, and sends the next one when a response (or a CancelResponse) returns a credit. This keeps requests of
+    * a client that outruns the wrapper queued in the client, where they can be limited and rejected, instead of in
+    * socket buffers. 0 means the wrapper doesn't limit the session.
+    */
+    struct {
+        uint32_t sessionId;
+        uint64_t token;
+        uint32_t clientPid;
+        Channel channel;
+        VariableArray library;
+    } Hello;
+    struct {
+        uint32_t sessionId;
+        uint64_t token;
+        uint32_t wrapperPid;
+        uint32_t credits;
+    } HelloResponse;
+
+    /*
+    * Sent by the client when it stopped waiting for the call with the CallId in the header. The wrapper drops the request
+    * if it didn't start executing it yet and answers with CancelResponse in place of the request's response, which
+    * returns its credit. Otherwise, the request is answered as usual and the client discards the response.
+    */
+    struct {} Cancel;
+    struct {} CancelResponse;
+
+    /*
+    * Memory usage of the wrapper in KB, see metrics::MemoryUsage. Sent by the wrapper on the callback connection of every
+    * session while it executes calls, so the client can replace a wrapper that runs out of address space. There is no
+    * request.
+    */
+    struct {} MemoryReport;
+    struct {
+        uint32_t workingSetKb;
+        uint32_t privateKb;
+        uint32_t addressSpaceUsedKb;
+        uint32_t addressSpaceTotalKb;
+    } MemoryReportResponse;
+
+    /*
+    * Sent by the wrapper in place of the response to the request with the CallId in the header if it didn't execute it,
+    * e.g. because its arguments are invalid or refer to an object the session doesn't hold. There is no request.
+    */
+    struct {} Error;
+    struct {} ErrorResponse;
 };
 
 /*
@@ -111,20 +293,40 @@ struct MessageData
 {
     MsgId id;
     Direction direction;
+    Lane lane;
+    uint32_t callId;
     StaticData staticData;
     size_t variableDataLength;
     char variableData[MSG_MAX_SIZE];  // Offsets inside StaticData point into this buffer
 };
 
-/* Initialize a message. */
+/* Maximum size of the variable data that still fits into a message of MSG_MAX_SIZE. */
+unsigned const MSG_MAX_VARIABLE_SIZE = MSG_MAX_SIZE - MSG_HEADER_SIZE - sizeof(StaticData);
+
+/* Initialize a message. Its lane is the default lane of id. */
 void InitMessageData(MessageData& message, MsgId id, Direction direction);
 
+/* Lane of a MsgId unless the client chooses another one. */
+Lane DefaultLane(MsgId id);
+
+/* Length of the message whose header is at the start of buffer. The buffer must hold at least MSG_HEADER_SIZE bytes. */
+uint32_t FrameLength(char const *buffer);
+
+/* MsgId of the message whose header is at the start of buffer, which isn't validated. */
+MsgId FrameId(char const *buffer);
+
 /* Parse the contents of buffer into message. */
 bool ParseMessage(MessageData& message, Direction direction, char const *buffer, int bufferSize);
 
 /* Serialize message into buffer. */
 void SerializeMessage(MessageData const& message, char *buffer, int &messageSize);
 
+/* Human readable name of a MsgId. */
+char const *MsgIdName(MsgId id);
+
+/* Human readable name of a Lane. */
+char const *LaneName(Lane lane);
+
 } // end namespace
 
 // Restore original alignment
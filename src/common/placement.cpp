@@ -0,0 +1,184 @@
+#include "placement.h"
+
+#include <windows.h>
+
+#include <algorithm>
+#include <cctype>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <mutex>
+
+namespace placement {
+
+namespace {
+
+char const *const roleNames[ROLE_COUNT] = {"bridge-reader", "bridge-dispatcher", "wrapper-io", "wrapper-worker"};
+
+struct Priority
+{
+    char const *name;
+    int value;
+};
+
+Priority const priorities[] = {
+    {"idle", THREAD_PRIORITY_IDLE},
+    {"lowest", THREAD_PRIORITY_LOWEST},
+    {"below", THREAD_PRIORITY_BELOW_NORMAL},
+    {"normal", THREAD_PRIORITY_NORMAL},
+    {"above", THREAD_PRIORITY_ABOVE_NORMAL},
+    {"highest", THREAD_PRIORITY_HIGHEST},
+    {"critical", THREAD_PRIORITY_TIME_CRITICAL},
+};
+
+struct Placement
+{
+    bool pinned = false;
+    GROUP_AFFINITY affinity = {};
+    bool prioritized = false;
+    int priority = THREAD_PRIORITY_NORMAL;
+};
+
+// Guards the following
+std::mutex mutex;
+Placement placements[ROLE_COUNT];
+std::string currentSpec;
+
+/* Parse a list of CPUs and ranges, or a NUMA node. */
+bool ParseCpus(std::string const &cpus, GROUP_AFFINITY &affinity)
+{
+    affinity = {};
+
+    if (cpus.compare(0, 4, "node") == 0)
+    {
+        char const *number = cpus.c_str() + 4;
+        char *end;
+        unsigned long const node = std::strtoul(number, &end, 10);
+        return std::isdigit(*number) && *end == '\0' && node <= USHRT_MAX &&
+               GetNumaNodeProcessorMaskEx((USHORT)node, &affinity) && affinity.Mask != 0;
+    }
+
+    unsigned const maxCpus = sizeof(affinity.Mask) * CHAR_BIT;
+    char const *p = cpus.c_str();
+    while (true)
+    {
+        char *end;
+        if (!std::isdigit(*p)) return false;
+        unsigned long const first = std::strtoul(p, &end, 10);
+        unsigned long last = first;
+        if (*end == '-')
+        {
+            p = end + 1;
+            if (!std::isdigit(*p)) return false;
+            last = std::strtoul(p, &end, 10);
+        }
+
+        if (first > last || last >= maxCpus) return false;
+        for (unsigned long cpu = first; cpu <= last; cpu++)
+        {
+            affinity.Mask |= (ULONG_PTR)1 << cpu;
+        }
+
+        if (*end == '\0') return true;
+        if (*end != ',') return false;
+        p = end + 1;
+    }
+}
+
+/* Parse a single `<thread>=<cpus>[:<priority>]` entry into placements. */
+bool ParseEntry(std::string const &entry, Placement (&parsed)[ROLE_COUNT])
+{
+    size_t const equals = entry.find('=');
+    if (equals == std::string::npos) return false;
+
+    std::string const name = entry.substr(0, equals);
+    int role = 0;
+    while (role < ROLE_COUNT && name != roleNames[role]) role++;
+    if (role == ROLE_COUNT) return false;
+
+    Placement &placement = parsed[role];
+    size_t const colon = entry.find(':', equals);
+    std::string const cpus = entry.substr(equals + 1, colon == std::string::npos ? std::string::npos : colon - equals - 1);
+
+    if (cpus != "*")
+    {
+        if (!ParseCpus(cpus, placement.affinity)) return false;
+        placement.pinned = true;
+    }
+
+    if (colon != std::string::npos)
+    {
+        std::string const priority = entry.substr(colon + 1);
+        for (Priority const &p : priorities)
+        {
+            if (priority == p.name)
+            {
+                placement.prioritized = true;
+                placement.priority = p.value;
+            }
+        }
+        if (!placement.prioritized) return false;
+    }
+
+    return true;
+}
+
+} // end anonymous namespace
+
+bool Configure(char const *spec)
+{
+    if (spec == nullptr || strnlen(spec, SPEC_MAXLEN) == SPEC_MAXLEN)
+    {
+        return false;
+    }
+
+    Placement parsed[ROLE_COUNT];
+    std::string entry;
+    for (char const *p = spec; ; p++)
+    {
+        if (*p == ';' || *p == '\0')
+        {
+            if (!entry.empty() && !ParseEntry(entry, parsed)) return false;
+            entry.clear();
+            if (*p == '\0') break;
+        }
+        else if (!std::isspace(*p))
+        {
+            entry += *p;
+        }
+    }
+
+    std::lock_guard<std::mutex> guard(mutex);
+    std::copy(std::begin(parsed), std::end(parsed), std::begin(placements));
+    currentSpec = spec;
+    return true;
+}
+
+std::string Spec()
+{
+    std::lock_guard<std::mutex> guard(mutex);
+    return currentSpec;
+}
+
+bool Apply(Role role)
+{
+    Placement placement;
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        placement = placements[role];
+    }
+
+    bool placed = true;
+    if (placement.pinned)
+    {
+        placed = SetThreadGroupAffinity(GetCurrentThread(), &placement.affinity, NULL) && placed;
+    }
+    if (placement.prioritized)
+    {
+        placed = SetThreadPriority(GetCurrentThread(), placement.priority) && placed;
+    }
+    return placed;
+}
+
+} // end namespace
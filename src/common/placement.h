@@ -0,0 +1,47 @@
+/**
+ * Placement of the threads of bridge and wrapper on CPUs.
+ *
+ * A placement is configured by a spec of `<thread>=<cpus>[:<priority>]` entries separated by ';', for example
+ * "bridge-reader=2;wrapper-io=3:above;wrapper-worker=node0:highest".
+ *
+ * * <thread> is one of the names in Role below.
+ * * <cpus> is a list of CPUs and ranges like "0-3,8" in processor group 0, "node<n>" for all CPUs of a NUMA node, or
+ *   "*" to leave the CPU to the scheduler and only set the priority. The 32-bit wrapper can only be pinned to CPUs 0-31.
+ * * <priority> is one of idle, lowest, below, normal, above, highest or critical.
+ *
+ * Threads without an entry are left to the scheduler. The bridge passes its spec on to the wrapper it starts, so both
+ * processes are placed by the same spec.
+ */
+
+#ifndef DLL32TO64_PLACEMENT_H
+#define DLL32TO64_PLACEMENT_H
+
+#include <string>
+
+namespace placement {
+
+/* Threads that can be placed. */
+enum Role
+{
+    ROLE_BridgeReader,      // "bridge-reader": Receives the responses of all calls
+    ROLE_BridgeDispatcher,  // "bridge-dispatcher": Delivers callbacks to the client
+    ROLE_WrapperIo,         // "wrapper-io": Event loop serving all connections of the wrapper
+    ROLE_WrapperWorker,     // "wrapper-worker": Executes the calls of the wrapped DLL
+    ROLE_COUNT,
+};
+
+/* Maximum length of a spec. */
+unsigned const SPEC_MAXLEN = 512;
+
+/* Replace the current placement by the one in spec. Returns false and keeps the current placement if spec is invalid. */
+bool Configure(char const *spec);
+
+/* Spec of the current placement. Empty if all threads are left to the scheduler. */
+std::string Spec();
+
+/* Place the calling thread according to its role. Returns false if the OS refused the placement. */
+bool Apply(Role role);
+
+} // end namespace
+
+#endif
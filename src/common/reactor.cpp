@@ -0,0 +1,495 @@
+#include "reactor.h"
+#include "msg_protocol.h"
+
+#include <plog/Log.h>
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+
+namespace sock {
+
+namespace {
+
+bool SetNonBlocking(SOCKET socket)
+{
+    u_long nonBlocking = 1;
+    return ioctlsocket(socket, FIONBIO, &nonBlocking) == 0;
+}
+
+} // end anonymous namespace
+
+Reactor::~Reactor()
+{
+    for (auto &entry : connections_)
+    {
+        closesocket(entry.second.socket);
+    }
+    if (listener_ != INVALID_SOCKET) closesocket(listener_);
+    if (wakeSocket_ != INVALID_SOCKET) closesocket(wakeSocket_);
+}
+
+bool Reactor::Listen(Address const &listenAddress, int &boundPort)
+{
+    sockaddr_in address;
+    int addressSize = sizeof(address);
+
+    // Wake-up socket: bound to a free port and connected to itself
+    wakeSocket_ = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    address.sin_family = AF_INET;
+    address.sin_port = 0;
+    inet_pton(AF_INET, ipAddress, &address.sin_addr);
+    if (wakeSocket_ == INVALID_SOCKET ||
+        bind(wakeSocket_, (sockaddr*)&address, sizeof(address)) != 0 ||
+        getsockname(wakeSocket_, (sockaddr*)&address, &addressSize) != 0 ||
+        connect(wakeSocket_, (sockaddr*)&address, sizeof(address)) != 0 ||
+        !SetNonBlocking(wakeSocket_))
+    {
+        PLOG_ERROR << "Can't create wake-up socket, Err: " << WSAGetLastError();
+        return false;
+    }
+
+    transport_ = listenAddress.transport;
+    if (!CreateSocket(listener_, transport_))
+    {
+        return false;
+    }
+
+    if (!Bind(listener_, listenAddress) ||
+        listen(listener_, SOMAXCONN) != 0 ||
+        !SetNonBlocking(listener_))
+    {
+        PLOG_ERROR << "Can't listen on " << ToString(listenAddress) << ", Err: " << WSAGetLastError();
+        closesocket(listener_);
+        listener_ = INVALID_SOCKET;
+        return false;
+    }
+
+    boundPort = 0;
+    if (transport_ == TRANSPORT_Tcp)
+    {
+        addressSize = sizeof(address);
+        if (getsockname(listener_, (sockaddr*)&address, &addressSize) != 0)
+        {
+            PLOG_ERROR << "getsockname() Error: " << WSAGetLastError();
+            closesocket(listener_);
+            listener_ = INVALID_SOCKET;
+            return false;
+        }
+        boundPort = ntohs(address.sin_port);
+    }
+
+    return true;
+}
+
+void Reactor::Run()
+{
+    std::vector<WSAPOLLFD> fds;
+    std::vector<ConnectionId> ids;
+
+    while (!stopRequested_.load())
+    {
+        fds.clear();
+        ids.clear();
+        fds.push_back(WSAPOLLFD{wakeSocket_, POLLRDNORM, 0});
+        fds.push_back(WSAPOLLFD{listener_, POLLRDNORM, 0});
+
+        // Messages that were held back while reading was paused can't wait for more data to arrive
+        for (auto &entry : connections_)
+        {
+            if (entry.second.readResumed.exchange(false)) Read(entry.first, entry.second);
+        }
+        RemoveClosed();
+
+        {
+            std::lock_guard<std::mutex> guard(mutex_);
+            for (auto const &entry : connections_)
+            {
+                Connection const &connection = entry.second;
+                // A paused connection is still polled for errors, which are reported without asking
+                short events = connection.readPaused.load() ? 0 : POLLRDNORM;
+                if (connection.outSent < connection.out.size()) events |= POLLWRNORM;
+                fds.push_back(WSAPOLLFD{connection.socket, events, 0});
+                ids.push_back(entry.first);
+            }
+        }
+
+        if (WSAPoll(fds.data(), fds.size(), -1) == SOCKET_ERROR)
+        {
+            PLOG_ERROR << "WSAPoll() Error: " << WSAGetLastError();
+            break;
+        }
+
+        if (fds[0].revents != 0) DrainWakeups();
+        if (fds[1].revents != 0) Accept();
+
+        for (size_t i = 0; i < ids.size(); i++)
+        {
+            short const revents = fds[i + 2].revents;
+            if (revents == 0)
+            {
+                continue;
+            }
+
+            Connection &connection = connections_.at(ids[i]);
+            if (revents & POLLRDNORM)
+            {
+                Read(ids[i], connection);
+            }
+            else if (revents & (POLLHUP | POLLERR | POLLNVAL))
+            {
+                // A paused connection isn't read, which would report the error
+                if (connection.readPaused.load())
+                {
+                    std::lock_guard<std::mutex> guard(mutex_);
+                    connection.failed = true;
+                }
+                else
+                {
+                    Read(ids[i], connection);
+                }
+            }
+            if (revents & POLLWRNORM)
+            {
+                std::lock_guard<std::mutex> guard(mutex_);
+                if (!Flush(connection)) connection.failed = true;
+            }
+        }
+
+        RemoveClosed();
+    }
+
+    // Last chance to deliver pending responses and callbacks
+    std::lock_guard<std::mutex> guard(mutex_);
+    for (auto &entry : connections_)
+    {
+        Flush(entry.second);
+    }
+}
+
+void Reactor::Stop()
+{
+    stopRequested_.store(true);
+    Wake();
+}
+
+bool Reactor::Send(ConnectionId id, char const *frame, int length, bool urgent)
+{
+    bool needsLoop;
+    bool queued = true;
+    {
+        std::lock_guard<std::mutex> guard(mutex_);
+        auto const it = connections_.find(id);
+        if (it == connections_.end() || it->second.closeRequested || it->second.failed)
+        {
+            return false;
+        }
+
+        Connection &connection = it->second;
+        bool const wasIdle = connection.outSent == connection.out.size();
+        if (connection.out.size() - connection.outSent + length > REACTOR_MAX_QUEUED_BYTES)
+        {
+            // The peer doesn't keep up, and its messages would pile up in our memory
+            PLOG_WARNING << "Dropping connection with " << connection.out.size() - connection.outSent
+                         << " bytes queued";
+            connection.failed = true;
+            queued = false;
+        }
+        else if (urgent && !wasIdle)
+        {
+            // Messages can't be split, so the partially sent one has to go first
+            size_t unsent = connection.outFrame;
+            if (unsent < connection.outSent) unsent += msg::FrameLength(&connection.out[unsent]);
+
+            size_t const position = std::max(unsent, connection.outUrgentEnd);
+            connection.out.insert(connection.out.begin() + position, frame, frame + length);
+            connection.outUrgentEnd = position + length;
+        }
+        else
+        {
+            connection.out.insert(connection.out.end(), frame, frame + length);
+        }
+
+        // If the loop is already waiting for the socket to become writable, it will send this as well
+        if (queued && !wasIdle)
+        {
+            return true;
+        }
+
+        if (queued && !Flush(connection)) connection.failed = true;
+        needsLoop = connection.failed || connection.outSent < connection.out.size();
+    }
+
+    if (needsLoop) Wake();
+    return queued;
+}
+
+void Reactor::Close(ConnectionId id)
+{
+    {
+        std::lock_guard<std::mutex> guard(mutex_);
+        auto const it = connections_.find(id);
+        if (it == connections_.end())
+        {
+            return;
+        }
+        it->second.closeRequested = true;
+    }
+
+    Wake();
+}
+
+void Reactor::Abort(ConnectionId id)
+{
+    {
+        std::lock_guard<std::mutex> guard(mutex_);
+        auto const it = connections_.find(id);
+        if (it == connections_.end())
+        {
+            return;
+        }
+        it->second.failed = true;
+    }
+
+    Wake();
+}
+
+void Reactor::PauseReading(ConnectionId id)
+{
+    std::lock_guard<std::mutex> guard(mutex_);
+    auto const it = connections_.find(id);
+    if (it != connections_.end()) it->second.readPaused.store(true);
+}
+
+void Reactor::ResumeReading(ConnectionId id)
+{
+    {
+        std::lock_guard<std::mutex> guard(mutex_);
+        auto const it = connections_.find(id);
+        if (it == connections_.end() || !it->second.readPaused.exchange(false))
+        {
+            return;
+        }
+        it->second.readResumed.store(true);
+    }
+
+    Wake();
+}
+
+void Reactor::TrackMessages(ConnectionId id, MessageDone done)
+{
+    std::lock_guard<std::mutex> guard(mutex_);
+    auto const it = connections_.find(id);
+    if (it != connections_.end()) it->second.messageDone = done;
+}
+
+void Reactor::Wake()
+{
+    // A single pending datagram is enough to wake the loop
+    if (!wakePending_.exchange(true))
+    {
+        char const signal = 0;
+        send(wakeSocket_, &signal, 1, 0);
+    }
+}
+
+void Reactor::DrainWakeups()
+{
+    char buf[16];
+    while (recv(wakeSocket_, buf, sizeof(buf), 0) > 0) {}
+
+    // Only now, or the datagram of a Wake() that comes in between would be drained as well, and no further Wake()
+    // would send one. Work requested before this point is handled by the current iteration.
+    wakePending_.store(false);
+}
+
+void Reactor::Accept()
+{
+    while (true)
+    {
+        SOCKET const socket = accept(listener_, NULL, NULL);
+        if (socket == INVALID_SOCKET)
+        {
+            int const lastError = WSAGetLastError();
+            if (lastError != WSAEWOULDBLOCK)
+            {
+                PLOG_ERROR << "accept() Error: " << lastError;
+            }
+            return;
+        }
+
+        // Messages are written as a whole, so there is nothing to gain from delaying them
+        if (transport_ == TRANSPORT_Tcp)
+        {
+            BOOL const noDelay = TRUE;
+            setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, (char const*)&noDelay, sizeof(noDelay));
+        }
+
+        if (!SetNonBlocking(socket))
+        {
+            PLOG_ERROR << "Can't make socket non-blocking, Err: " << WSAGetLastError();
+            closesocket(socket);
+            continue;
+        }
+
+        std::lock_guard<std::mutex> guard(mutex_);
+        Connection &connection = connections_[nextConnectionId_++];
+        connection.socket = socket;
+        connection.in.resize(REACTOR_READ_BUFFER_SIZE);
+    }
+}
+
+void Reactor::Read(ConnectionId id, Connection &connection)
+{
+    // Messages that were held back go first
+    if (!Dispatch(id, connection)) return;
+
+    while (!connection.readPaused.load())
+    {
+        int const space = connection.in.size() - connection.inUsed;
+        if (space == 0)
+        {
+            // Paused and resumed since the last messages were handed out, which the loop catches up on
+            return;
+        }
+
+        int const received = recv(connection.socket, &connection.in[connection.inUsed], space, 0);
+        if (received == 0 || (received == SOCKET_ERROR && WSAGetLastError() != WSAEWOULDBLOCK))
+        {
+            // Peer hung up or the connection broke
+            std::lock_guard<std::mutex> guard(mutex_);
+            connection.failed = true;
+            return;
+        }
+        if (received == SOCKET_ERROR)
+        {
+            return;
+        }
+
+        connection.inUsed += received;
+        if (!Dispatch(id, connection)) return;
+
+        if (received < space)
+        {
+            // Socket is drained
+            return;
+        }
+    }
+}
+
+bool Reactor::Dispatch(ConnectionId id, Connection &connection)
+{
+    size_t pos = 0;
+    while (connection.inUsed - pos >= msg::MSG_HEADER_SIZE && !connection.readPaused.load())
+    {
+        uint32_t const length = msg::FrameLength(&connection.in[pos]);
+        if (length < msg::MSG_HEADER_SIZE || length > msg::MSG_MAX_SIZE)
+        {
+            // The stream can't be split into messages anymore
+            PLOG_ERROR << "Invalid message length " << length;
+            std::lock_guard<std::mutex> guard(mutex_);
+            connection.failed = true;
+            return false;
+        }
+        if (connection.inUsed - pos < length)
+        {
+            break;
+        }
+
+        handler_.OnFrame(id, &connection.in[pos], length);
+        pos += length;
+    }
+
+    // Keep the start of an incomplete message, and the messages held back
+    std::memmove(&connection.in[0], &connection.in[pos], connection.inUsed - pos);
+    connection.inUsed -= pos;
+    return true;
+}
+
+bool Reactor::Flush(Connection &connection)
+{
+    while (connection.outSent < connection.out.size())
+    {
+        size_t const pending = connection.out.size() - connection.outSent;
+        int const sent = send(connection.socket, &connection.out[connection.outSent],
+                              pending > INT_MAX ? INT_MAX : (int)pending, 0);
+        if (sent == SOCKET_ERROR)
+        {
+            int const lastError = WSAGetLastError();
+            if (lastError == WSAEWOULDBLOCK)
+            {
+                Compact(connection);
+                return true;
+            }
+
+            PLOG_ERROR << "send() Error: " << lastError;
+            return false;
+        }
+
+        connection.outSent += sent;
+
+        while (connection.outFrame < connection.outSent)
+        {
+            size_t const frameEnd = connection.outFrame + msg::FrameLength(&connection.out[connection.outFrame]);
+            if (frameEnd > connection.outSent) break;
+            if (connection.messageDone != nullptr) connection.messageDone(&connection.out[connection.outFrame], true);
+            connection.outFrame = frameEnd;
+        }
+    }
+
+    connection.out.clear();
+    connection.outSent = 0;
+    connection.outFrame = 0;
+    connection.outUrgentEnd = 0;
+    return true;
+}
+
+void Reactor::Compact(Connection &connection)
+{
+    if (connection.outFrame == 0) return;
+
+    connection.out.erase(connection.out.begin(), connection.out.begin() + connection.outFrame);
+    connection.outSent -= connection.outFrame;
+    connection.outUrgentEnd -= std::min(connection.outUrgentEnd, connection.outFrame);
+    connection.outFrame = 0;
+}
+
+void Reactor::RemoveClosed()
+{
+    std::vector<ConnectionId> hungUp;
+    {
+        std::lock_guard<std::mutex> guard(mutex_);
+        for (auto it = connections_.begin(); it != connections_.end();)
+        {
+            Connection const &connection = it->second;
+            bool const flushed = connection.outSent == connection.out.size();
+            if (!connection.failed && !(connection.closeRequested && flushed))
+            {
+                ++it;
+                continue;
+            }
+
+            if (!connection.closeRequested)
+            {
+                hungUp.push_back(it->first);
+            }
+            if (connection.messageDone != nullptr)
+            {
+                for (size_t frame = connection.outFrame; frame < connection.out.size();
+                     frame += msg::FrameLength(&connection.out[frame]))
+                {
+                    connection.messageDone(&connection.out[frame], false);
+                }
+            }
+            closesocket(connection.socket);
+            it = connections_.erase(it);
+        }
+    }
+
+    for (ConnectionId const id : hungUp)
+    {
+        handler_.OnClose(id);
+    }
+}
+
+} // end namespace
@@ -0,0 +1,157 @@
+/**
+ * Event loop that serves many non-blocking socket connections from a single thread.
+ *
+ * The loop waits with WSAPoll() until the listener, a connection or its wake-up socket is ready. It accepts new
+ * connections, reads whatever data arrived, splits it into messages (see msg::FrameLength()) and hands complete messages
+ * to the Handler.
+ *
+ * Messages can be sent from any thread. They are written right away as far as the socket accepts them. The rest is
+ * buffered and written by the loop as soon as the socket becomes writable again, so senders never block on the peer.
+ * Urgent messages overtake buffered ones that haven't started sending yet.
+ */
+
+#ifndef DLL32TO64_REACTOR_H
+#define DLL32TO64_REACTOR_H
+
+#include "socket.h"
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <vector>
+
+namespace sock {
+
+/* Size of the receive buffer of each connection. Must hold at least one message of msg::MSG_MAX_SIZE. */
+unsigned const REACTOR_READ_BUFFER_SIZE = 64 * 1024;
+
+/* Bytes that may be queued for sending on a connection. A peer that doesn't read them is dropped. */
+size_t const REACTOR_MAX_QUEUED_BYTES = 4 * 1024 * 1024;
+
+class Reactor
+{
+public:
+    /* Identifies a connection. 0 is never used. */
+    typedef uint32_t ConnectionId;
+
+    /* Receives the events of the loop. All methods are called by the thread running the loop. */
+    class Handler
+    {
+    public:
+        virtual ~Handler() = default;
+
+        /* A complete message was received. `frame` is only valid during the call. */
+        virtual void OnFrame(ConnectionId connection, char const *frame, int length) = 0;
+
+        /* The peer closed the connection or it failed. Not called for connections closed with Close(). */
+        virtual void OnClose(ConnectionId connection) = 0;
+    };
+
+    explicit Reactor(Handler &handler) : handler_(handler) {}
+    ~Reactor();
+
+    Reactor(Reactor const&) = delete;
+    Reactor& operator=(Reactor const&) = delete;
+
+    /*
+     * Listen on address. Must be called before Run().
+     *
+     * @param boundPort: Port the listener was bound to for TRANSPORT_Tcp (in case address.port is 0), 0 otherwise.
+     */
+    bool Listen(Address const &address, int &boundPort);
+
+    /* Run the loop until Stop() is called. */
+    void Run();
+
+    /* Make Run() return after writing what can be written without blocking. Can be called from any thread. */
+    void Stop();
+
+    /*
+     * Queue a message for sending. Can be called from any thread. Returns false if the connection is gone, or the
+     * message would exceed REACTOR_MAX_QUEUED_BYTES. Then, the connection fails as if the peer hung up.
+     *
+     * @param urgent: Send it before all buffered messages that are not urgent, except the one that is partially sent.
+     */
+    bool Send(ConnectionId connection, char const *frame, int length, bool urgent = false);
+
+    /* Close a connection once everything queued for it has been sent. Can be called from any thread. */
+    void Close(ConnectionId connection);
+
+    /* Close a connection right away, as if the peer hung up: Queued messages are dropped and OnClose() is called. */
+    void Abort(ConnectionId connection);
+
+    /*
+     * Stop handing out messages of a connection, e.g. because its peer has too many requests outstanding. Messages that
+     * were received already are held back, the rest waits in the socket. Can be called from any thread.
+     */
+    void PauseReading(ConnectionId connection);
+
+    /* Hand out the messages of a paused connection again. Can be called from any thread. */
+    void ResumeReading(ConnectionId connection);
+
+    /* Invoked for a message once it was sent completely (`sent`) or dropped with its connection. */
+    typedef void (*MessageDone)(char const *frame, bool sent);
+
+    /*
+     * Invoke `done` for every message queued on a connection from now on, e.g. to count messages that wait for a slow
+     * peer. It is called with the reactor's lock held, so it must not call the reactor. Can be called from any thread.
+     */
+    void TrackMessages(ConnectionId connection, MessageDone done);
+
+private:
+    struct Connection
+    {
+        SOCKET socket = INVALID_SOCKET;
+
+        // Received bytes that weren't handed out yet. Only accessed by the loop.
+        std::vector<char> in;
+        size_t inUsed = 0;
+        // Set while reading is paused, and once it was resumed until the loop handed out the held back messages
+        std::atomic<bool> readPaused{false};
+        std::atomic<bool> readResumed{false};
+
+        // Guarded by mutex_. Messages that were sent completely are removed when the socket stops taking more.
+        std::vector<char> out;
+        size_t outSent = 0;
+        // Start of the first message in out that isn't sent completely
+        size_t outFrame = 0;
+        // End of the last urgent message in out
+        size_t outUrgentEnd = 0;
+        bool closeRequested = false;
+        bool failed = false;
+        // See TrackMessages(), nullptr if messages aren't tracked. Guarded by mutex_.
+        MessageDone messageDone = nullptr;
+    };
+
+    void Wake();
+    void DrainWakeups();
+    void Accept();
+    void Read(ConnectionId id, Connection &connection);
+    /* Hand out the complete messages of connection's input until it is paused. False if the stream is invalid. */
+    bool Dispatch(ConnectionId id, Connection &connection);
+    void RemoveClosed();
+
+    /* Write as much of connection's output as the socket takes. Returns false on error. Must hold mutex_. */
+    bool Flush(Connection &connection);
+    /* Remove the messages that were sent completely from connection's output. Must hold mutex_. */
+    void Compact(Connection &connection);
+
+    Handler &handler_;
+    Transport transport_ = TRANSPORT_Tcp;
+    SOCKET listener_ = INVALID_SOCKET;
+    // Datagram socket connected to itself, which makes WSAPoll() return when other threads need the loop
+    SOCKET wakeSocket_ = INVALID_SOCKET;
+    std::atomic<bool> wakePending_{false};
+    std::atomic<bool> stopRequested_{false};
+
+    // Guards the output state of all connections and insertions into connections_. Only the loop erases connections,
+    // so it may access connections_ without the lock otherwise.
+    std::mutex mutex_;
+    std::map<ConnectionId, Connection> connections_;
+    ConnectionId nextConnectionId_ = 1;
+};
+
+} // end namespace
+
+#endif // DLL32TO64_REACTOR_H
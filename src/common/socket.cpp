@@ -1,9 +1,59 @@
 #include "socket.h"
+#include "msg_protocol.h"
 
 #include <plog/Log.h>
 
+#include <cstring>
+
 namespace sock {
 
+namespace {
+
+/* Socket address of address. Returns its size. */
+int ToSockaddr(Address const &address, sockaddr_storage &storage)
+{
+    std::memset(&storage, 0, sizeof(storage));
+
+    if (address.transport == TRANSPORT_Unix)
+    {
+        sockaddr_un &unixAddress = (sockaddr_un&)storage;
+        unixAddress.sun_family = AF_UNIX;
+        std::strcpy(unixAddress.sun_path, address.path);
+        return sizeof(unixAddress);
+    }
+
+    sockaddr_in &inetAddress = (sockaddr_in&)storage;
+    inetAddress.sin_family = AF_INET;
+    inetAddress.sin_port = htons(address.port);
+    inet_pton(AF_INET, ipAddress, &inetAddress.sin_addr);
+    return sizeof(inetAddress);
+}
+
+} // end anonymous namespace
+
+bool SetUnixPath(Address &address, char const *path)
+{
+    if (strnlen(path, sizeof(address.path)) == sizeof(address.path))
+    {
+        PLOG_ERROR << "Socket path too long: " << path;
+        return false;
+    }
+
+    address.transport = TRANSPORT_Unix;
+    std::strcpy(address.path, path);
+    return true;
+}
+
+std::string ToString(Address const &address)
+{
+    if (address.transport == TRANSPORT_Unix)
+    {
+        return std::string("socket ") + address.path;
+    }
+
+    return "port " + std::to_string(address.port);
+}
+
 bool StartupWinSock()
 {
     PLOG_INFO << "Starting WinSock";
@@ -20,11 +70,11 @@ bool StartupWinSock()
     return true;
 }
 
-bool CreateSocket(SOCKET &sock)
+bool CreateSocket(SOCKET &sock, Transport transport)
 {
     PLOG_INFO << "Creating new Socket";
 
-    sock = socket(AF_INET, SOCK_STREAM, 0);
+    sock = socket(transport == TRANSPORT_Unix ? AF_UNIX : AF_INET, SOCK_STREAM, 0);
     if (sock == INVALID_SOCKET)
     {
         int const lastError = WSAGetLastError();
@@ -35,6 +85,46 @@ bool CreateSocket(SOCKET &sock)
     return true;
 }
 
+bool Bind(SOCKET sock, Address const &address)
+{
+    if (address.transport == TRANSPORT_Unix)
+    {
+        // Left behind by a wrapper that didn't exit cleanly
+        DeleteFileA(address.path);
+    }
+
+    sockaddr_storage storage;
+    int const size = ToSockaddr(address, storage);
+    return bind(sock, (sockaddr*)&storage, size) == 0;
+}
+
+bool Connect(SOCKET &sock, Address const &address)
+{
+    if (!CreateSocket(sock, address.transport))
+    {
+        return false;
+    }
+
+    sockaddr_storage storage;
+    int const size = ToSockaddr(address, storage);
+    if (connect(sock, (sockaddr*)&storage, size) == SOCKET_ERROR)
+    {
+        PLOG_ERROR << "Can't connect to " << ToString(address) << ", Err: " << WSAGetLastError();
+        closesocket(sock);
+        sock = INVALID_SOCKET;
+        return false;
+    }
+
+    if (address.transport == TRANSPORT_Tcp)
+    {
+        // Messages are written as a whole, so there is nothing to gain from delaying them
+        BOOL const noDelay = TRUE;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char const*)&noDelay, sizeof(noDelay));
+    }
+
+    return true;
+}
+
 bool Send(SOCKET socket, char const *buf, int size)
 {
     int totalBytesSent = 0;
@@ -74,4 +164,65 @@ bool Receive(SOCKET socket, char *buf, int bufSize, int& recvBytes)
     return true;
 }
 
+/* Receive until buf is full. */
+static bool ReceiveAll(SOCKET socket, char *buf, int size, int& recvBytes)
+{
+    int total = 0;
+    while (total < size)
+    {
+        if (!Receive(socket, &buf[total], size - total, recvBytes))
+        {
+            return false;
+        }
+        total += recvBytes;
+    }
+
+    recvBytes = total;
+    return true;
+}
+
+bool ReceiveFrame(SOCKET socket, char *buf, int bufSize, int& frameBytes)
+{
+    if (!ReceiveAll(socket, buf, msg::MSG_HEADER_SIZE, frameBytes))
+    {
+        return false;
+    }
+
+    uint32_t const length = msg::FrameLength(buf);
+    if (length < msg::MSG_HEADER_SIZE || length > (uint32_t)bufSize)
+    {
+        // The stream can't be split into messages anymore
+        PLOG_ERROR << "Invalid message length " << length;
+        frameBytes = SOCKET_ERROR;
+        return false;
+    }
+
+    if (!ReceiveAll(socket, &buf[msg::MSG_HEADER_SIZE], length - msg::MSG_HEADER_SIZE, frameBytes))
+    {
+        return false;
+    }
+
+    frameBytes = length;
+    return true;
+}
+
+bool WaitForData(SOCKET socket, int timeoutMs, bool &timedOut)
+{
+    WSAPOLLFD fd = {};
+    fd.fd = socket;
+    fd.events = POLLRDNORM;
+
+    int const result = WSAPoll(&fd, 1, timeoutMs < 0 ? -1 : timeoutMs);
+    timedOut = result == 0;
+    if (result == SOCKET_ERROR)
+    {
+        int const lastError = WSAGetLastError();
+        PLOG_ERROR << "WSAPoll() Error: " << lastError;
+        return false;
+    }
+
+    // A closed connection or error is reported by the following receive
+    return result > 0;
+}
+
 } // end namespace
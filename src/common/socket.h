@@ -1,6 +1,8 @@
 #ifndef DLL32TO64_SOCKET_H
 #define DLL32TO64_SOCKET_H
 
+#include <string>
+
 // Need to define the Windows version manually if not using MSVC
 #ifndef NTDDI_VERSION
     #define NTDDI_VERSION NTDDI_WIN10_19H1
@@ -10,21 +12,47 @@
 #endif
 
 #include <WS2tcpip.h>  // Windows Sockets
+#include <afunix.h>    // AF_UNIX sockets, available since Windows 10 1803
 
 namespace sock {
 
 // Establish connections on loopback address
 char const ipAddress[] = "127.0.0.1";
-// Port for Request-Response connection
-int const requestPort = 54000;
-// Port for Callback connection
-int const callbackPort = 54001;
+// Default port of a shared wrapper daemon (wrapper.exe --daemon). Wrappers started per client use a free port instead.
+int const daemonPort = 54000;
+
+/* Transport between bridge and wrapper. */
+enum Transport
+{
+    TRANSPORT_Tcp,   // TCP on the loopback address
+    TRANSPORT_Unix,  // AF_UNIX stream socket, which skips the TCP/IP stack and needs no port
+};
+
+/* Endpoint a wrapper listens on. */
+struct Address
+{
+    Transport transport = TRANSPORT_Tcp;
+    int port = 0;                   // TRANSPORT_Tcp: Port on the loopback address, 0 to listen on any free port
+    char path[UNIX_PATH_MAX] = "";  // TRANSPORT_Unix: 0-terminated path of the socket file
+};
+
+/* Make address a TRANSPORT_Unix address of the socket file at path. Returns false if the path is too long. */
+bool SetUnixPath(Address &address, char const *path);
+
+/* Human readable form of address for log messages. */
+std::string ToString(Address const &address);
 
 // Wrapper around WSAStartup()
 bool StartupWinSock();
 
-/* Create a socket. */
-bool CreateSocket(SOCKET &sock);
+/* Create a socket for the transport. */
+bool CreateSocket(SOCKET &sock, Transport transport = TRANSPORT_Tcp);
+
+/* Bind sock to address. For TRANSPORT_Unix, a leftover socket file at the path is removed first. */
+bool Bind(SOCKET sock, Address const &address);
+
+/* Connect a new socket to address. Returns false and leaves sock invalid if that fails. */
+bool Connect(SOCKET &sock, Address const &address);
 
 /* Wrapper around send() syscall, that only returns once all of buf has been sent (or an error occured) */
 bool Send(SOCKET socket, char const *buf, int size);
@@ -36,6 +64,22 @@ bool Send(SOCKET socket, char const *buf, int size);
  */
 bool Receive(SOCKET socket, char *buf, int bufSize, int& recvBytes);
 
+/*
+ * Receive exactly one message (see msg_protocol.h) into buf, however it was split up by the transport.
+ *
+ * If this returns false, 'frameBytes' will contain the error code (or 0 if the connection was closed) instead of the
+ * message length.
+ */
+bool ReceiveFrame(SOCKET socket, char *buf, int bufSize, int& frameBytes);
+
+/*
+ * Wait until data can be received on socket.
+ *
+ * @param timeoutMs: Maximum time to wait, negative to wait forever.
+ * @param timedOut: Set to true if this returned false because the time ran out rather than because of an error.
+ */
+bool WaitForData(SOCKET socket, int timeoutMs, bool &timedOut);
+
 } // end namespace
 
 #endif // DLL32TO64_SOCKET_H
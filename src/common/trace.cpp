@@ -0,0 +1,181 @@
+#include "trace.h"
+
+#include <windows.h>
+
+#include <atomic>
+#include <cinttypes>
+
+namespace trace {
+
+namespace {
+
+/* Chrome trace phases used by us. */
+char const PHASE_Complete = 'X';
+char const PHASE_FlowStart = 's';
+char const PHASE_FlowStep = 't';
+
+struct Event
+{
+    char const *name;
+    int64_t timestamp;
+    int64_t duration;
+    uint32_t id;
+    char phase;
+};
+
+struct ThreadBuffer
+{
+    DWORD threadId;
+    // Number of valid entries in events. Only incremented by the owning thread after an event was completely written.
+    std::atomic<uint32_t> count;
+    Event events[EVENTS_PER_THREAD];
+};
+
+std::atomic<bool> enabled(false);
+char const *process = "";
+int64_t offset = 0;
+
+// Buffers of all threads that have recorded events so far. Once registered, buffers live until the process exits
+// because the trace is only written when the threads might already be gone.
+std::atomic<ThreadBuffer*> buffers[MAX_THREADS];
+std::atomic<unsigned> numBuffers(0);
+
+thread_local ThreadBuffer *localBuffer = nullptr;
+
+ThreadBuffer *GetLocalBuffer()
+{
+    if (localBuffer != nullptr)
+    {
+        return localBuffer;
+    }
+
+    unsigned const slot = numBuffers.fetch_add(1);
+    if (slot >= MAX_THREADS)
+    {
+        // Don't retry registration for every event of this thread
+        static ThreadBuffer overflow;
+        localBuffer = &overflow;
+        overflow.count.store(EVENTS_PER_THREAD);
+        return localBuffer;
+    }
+
+    localBuffer = new ThreadBuffer();
+    localBuffer->threadId = GetCurrentThreadId();
+    localBuffer->count.store(0);
+    buffers[slot].store(localBuffer, std::memory_order_release);
+    return localBuffer;
+}
+
+void Record(char phase, char const *name, int64_t timestamp, int64_t duration, uint32_t id)
+{
+    ThreadBuffer *buffer = GetLocalBuffer();
+
+    uint32_t const index = buffer->count.load(std::memory_order_relaxed);
+    if (index >= EVENTS_PER_THREAD)
+    {
+        return;
+    }
+
+    Event &event = buffer->events[index];
+    event.phase = phase;
+    event.name = name;
+    event.timestamp = timestamp;
+    event.duration = duration;
+    event.id = id;
+
+    // Publish the event to WriteEvents()
+    buffer->count.store(index + 1, std::memory_order_release);
+}
+
+} // end anonymous namespace
+
+int64_t Now()
+{
+    static int64_t const frequency = []()
+    {
+        LARGE_INTEGER f;
+        QueryPerformanceFrequency(&f);
+        return (int64_t)f.QuadPart;
+    }();
+
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+
+    // Split the conversion to avoid overflowing the multiplication
+    int64_t const ticks = counter.QuadPart;
+    return (ticks / frequency) * 1000000 + ((ticks % frequency) * 1000000) / frequency;
+}
+
+void Enable(char const *processName, int64_t clockOffset)
+{
+    process = processName;
+    offset = clockOffset;
+    enabled.store(true, std::memory_order_release);
+}
+
+bool IsEnabled()
+{
+    return enabled.load(std::memory_order_relaxed);
+}
+
+void Complete(char const *name, int64_t start, int64_t end, uint32_t callId)
+{
+    Record(PHASE_Complete, name, start, end - start, callId);
+}
+
+void FlowStart(uint32_t flowId, int64_t time)
+{
+    if (!IsEnabled()) return;
+    Record(PHASE_FlowStart, "call", time, 0, flowId);
+}
+
+void FlowStep(uint32_t flowId, int64_t time)
+{
+    if (!IsEnabled()) return;
+    Record(PHASE_FlowStep, "call", time, 0, flowId);
+}
+
+void WriteEvents(FILE *file, bool &needSeparator)
+{
+    DWORD const pid = GetCurrentProcessId();
+
+    fprintf(file, "%s{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%lu,\"args\":{\"name\":\"%s\"}}",
+            needSeparator ? ",\n" : "", pid, process);
+    needSeparator = true;
+
+    unsigned const registered = numBuffers.load();
+    for (unsigned b = 0; b < registered && b < MAX_THREADS; b++)
+    {
+        ThreadBuffer const *buffer = buffers[b].load(std::memory_order_acquire);
+        if (buffer == nullptr)
+        {
+            // Thread is just registering itself
+            continue;
+        }
+
+        uint32_t const count = buffer->count.load(std::memory_order_acquire);
+        for (uint32_t i = 0; i < count; i++)
+        {
+            Event const &event = buffer->events[i];
+            int64_t const timestamp = event.timestamp - offset;
+
+            if (event.phase == PHASE_Complete)
+            {
+                fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"dll32to64\",\"ph\":\"X\",\"ts\":%" PRId64 ",\"dur\":%" PRId64
+                              ",\"pid\":%lu,\"tid\":%lu,\"args\":{\"callId\":%" PRIu32 "}}",
+                        event.name, timestamp, event.duration, pid, buffer->threadId, event.id);
+            }
+            else
+            {
+                // Flow events bind to the enclosing span ("bp":"e") instead of the next one
+                fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"flow\",\"ph\":\"%c\",\"bp\":\"e\",\"id\":%" PRIu32
+                              ",\"ts\":%" PRId64 ",\"pid\":%lu,\"tid\":%lu}",
+                        event.name, event.phase, event.id, timestamp, pid, buffer->threadId);
+            }
+        }
+    }
+
+    fflush(file);
+}
+
+} // end namespace
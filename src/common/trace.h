@@ -0,0 +1,83 @@
+/**
+ * Opt-in span tracing in the Chrome Trace Event format (readable by chrome://tracing and https://ui.perfetto.dev).
+ *
+ * Every thread records its events into its own fixed size buffer, so recording an event never takes a lock. Buffers are
+ * only read when the trace is written out, which happens once at shutdown.
+ *
+ * Bridge and wrapper each record their own events. During connection setup the bridge measures the offset between both
+ * clocks (see MSGID_ClockSync) and passes it to the wrapper, which shifts its timestamps into the bridge's time domain
+ * when writing them. This allows the events of both processes to be merged into a single timeline.
+ */
+
+#ifndef DLL32TO64_TRACE_H
+#define DLL32TO64_TRACE_H
+
+#include <cstdint>
+#include <cstdio>
+
+namespace trace {
+
+/* Maximum number of events recorded per thread. Further events are dropped. */
+unsigned const EVENTS_PER_THREAD = 32768;
+/* Maximum number of threads that can record events. */
+unsigned const MAX_THREADS = 64;
+
+/* Current time of the trace clock in microseconds. */
+int64_t Now();
+
+/*
+ * Start recording events.
+ *
+ * @param processName: Name under which this process shows up in the trace. Must be a string literal.
+ * @param clockOffset: Offset (in microseconds) that is subtracted from all timestamps when writing events.
+ */
+void Enable(char const *processName, int64_t clockOffset);
+
+/* True if events are currently recorded. */
+bool IsEnabled();
+
+/* Record a span that started at `start` and ended at `end`. `name` must be a string literal. */
+void Complete(char const *name, int64_t start, int64_t end, uint32_t callId);
+
+/* Start a flow (arrow in the trace viewer) from the span enclosing the current time on this thread. */
+void FlowStart(uint32_t flowId, int64_t time);
+
+/* Continue the flow with the given id at the span enclosing the current time on this thread. */
+void FlowStep(uint32_t flowId, int64_t time);
+
+/*
+ * Write all recorded events to file as JSON objects.
+ *
+ * The objects are separated by commas, but not enclosed in an array, so the output of multiple processes can be
+ * concatenated. `needSeparator` determines whether a comma is written before the first event and is updated accordingly.
+ */
+void WriteEvents(FILE *file, bool &needSeparator);
+
+/* Records a span from construction until destruction of this object. */
+class Span
+{
+public:
+    Span(char const *name, uint32_t callId = 0)
+        : name_(name), callId_(callId), start_(IsEnabled() ? Now() : 0)
+    {}
+
+    ~Span()
+    {
+        if (start_ != 0 && IsEnabled()) Complete(name_, start_, Now(), callId_);
+    }
+
+    Span(Span const&) = delete;
+    Span& operator=(Span const&) = delete;
+
+    /* Time when this span started or 0, if tracing was disabled at that point. */
+    int64_t Start() const { return start_; }
+
+private:
+    char const *name_;
+    uint32_t callId_;
+    int64_t start_;
+};
+
+} // end namespace
+
+#endif // DLL32TO64_TRACE_H
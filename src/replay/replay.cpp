@@ -0,0 +1,437 @@
+/**
+ * dll32to64-replay: Replays a capture recorded with Dll32To64_StartCapture() and reports throughput and latency.
+ *
+ * Usage: dll32to64-replay <capture file> [options]
+ *
+ *   --wrapper <path>  wrapper.exe to drive (default: wrapper.exe next to this executable)
+ *   --daemon <port>   Drive an already running wrapper daemon instead of starting wrapper.exe.
+ *   --stub            Answer requests with the captured responses instead of running wrapper.exe. This measures the
+ *                     transport alone.
+ *   --paced           Send requests at their original pace instead of as fast as possible.
+ *   --repeat <n>      Replay the capture n times.
+ *
+ * Requests are sent one after another, like bridge.dll does. Responses that differ from the captured ones are counted as
+ * divergent, which points to non-deterministic exports or a behavior change in the wrapper.
+ */
+
+#include "common/common.h"
+#include "common/capture.h"
+#include "common/trace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace {
+
+/* A captured request and its response. */
+struct Call
+{
+    char const *request;
+    int requestLength;
+    char const *response;
+    int responseLength;
+    int64_t timestamp;
+};
+
+struct Options
+{
+    char const *capturePath = nullptr;
+    std::string wrapperPath;
+    int daemonPort = 0;
+    bool stub = false;
+    bool paced = false;
+    unsigned repeat = 1;
+};
+
+std::atomic<uint64_t> callbacksReceived(0);
+
+uint32_t CallIdOf(char const *frame)
+{
+    uint32_t callId;
+    std::memcpy(&callId, &frame[3], sizeof(callId));
+    return callId;
+}
+
+bool ParseOptions(int argc, char **argv, Options &options)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        std::string const arg(argv[i]);
+        if (arg == "--stub") options.stub = true;
+        else if (arg == "--paced") options.paced = true;
+        else if (arg == "--wrapper" && i + 1 < argc) options.wrapperPath = argv[++i];
+        else if (arg == "--daemon" && i + 1 < argc) options.daemonPort = std::atoi(argv[++i]);
+        else if (arg == "--repeat" && i + 1 < argc) options.repeat = std::strtoul(argv[++i], nullptr, 10);
+        else if (options.capturePath == nullptr && arg.rfind("--", 0) != 0) options.capturePath = argv[i];
+        else return false;
+    }
+
+    if (options.wrapperPath.empty())
+    {
+        char path[4096];
+        GetModuleFileNameA(NULL, path, sizeof(path));
+        std::string const self(path);
+        options.wrapperPath = self.substr(0, self.find_last_of("\\/") + 1) + "wrapper.exe";
+    }
+
+    return options.capturePath != nullptr && options.repeat > 0;
+}
+
+/* Pair captured requests with their responses. Internal messages (tracing) are not replayed. */
+std::vector<Call> LoadCalls(capture::Reader &reader, uint64_t &capturedCallbacks)
+{
+    std::vector<Call> calls;
+    std::unordered_map<uint32_t, size_t> pending;
+
+    capture::RecordHeader const *record;
+    char const *frame;
+    while (reader.Next(record, frame))
+    {
+        if (record->length < msg::MSG_HEADER_SIZE) continue;
+
+        msg::MsgId const id = (msg::MsgId)frame[1];
+        if (id == msg::MSGID_ClockSync || id == msg::MSGID_TraceStart || id == msg::MSGID_Hello ||
+            id == msg::MSGID_Cancel || id == msg::MSGID_MemoryReport) continue;
+
+        switch (record->kind)
+        {
+            case capture::RECORD_Request:
+            {
+                pending[CallIdOf(frame)] = calls.size();
+                calls.push_back(Call{frame, (int)record->length, nullptr, 0, record->timestamp});
+            } break;
+            case capture::RECORD_Response:
+            {
+                auto const it = pending.find(CallIdOf(frame));
+                if (it == pending.end()) continue;
+                calls[it->second].response = frame;
+                calls[it->second].responseLength = record->length;
+                pending.erase(it);
+            } break;
+            case capture::RECORD_Callback:
+                capturedCallbacks++;
+                break;
+        }
+    }
+
+    // Calls without a response failed during capture and would block the replay
+    calls.erase(std::remove_if(calls.begin(), calls.end(), [](Call const &c) { return c.response == nullptr; }),
+                calls.end());
+    return calls;
+}
+
+/* Listen on a free port. */
+SOCKET Listen(int &port)
+{
+    SOCKET listener;
+    if (!sock::CreateSocket(listener)) return INVALID_SOCKET;
+
+    sockaddr_in hint;
+    hint.sin_family = AF_INET;
+    hint.sin_port = 0;
+    inet_pton(AF_INET, sock::ipAddress, &hint.sin_addr);
+
+    int hintSize = sizeof(hint);
+    if (bind(listener, (sockaddr*)&hint, sizeof(hint)) != 0 || listen(listener, 1) != 0 ||
+        getsockname(listener, (sockaddr*)&hint, &hintSize) != 0)
+    {
+        printf("Can't listen, Err: %d\n", WSAGetLastError());
+        closesocket(listener);
+        return INVALID_SOCKET;
+    }
+
+    port = ntohs(hint.sin_port);
+    return listener;
+}
+
+/* Start wrapper.exe and read the port it listens on from the pipe it reports it to. */
+HANDLE StartWrapper(std::string const &path, int &port)
+{
+    SECURITY_ATTRIBUTES inheritable = {sizeof(SECURITY_ATTRIBUTES), NULL, TRUE};
+    HANDLE readPipe;
+    HANDLE writePipe;
+    if (!CreatePipe(&readPipe, &writePipe, &inheritable, 0)) return INVALID_HANDLE_VALUE;
+    SetHandleInformation(readPipe, HANDLE_FLAG_INHERIT, 0);
+
+    std::string commandLine = "\"" + path + "\" --ready-pipe " + std::to_string((uintptr_t)writePipe);
+
+    STARTUPINFOA si = {};
+    si.cb = sizeof(si);
+    PROCESS_INFORMATION pi = {};
+    bool const started = CreateProcessA(path.c_str(), &commandLine[0], NULL, NULL, true, 0, NULL, NULL, &si, &pi);
+    CloseHandle(writePipe);
+    if (!started)
+    {
+        printf("Can't start %s, Err: %lu\n", path.c_str(), GetLastError());
+        CloseHandle(readPipe);
+        return INVALID_HANDLE_VALUE;
+    }
+    CloseHandle(pi.hThread);
+
+    char buf[16] = {};
+    DWORD bytesRead = 0;
+    bool const ready = ReadFile(readPipe, buf, sizeof(buf) - 1, &bytesRead, NULL) && bytesRead > 0;
+    CloseHandle(readPipe);
+    if (!ready)
+    {
+        printf("%s exited before accepting connections\n", path.c_str());
+        CloseHandle(pi.hProcess);
+        return INVALID_HANDLE_VALUE;
+    }
+
+    port = std::atoi(buf);
+    return pi.hProcess;
+}
+
+SOCKET Connect(int port)
+{
+    sockaddr_in hint;
+    hint.sin_family = AF_INET;
+    hint.sin_port = htons(port);
+    inet_pton(AF_INET, sock::ipAddress, &hint.sin_addr);
+
+    // The peer may still be starting up
+    for (int attempt = 0; attempt < 100; attempt++)
+    {
+        SOCKET s;
+        if (!sock::CreateSocket(s)) return INVALID_SOCKET;
+        if (connect(s, (sockaddr*)&hint, sizeof(hint)) == 0) return s;
+        closesocket(s);
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+
+    printf("Can't connect on port %d\n", port);
+    return INVALID_SOCKET;
+}
+
+/*
+ * Open a session (sessionId 0) or attach a callback connection to it. Returns the session id, 0 on error. Opening a
+ * session sets its token, which attaching requires.
+ */
+uint32_t Handshake(SOCKET socket, msg::Channel channel, uint32_t sessionId, uint64_t &token)
+{
+    msg::MessageData message = {};
+    msg::InitMessageData(message, msg::MSGID_Hello, msg::DIRECTION_Request);
+    message.staticData.Hello.sessionId = sessionId;
+    message.staticData.Hello.token = token;
+    message.staticData.Hello.clientPid = GetCurrentProcessId();
+    message.staticData.Hello.channel = channel;
+
+    char buf[msg::MSG_MAX_SIZE];
+    int size;
+    msg::SerializeMessage(message, buf, size);
+
+    msg::MessageData response = {};
+    if (!sock::Send(socket, buf, size) || !sock::ReceiveFrame(socket, buf, sizeof(buf), size) ||
+        !msg::ParseMessage(response, msg::DIRECTION_Response, buf, size) || response.id != msg::MSGID_Hello)
+    {
+        printf("Wrapper refused the connection\n");
+        return 0;
+    }
+
+    if (sessionId == 0) token = response.staticData.HelloResponse.token;
+    return response.staticData.HelloResponse.sessionId;
+}
+
+/* Answers every request with its captured response. */
+void StubTask(SOCKET listener, std::unordered_map<uint32_t, Call const*> const *responses)
+{
+    SOCKET const client = accept(listener, NULL, NULL);
+    closesocket(listener);
+    if (client == INVALID_SOCKET) return;
+
+    char incoming[msg::MSG_MAX_SIZE];
+    int recvBytes;
+    while (sock::ReceiveFrame(client, incoming, sizeof(incoming), recvBytes))
+    {
+        if ((msg::MsgId)incoming[1] == msg::MSGID_Hello)
+        {
+            msg::MessageData response = {};
+            msg::InitMessageData(response, msg::MSGID_Hello, msg::DIRECTION_Response);
+            response.staticData.HelloResponse.sessionId = 1;
+            response.staticData.HelloResponse.wrapperPid = GetCurrentProcessId();
+            int size;
+            msg::SerializeMessage(response, incoming, size);
+            if (!sock::Send(client, incoming, size)) break;
+            continue;
+        }
+
+        auto const it = responses->find(CallIdOf(incoming));
+        if (it == responses->end()) break;
+        if (!sock::Send(client, it->second->response, it->second->responseLength)) break;
+    }
+
+    closesocket(client);
+}
+
+void CallbackDrainTask(SOCKET callbackSocket)
+{
+    char incoming[msg::MSG_MAX_SIZE];
+    int recvBytes;
+    while (sock::ReceiveFrame(callbackSocket, incoming, sizeof(incoming), recvBytes))
+    {
+        callbacksReceived.fetch_add(1);
+    }
+}
+
+} // end anonymous namespace
+
+int main(int argc, char **argv)
+{
+    Options options;
+    if (!ParseOptions(argc, argv, options))
+    {
+        printf("Usage: %s <capture file> [--wrapper <path> | --daemon <port> | --stub] [--paced] [--repeat <n>]\n",
+               argv[0]);
+        return 1;
+    }
+
+    capture::Reader reader;
+    if (!reader.Open(options.capturePath))
+    {
+        printf("Can't open capture %s\n", options.capturePath);
+        return 1;
+    }
+
+    if (reader.Header().protocolVersion != msg::PROTOCOL_VERSION)
+    {
+        printf("Capture uses protocol version %u, but this tool speaks version %u\n",
+               reader.Header().protocolVersion, msg::PROTOCOL_VERSION);
+        return 1;
+    }
+
+    uint64_t capturedCallbacks = 0;
+    std::vector<Call> const calls = LoadCalls(reader, capturedCallbacks);
+    if (calls.empty())
+    {
+        printf("Capture contains no complete calls\n");
+        return 1;
+    }
+
+    std::string const target = options.stub ? "stub responder"
+                             : options.daemonPort != 0 ? "daemon on port " + std::to_string(options.daemonPort)
+                             : options.wrapperPath;
+    printf("Replaying %zu calls x %u against %s\n", calls.size(), options.repeat, target.c_str());
+
+    if (!sock::StartupWinSock()) return 2;
+
+    std::unordered_map<uint32_t, Call const*> responses;
+    std::thread stubThread;
+    std::thread callbackThread;
+    HANDLE wrapperProcess = INVALID_HANDLE_VALUE;
+    SOCKET callbackSocket = INVALID_SOCKET;
+    int port = options.daemonPort;
+
+    if (options.stub)
+    {
+        for (Call const &call : calls) responses[CallIdOf(call.request)] = &call;
+
+        SOCKET const listener = Listen(port);
+        if (listener == INVALID_SOCKET) return 2;
+        stubThread = std::thread(StubTask, listener, &responses);
+    }
+    else if (options.daemonPort == 0)
+    {
+        wrapperProcess = StartWrapper(options.wrapperPath, port);
+        if (wrapperProcess == INVALID_HANDLE_VALUE) return 2;
+    }
+
+    SOCKET const requestSocket = Connect(port);
+    if (requestSocket == INVALID_SOCKET) return 3;
+
+    uint64_t token = 0;
+    uint32_t const sessionId = Handshake(requestSocket, msg::CHANNEL_Request, 0, token);
+    if (sessionId == 0) return 3;
+
+    if (!options.stub)
+    {
+        callbackSocket = Connect(port);
+        if (callbackSocket == INVALID_SOCKET ||
+            Handshake(callbackSocket, msg::CHANNEL_Callback, sessionId, token) == 0) return 3;
+        callbackThread = std::thread(CallbackDrainTask, callbackSocket);
+    }
+
+    std::vector<int64_t> latencies;
+    latencies.reserve(calls.size() * options.repeat);
+    uint64_t errors = 0;
+    uint64_t divergent = 0;
+
+    int64_t const captureStart = calls.front().timestamp;
+    int64_t const captureDuration = calls.back().timestamp - captureStart;
+    int64_t const replayStart = trace::Now();
+
+    char responseBuffer[msg::MSG_MAX_SIZE];
+    for (unsigned r = 0; r < options.repeat && errors == 0; r++)
+    {
+        for (Call const &call : calls)
+        {
+            if (options.paced)
+            {
+                int64_t const due = replayStart + r * (captureDuration + 1) + (call.timestamp - captureStart);
+                int64_t const wait = due - trace::Now();
+                if (wait > 0) std::this_thread::sleep_for(std::chrono::microseconds(wait));
+            }
+
+            int64_t const sent = trace::Now();
+            int recvBytes;
+            if (!sock::Send(requestSocket, call.request, call.requestLength) ||
+                !sock::ReceiveFrame(requestSocket, responseBuffer, sizeof(responseBuffer), recvBytes))
+            {
+                errors++;
+                break;
+            }
+            latencies.push_back(trace::Now() - sent);
+
+            if (recvBytes != call.responseLength || std::memcmp(responseBuffer, call.response, recvBytes) != 0)
+            {
+                divergent++;
+            }
+        }
+    }
+
+    int64_t const elapsed = trace::Now() - replayStart;
+
+    // Closing the request connection ends the session, which shuts down the stub and a wrapper started by us
+    closesocket(requestSocket);
+    if (stubThread.joinable()) stubThread.join();
+    if (wrapperProcess != INVALID_HANDLE_VALUE)
+    {
+        WaitForSingleObject(wrapperProcess, INFINITE);
+        CloseHandle(wrapperProcess);
+    }
+    if (callbackThread.joinable()) callbackThread.join();
+    if (callbackSocket != INVALID_SOCKET) closesocket(callbackSocket);
+    WSACleanup();
+
+    if (latencies.empty())
+    {
+        printf("No call completed\n");
+        return 4;
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&latencies](unsigned permille)
+    {
+        return latencies[std::min(latencies.size() - 1, (latencies.size() * permille) / 1000)];
+    };
+
+    printf("Calls:      %zu (%llu errors, %llu divergent responses)\n", latencies.size(),
+           (unsigned long long)errors, (unsigned long long)divergent);
+    printf("Callbacks:  %llu (captured %llu per run)\n",
+           (unsigned long long)callbacksReceived.load(), (unsigned long long)capturedCallbacks);
+    printf("Elapsed:    %.3f s\n", elapsed / 1e6);
+    printf("Throughput: %.1f calls/s\n", elapsed > 0 ? latencies.size() * 1e6 / elapsed : 0.0);
+    printf("Latency:    p50 %lld us, p90 %lld us, p99 %lld us, max %lld us\n",
+           (long long)percentile(500), (long long)percentile(900), (long long)percentile(990),
+           (long long)latencies.back());
+
+    return errors == 0 ? 0 : 4;
+}
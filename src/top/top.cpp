@@ -0,0 +1,130 @@
+/**
+ * dll32to64-top: Displays the live metrics that bridge.dll and wrapper.exe publish into shared memory (see metrics.h).
+ *
+ * Usage: dll32to64-top <pid of client application> [refresh interval in ms]
+ *
+ * The segments are only mapped read-only, so this can safely be attached to production processes.
+ */
+
+#include "common/metrics.h"
+
+#include <windows.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+
+namespace {
+
+/* A segment is considered stale if it has not been updated for this many refreshes. */
+unsigned const STALE_REFRESHES = 4;
+
+struct View
+{
+    metrics::SegmentReader reader;
+    uint32_t pid = 0;
+    uint64_t lastUpdates = 0;
+    unsigned unchanged = 0;
+};
+
+void PrintSegment(View &view)
+{
+    metrics::Segment segment;
+    if (view.pid == 0 || !view.reader.Read(segment))
+    {
+        printf("  (no metrics available)\n\n");
+        return;
+    }
+
+    view.unchanged = (segment.updates == view.lastUpdates) ? view.unchanged + 1 : 0;
+    view.lastUpdates = segment.updates;
+
+    printf("%s (pid %u)%s\n", segment.role, segment.pid, view.unchanged >= STALE_REFRESHES ? " STALE" : "");
+    printf("  calls %llu (%llu/s)  errors %llu  in-flight %llu  callbacks %llu (queued %llu)  reconnects %llu  "
+           "recycles %llu\n",
+           (unsigned long long)segment.calls, (unsigned long long)segment.callsPerSecond,
+           (unsigned long long)segment.errors, (unsigned long long)segment.inFlight,
+           (unsigned long long)segment.callbacks, (unsigned long long)segment.callbackQueueDepth,
+           (unsigned long long)segment.reconnects, (unsigned long long)segment.recycles);
+    printf("  memory: working set %llu MB  private %llu MB  address space %llu / %llu MB\n",
+           (unsigned long long)(segment.workingSet >> 20), (unsigned long long)(segment.privateBytes >> 20),
+           (unsigned long long)(segment.addressSpaceUsed >> 20), (unsigned long long)(segment.addressSpaceTotal >> 20));
+    printf("  load: queued %llu  rejected %llu", (unsigned long long)segment.queued,
+           (unsigned long long)segment.rejected);
+    if (segment.creditLimit != 0)
+    {
+        printf("  credits %llu / %llu", (unsigned long long)segment.credits, (unsigned long long)segment.creditLimit);
+    }
+    printf("\n\n");
+
+    printf("  %-23s %12s %8s %8s %8s %10s %10s %10s %10s\n", "EXPORT", "CALLS", "ERRORS", "QUEUED", "REJECTED",
+           "P50[us]", "P90[us]", "P99[us]", "MAX[us]");
+    for (unsigned i = 0; i < segment.numExports && i < metrics::MAX_EXPORTS; i++)
+    {
+        metrics::ExportStats const &stats = segment.exports[i];
+        if (stats.calls == 0 && stats.queued == 0) continue;
+
+        printf("  %-23.23s %12llu %8llu %8llu %8llu %10u %10u %10u %10u\n", stats.name, (unsigned long long)stats.calls,
+               (unsigned long long)stats.errors, (unsigned long long)stats.queued, (unsigned long long)stats.rejected,
+               stats.p50Us, stats.p90Us, stats.p99Us, stats.maxUs);
+    }
+    printf("\n");
+
+    printf("  %-23s %12s %8s %10s %10s %10s %10s\n", "LANE", "CALLS", "ERRORS", "P50[us]", "P90[us]", "P99[us]", "MAX[us]");
+    for (unsigned i = 0; i < segment.numLanes && i < metrics::MAX_LANES; i++)
+    {
+        metrics::ExportStats const &stats = segment.lanes[i];
+        printf("  %-23.23s %12llu %8llu %10u %10u %10u %10u\n", stats.name, (unsigned long long)stats.calls,
+               (unsigned long long)stats.errors, stats.p50Us, stats.p90Us, stats.p99Us, stats.maxUs);
+    }
+    printf("\n");
+}
+
+} // end anonymous namespace
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        printf("Usage: %s <pid of client application> [refresh interval in ms]\n", argv[0]);
+        return 1;
+    }
+
+    View bridge;
+    bridge.pid = std::strtoul(argv[1], nullptr, 10);
+    unsigned const intervalMs = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : metrics::PUBLISH_INTERVAL_MS;
+
+    if (!bridge.reader.Open(bridge.pid))
+    {
+        printf("No dll32to64 metrics found for pid %u\n", bridge.pid);
+        return 2;
+    }
+
+    // Allow clearing the screen with escape sequences in the Windows console
+    HANDLE const console = GetStdHandle(STD_OUTPUT_HANDLE);
+    DWORD mode;
+    if (GetConsoleMode(console, &mode)) SetConsoleMode(console, mode | ENABLE_VIRTUAL_TERMINAL_PROCESSING);
+
+    View wrapper;
+    while (true)
+    {
+        // Follow the wrapper if the bridge restarted it
+        metrics::Segment segment;
+        if (bridge.reader.Read(segment) && segment.peerPid != wrapper.pid)
+        {
+            wrapper.pid = segment.peerPid;
+            wrapper.unchanged = 0;
+            if (!wrapper.reader.Open(wrapper.pid)) wrapper.pid = 0;
+        }
+
+        printf("\x1b[H\x1b[J");
+        PrintSegment(bridge);
+        PrintSegment(wrapper);
+        fflush(stdout);
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(intervalMs));
+    }
+
+    return 0;
+}
@@ -1,212 +1,1423 @@
 /**
- * Upon startup, this program runs a listener socket and waits to receive messages of the format defined
- * in msg_protocol.h.
- * When a message is received, its contents are parsed and the corresponding function of the wrapped DLL is executed. The
- * calls response is then returned via the socket.
+ * Upon startup, this program runs a listener socket and waits for clients (bridge.dll) to connect. Each client opens a
+ * session consisting of a request and a callback connection, see msg::StaticData::Hello.
+ *
+ * All connections are served by an event loop on a separate thread (see sock::Reactor), which parses incoming requests
+ * and queues them. The main thread executes them one at a time, so the wrapped DLL is only ever called from a single
+ * thread, while the loop keeps receiving. Sessions with pending requests take turns, so a busy client can't starve the
+ * others. The call's response is then returned via the session's request connection.
+ *
+ * Each session queues its requests per lane (see msg::Lane). Control requests are executed before bulk requests and
+ * their responses overtake queued bulk responses, so small calls don't wait for large transfers.
+ *
+ * Objects the DLL returns by pointer (see msg::Handle) stay in the wrapper. Clients get a handle for them, which is
+ * looked up in a handle table when they pass it back. Objects a session still holds when it ends are freed.
+ *
+ * A wrapper can host several libraries, so clients that bridge several of them only need one wrapper process. Each
+ * session calls into the library it named in its Hello. A library is loaded with LoadLibrary() on its first call, and
+ * its exports are resolved into a flat table indexed by library and MsgId.
+ *
+ * While calls are executed, the wrapper reports its memory usage to all sessions (see msg::StaticData::MemoryReport), so
+ * clients can replace a wrapper whose DLL leaks before it runs out of address space.
+ *
+ * Map requests (e.g. InvertMap) call a scalar export for every element of an array in a tight loop. For exports
+ * declared thread-safe (see --thread-safe), the elements are split across the main thread and --map-threads - 1 helper
+ * threads. These are the only calls of a wrapped DLL that don't come from the main thread.
+ *
+ * Each session may only have a number of requests outstanding (see --credits), so a client that sends faster than the
+ * wrapper executes keeps its surplus calls queued on its side, where it can limit and reject them. The wrapper stops
+ * reading the requests of a session that has all of them outstanding.
+ *
+ * Command line:
+ *   --daemon          Keep running and accept new clients when sessions end. Without it, the wrapper serves a single
+ *                     session and exits when it ends.
+ *   --port <n>        Port to listen on. Defaults to sock::daemonPort in daemon mode and to a free port otherwise.
+ *   --unix <path>     Listen on an AF_UNIX socket file at path instead of a TCP port. The file is removed on exit.
+ *   --ready-pipe <h>  Inherited pipe handle the listening port (0 with --unix) is written to as soon as clients can
+ *                     connect.
+ *   --placement <s>   Pin the event loop and the thread executing calls to CPUs, see placement.h. Defaults to the
+ *                     environment variable DLL32TO64_PLACEMENT.
+ *   --library <path>  Host the DLL at path. Can be given up to MAX_LIBRARIES times, the first one serves clients that
+ *                     don't name a library. Defaults to WRAPPED_DLL.
+ *   --credits <n>     Requests each session may have outstanding, see msg::StaticData::Hello. 0 for no limit. Defaults
+ *                     to DEFAULT_CREDITS.
+ *   --map-threads <n> Threads that execute the elements of map requests, including the main thread. Defaults to the
+ *                     environment variable DLL32TO64_MAP_THREADS or 1.
+ *   --thread-safe <e> Comma-separated exports that may be called from several threads at once, so map requests of them
+ *                     are split across the map threads. Defaults to the environment variable DLL32TO64_THREAD_SAFE.
  */
 
+// Declares rand_s()
+#define _CRT_RAND_S
+
 #include "common/common.h"
+#include "common/metrics.h"
+#include "common/placement.h"
+#include "common/reactor.h"
+#include "common/trace.h"
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <condition_variable>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <cassert>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
 #include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 // TODO: AUTOGEN
 #include "test_lib.h"
 
+// Library hosted unless --library is given, set by build.py
+#ifndef WRAPPED_DLL
+#define WRAPPED_DLL "test_lib.dll"
+#endif
+
 namespace {
 
-// Socket to maintain request-response connection
-SOCKET requestSocket = INVALID_SOCKET;
-// Socket to maintain callback connection
-SOCKET callbackSocket = INVALID_SOCKET;
+typedef sock::Reactor::ConnectionId ConnectionId;
+
+/* Dispatches the events of the reactor to the sessions. */
+class ConnectionHandler : public sock::Reactor::Handler
+{
+public:
+    void OnFrame(ConnectionId connection, char const *frame, int length) override;
+    void OnClose(ConnectionId connection) override;
+};
+
+ConnectionHandler handler;
+sock::Reactor reactor(handler);
+
+/* Maximum number of libraries a wrapper can host. */
+unsigned const MAX_LIBRARIES = 8;
+/* Number of functions of a library. They come first among the MsgIds. */
+// TODO: AUTOGEN
+unsigned const EXPORTS_PER_LIBRARY = msg::MSGID_Callback;
+
+/* A library hosted by the wrapper. */
+struct Library
+{
+    std::string path;
+    // File name without extension, by which clients name the library in their Hello
+    std::string name;
+    // Set once the library was loaded by its first call
+    HMODULE module = NULL;
+    bool failed = false;
+};
+
+// Hosted libraries, see --library. Not modified once clients can connect.
+std::vector<Library> libraries;
+
+// Any exported function, which is cast to its actual type before it is called
+typedef void (*AnyFunction)();
+// Exports of all loaded libraries. The function for MsgId `id` of library `l` is at l * EXPORTS_PER_LIBRARY + id, nullptr
+// if the library doesn't export it. Only accessed by the main thread.
+AnyFunction exportTable[MAX_LIBRARIES * EXPORTS_PER_LIBRARY] = {};
+
+/* Connections and pending requests of a single client. */
+struct Session
+{
+    Session(uint32_t id, uint64_t token, uint32_t clientPid, ConnectionId requestConnection, unsigned library)
+        : id(id), token(token), clientPid(clientPid), requestConnection(requestConnection), library(library)
+    {}
+
+    ~Session()
+    {
+        // Closing the callback connection tells the client that the session is over
+        ConnectionId const callbacks = callbackConnection.load();
+        if (callbacks != 0) reactor.Close(callbacks);
+    }
+
+    uint32_t const id;
+    // Required on the callback connection, see msg::StaticData::Hello
+    uint64_t const token;
+    uint32_t const clientPid;
+    ConnectionId const requestConnection;
+    // Index of the library in libraries that all calls of the session go to
+    unsigned const library;
+    // 0 until the client connected it
+    std::atomic<ConnectionId> callbackConnection{0};
+
+    // Requests that were received, but not executed yet, per lane. Guarded by sessionMutex.
+    std::deque<msg::MessageData> pending[msg::LANE_COUNT];
+    // Requests that were received and aren't done yet, see --credits. Guarded by sessionMutex.
+    uint32_t outstanding = 0;
+    // Requests whose execution has started, see msg::StaticData::CallbackResponse
+    std::atomic<uint32_t> requestsStarted{0};
+};
+
+// Control requests that are executed in a row while bulk requests wait, so these still make progress
+unsigned const CONTROL_BURST = 16;
+// Elements each map thread executes at least, so short map requests aren't split at a loss
+int const MAP_SLICE_MIN = 256;
+// Requests a session may have outstanding unless --credits is given
+uint32_t const DEFAULT_CREDITS = 64;
+// Minimum time between two memory reports in microseconds
+int64_t const MEMORY_REPORT_INTERVAL_US = 500000;
+
+// Where clients connect, see --port and --unix
+sock::Address listenAddress;
+// True if running as shared daemon, see --daemon
+bool daemonMode = false;
+// Requests each session may have outstanding, see --credits
+uint32_t sessionCredits = DEFAULT_CREDITS;
+// Exports that may be called from several threads at once, see --thread-safe
+bool threadSafe[EXPORTS_PER_LIBRARY] = {};
 
 /*
- * Mutex for locking the callback Socket.
+ * Helper threads that execute slices of map requests together with the main thread, see --map-threads. A map request
+ * is split into at most one slice per thread, each at least MAP_SLICE_MIN elements.
+ */
+class MapThreads
+{
+public:
+    /* Start the helpers, one less than `threads`, as the main thread takes part. */
+    void Start(unsigned threads)
+    {
+        for (unsigned i = 1; i < threads; i++)
+        {
+            helpers_.emplace_back(&MapThreads::Help, this);
+        }
+    }
+
+    void Stop()
+    {
+        {
+            std::lock_guard<std::mutex> guard(mutex_);
+            stop_ = true;
+        }
+        changed_.notify_all();
+        for (std::thread &helper : helpers_) helper.join();
+        helpers_.clear();
+    }
+
+    /* Call body(begin, end) for slices that cover [0, count), on all threads. Returns once all slices are done. */
+    void Run(int count, std::function<void(int, int)> const &body)
+    {
+        int const slices = std::min((int)helpers_.size() + 1, count / MAP_SLICE_MIN);
+        if (slices <= 1)
+        {
+            body(0, count);
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> guard(mutex_);
+            body_ = &body;
+            count_ = count;
+            slices_ = slices;
+            nextSlice_ = 0;
+            pending_ = slices;
+            generation_++;
+        }
+        changed_.notify_all();
+
+        RunSlices();
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        done_.wait(lock, [this] { return pending_ == 0; });
+        body_ = nullptr;
+    }
+
+private:
+    /* Execute slices of the current request until all are taken. */
+    void RunSlices()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (nextSlice_ < slices_)
+        {
+            int const slice = nextSlice_++;
+            std::function<void(int, int)> const &body = *body_;
+            int const begin = (int)((int64_t)count_ * slice / slices_);
+            int const end = (int)((int64_t)count_ * (slice + 1) / slices_);
+
+            lock.unlock();
+            body(begin, end);
+            lock.lock();
+
+            if (--pending_ == 0) done_.notify_all();
+        }
+    }
+
+    void Help()
+    {
+        uint64_t seen = 0;
+        while (true)
+        {
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                changed_.wait(lock, [this, seen] { return stop_ || generation_ != seen; });
+                if (stop_) return;
+                seen = generation_;
+            }
+            RunSlices();
+        }
+    }
+
+    std::vector<std::thread> helpers_;
+    // Guards the following
+    std::mutex mutex_;
+    std::condition_variable changed_;
+    std::condition_variable done_;
+    bool stop_ = false;
+    // Incremented for every request that is split
+    uint64_t generation_ = 0;
+    std::function<void(int, int)> const *body_ = nullptr;
+    int count_ = 0;
+    int slices_ = 0;
+    int nextSlice_ = 0;
+    // Slices that aren't done yet
+    int pending_ = 0;
+};
+
+MapThreads mapThreads;
+
+// Guards sessions, nextSessionId, sessionsOpened and Session::pending
+std::mutex sessionMutex;
+// Notified when a request is queued or a session ends
+std::condition_variable sessionChanged;
+// Open sessions by id. Ordered, so the scheduler can serve them round-robin.
+std::map<uint32_t, std::shared_ptr<Session>> sessions;
+uint32_t nextSessionId = 1;
+unsigned sessionsOpened = 0;
+
+// Sessions by their connections. Only accessed by the event loop.
+std::unordered_map<ConnectionId, std::shared_ptr<Session>> requestConnections;
+std::unordered_map<ConnectionId, std::weak_ptr<Session>> callbackConnections;
+
+// Guards executingSession and callbackSessions, which are read by callbacks from threads inside the wrapped DLLs
+std::mutex callbackTargetMutex;
+// Session whose request is currently executed by a wrapped DLL
+std::shared_ptr<Session> executingSession;
+// Session that registered the callback of each library most recently
+// TODO: AUTOGEN (one per callback registration export)
+std::weak_ptr<Session> callbackSessions[MAX_LIBRARIES];
+
+// CallId of the request that is currently executed by the wrapped DLL, 0 if none
+std::atomic<uint32_t> currentCallId(0);
+
+/* Kinds of objects of the wrapped DLL that clients refer to by handle. */
+// TODO: AUTOGEN
+enum HandleType
+{
+    HANDLE_Buffer,
+};
+
+/* Object of the wrapped DLL held by a session. */
+struct HandleEntry
+{
+    void *object;
+    HandleType type;
+    uint32_t sessionId;
+    // Library that created the object
+    unsigned library;
+};
+
+// Objects of the wrapped DLL by handle. Only accessed by the main thread, which is the only one calling the DLL.
+std::unordered_map<msg::Handle, HandleEntry> handles;
+msg::Handle nextHandle = 1;
+
+// Sessions that ended, but whose objects haven't been freed yet. Guarded by sessionMutex.
+std::vector<uint32_t> endedSessions;
+
+// File the trace events are written to, empty if tracing is disabled
+char traceFile[msg::MSG_MAX_SIZE] = "";
+// Session that started tracing. In daemon mode, its events are written when it ends.
+uint32_t tracingSessionId = 0;
+
+/*
+ * Session a callback of a library is delivered to.
  *
- * We don't know multiple callbacks may be executed simultaneously by different threads inside the wrapped DLL,
- * so to be safe we lock access to the resources shared by all callbacks (message buffer + socket).
+ * Callbacks triggered while a request of the library is executed belong to the session that sent the request. All others
+ * go to the session that registered the callback.
  */
-std::mutex callbackMutex;
+std::shared_ptr<Session> CallbackTarget(unsigned library)
+{
+    std::lock_guard<std::mutex> guard(callbackTargetMutex);
+    if (executingSession && executingSession->library == library) return executingSession;
+    return callbackSessions[library].lock();
+}
 
-void SerializeAndSendCallbackResponse(msg::MessageData const &message)
+/* Function of a loaded library for a MsgId. */
+template <typename Function>
+Function Export(unsigned library, msg::MsgId id)
 {
-    static char buf[msg::MSG_MAX_SIZE];
-    int messageSize;
+    return (Function)exportTable[library * EXPORTS_PER_LIBRARY + id];
+}
+
+/* Export a message calls: itself, the scalar export of a map request, or EXPORTS_PER_LIBRARY for internal messages. */
+// TODO: AUTOGEN
+unsigned ExportOf(msg::MsgId id)
+{
+    if (id == msg::MSGID_InvertMap) return msg::MSGID_Invert;
+    return (unsigned)id < EXPORTS_PER_LIBRARY ? (unsigned)id : EXPORTS_PER_LIBRARY;
+}
 
-    DBG_LOG("WRAPPER: Send Callback %d\n", message.id);
-    std::lock_guard<std::mutex> guard(callbackMutex);
+/* Call body(begin, end) for all elements of a map request of an export, split across the map threads if it may be. */
+void MapElements(msg::MsgId id, int count, std::function<void(int, int)> const &body)
+{
+    if (threadSafe[id])
+    {
+        mapThreads.Run(count, body);
+    }
+    else
+    {
+        body(0, count);
+    }
+}
+
+/* Parse a comma-separated list of exports into threadSafe. */
+bool ParseThreadSafe(char const *list)
+{
+    std::string const exports(list);
+    size_t start = 0;
+    while (start <= exports.size())
+    {
+        size_t end = exports.find(',', start);
+        if (end == std::string::npos) end = exports.size();
+        std::string const name = exports.substr(start, end - start);
+        start = end + 1;
+        if (name.empty()) continue;
+
+        unsigned id = 0;
+        while (id < EXPORTS_PER_LIBRARY && name != msg::MsgIdName((msg::MsgId)id)) id++;
+        if (id == EXPORTS_PER_LIBRARY)
+        {
+            printf("WRAPPER: Unknown export %s in --thread-safe\n", name.c_str());
+            return false;
+        }
+        threadSafe[id] = true;
+    }
+    return true;
+}
+
+void SerializeAndSendCallbackResponse(Session &session, msg::MessageData const &message)
+{
+    ConnectionId const connection = session.callbackConnection.load();
+    if (connection == 0)
+    {
+        return;
+    }
+
+    char buf[msg::MSG_MAX_SIZE];
+    int messageSize;
     msg::SerializeMessage(message, buf, messageSize);
-    sock::Send(callbackSocket, buf, messageSize);
+
+    // Callbacks may be executed simultaneously by different threads inside the wrapped DLL. The reactor queues each
+    // message as a whole, so they don't interleave.
+    DBG_LOG("WRAPPER: Send Callback %d to session %u\n", message.id, session.id);
+    // Delivered once the reactor sent it, see CallbackSent()
+    metrics::CallbackQueued();
+    if (!reactor.Send(connection, buf, messageSize)) metrics::CallbackDropped();
 }
 
-// See TCallback, will be called by a separate thread from inside the wrapped DLL
-void Callback(int val)
+/* Count a callback that left the wrapper or was dropped, after it waited for its connection. */
+void CallbackSent(char const *frame, bool sent)
 {
-    if (callbackSocket == INVALID_SOCKET)
+    if (msg::FrameId(frame) != msg::MSGID_Callback) return;
+
+    if (sent)
+    {
+        metrics::CallbackDelivered();
+    }
+    else
+    {
+        metrics::CallbackDropped();
+    }
+}
+
+/* Deliver a callback of a library, which will be called by a separate thread from inside the wrapped DLL. */
+void DeliverCallback(unsigned library, int val)
+{
+    std::shared_ptr<Session> const session = CallbackTarget(library);
+    if (!session)
     {
         return;
     }
 
+    // Link the callback to the call that triggered it
+    uint32_t const callId = currentCallId.load();
+    trace::Span span("Callback", callId);
+    trace::FlowStep(callId, span.Start());
+
     msg::MessageData message;
     msg::InitMessageData(message, msg::MSGID_Callback, msg::DIRECTION_Response);
+    message.callId = callId;
     message.staticData.CallbackResponse.val = val;
+    message.staticData.CallbackResponse.requests = session->requestsStarted.load();
 
-    SerializeAndSendCallbackResponse(message);
+    SerializeAndSendCallbackResponse(*session, message);
+}
+
+// See TCallback. The DLL doesn't pass anything to tell libraries apart, so each one gets its own function.
+// TODO: AUTOGEN (one per callback type)
+template <size_t Library>
+void Callback(int val)
+{
+    DeliverCallback(Library, val);
 }
 
-/* Listen on the specified port for an incoming connection from Bridge. */
-SOCKET WaitForClient(int port)
+template <size_t... Libraries>
+std::array<TCallback, MAX_LIBRARIES> MakeCallbacks(std::index_sequence<Libraries...>)
 {
-    SOCKET listener;
-    if (!sock::CreateSocket(listener))
+    return {{&Callback<Libraries>...}};
+}
+
+std::array<TCallback, MAX_LIBRARIES> const libraryCallbacks = MakeCallbacks(std::make_index_sequence<MAX_LIBRARIES>());
+
+/* Host the DLL at path, unless MAX_LIBRARIES are hosted already. */
+bool AddLibrary(char const *path)
+{
+    if (libraries.size() == MAX_LIBRARIES)
     {
-        return INVALID_SOCKET;
+        printf("WRAPPER: Can't host more than %u libraries\n", MAX_LIBRARIES);
+        return false;
     }
 
-    // Bind socket to given port on loopback address
-    sockaddr_in addressHint;
-    addressHint.sin_family = AF_INET;
-    addressHint.sin_port = htons(port);
-    inet_pton(AF_INET, sock::ipAddress, &addressHint.sin_addr);
+    Library library;
+    library.path = path;
+    library.name = library.path.substr(library.path.find_last_of("\\/") + 1);
+    library.name = library.name.substr(0, library.name.find_last_of('.'));
+    libraries.push_back(library);
+    return true;
+}
 
-    int const bindResult = bind(listener, (sockaddr*)&addressHint, sizeof(addressHint));
-    if (bindResult != 0)
+/* Index of the library a Hello names, -1 if it isn't hosted. */
+int FindLibrary(msg::MessageData const &hello)
+{
+    msg::VariableArray const name = hello.staticData.Hello.library;
+    if (name.byte_length == 0)
     {
-        printf("WRAPPER: bind() Error: %d\n", bindResult);
-        closesocket(listener);
-        return INVALID_SOCKET;
+        return 0;
     }
+    if (name.byte_offset < 0 || name.byte_length < 0 ||
+        name.byte_offset + name.byte_length > (int)hello.variableDataLength)
+    {
+        return -1;
+    }
+
+    std::string const requested(&hello.variableData[name.byte_offset], name.byte_length);
+    for (size_t i = 0; i < libraries.size(); i++)
+    {
+        if (_stricmp(libraries[i].name.c_str(), requested.c_str()) == 0) return i;
+    }
+    return -1;
+}
+
+/* Load a library and resolve its exports, unless that happened before. Returns false if it can't be loaded. */
+bool LoadExports(unsigned index)
+{
+    Library &library = libraries[index];
+    if (library.module != NULL) return true;
+    if (library.failed) return false;
 
-    // Only accept a single connection
-    listen(listener, 1);
-    DBG_LOG("WRAPPER: Listening for client on port %d...\n", port);
+    trace::Span span("LoadLibrary");
+    library.module = LoadLibraryA(library.path.c_str());
+    if (library.module == NULL)
+    {
+        printf("WRAPPER: Can't load %s, Err: %lu\n", library.path.c_str(), GetLastError());
+        library.failed = true;
+        return false;
+    }
 
-    sockaddr_in client;
-    int clientSize = sizeof(client);
-    SOCKET clientSocket = accept(listener, (sockaddr*)&client, &clientSize);
-    if (clientSocket == INVALID_SOCKET)
+    for (unsigned id = 0; id < EXPORTS_PER_LIBRARY; id++)
     {
-        int const lastError = WSAGetLastError();
-        printf("WRAPPER: accept() Error: %d\n", lastError);
-        closesocket(listener);
-        return INVALID_SOCKET;
+        char const *const name = msg::MsgIdName((msg::MsgId)id);
+        AnyFunction const function = (AnyFunction)GetProcAddress(library.module, name);
+        if (function == nullptr)
+        {
+            printf("WRAPPER: %s doesn't export %s\n", library.name.c_str(), name);
+        }
+        exportTable[index * EXPORTS_PER_LIBRARY + id] = function;
     }
 
-    DBG_LOG("WRAPPER: Client on port %d accepted. Waiting for messages...\n", port);
+    printf("WRAPPER: Loaded %s\n", library.path.c_str());
+    return true;
+}
 
-    // Listening socket can be closed after connection has been established
-    closesocket(listener);
+/* Tell the process that started us which port to connect to. */
+void ReportPort(char const *pipeArg, int port)
+{
+    HANDLE const pipe = (HANDLE)(uintptr_t)std::strtoull(pipeArg, nullptr, 10);
 
-    return clientSocket;
+    char buf[16];
+    int const length = snprintf(buf, sizeof(buf), "%d", port);
+    DWORD written;
+    if (!WriteFile(pipe, buf, length, &written, NULL))
+    {
+        printf("WRAPPER: Can't report port, Err: %lu\n", GetLastError());
+    }
+    CloseHandle(pipe);
 }
 
-int Shutdown(int exitArg)
+void SendHelloResponse(ConnectionId connection, uint32_t sessionId, uint64_t token)
 {
-    if (callbackSocket != INVALID_SOCKET) closesocket(callbackSocket);
-    if (requestSocket != INVALID_SOCKET) closesocket(requestSocket);
-    WSACleanup();
-    return exitArg;
+    msg::MessageData response = {};
+    msg::InitMessageData(response, msg::MSGID_Hello, msg::DIRECTION_Response);
+    response.staticData.HelloResponse.sessionId = sessionId;
+    response.staticData.HelloResponse.token = token;
+    response.staticData.HelloResponse.wrapperPid = GetCurrentProcessId();
+    response.staticData.HelloResponse.credits = sessionCredits;
+
+    char buf[msg::MSG_MAX_SIZE];
+    int responseSize;
+    msg::SerializeMessage(response, buf, responseSize);
+    reactor.Send(connection, buf, responseSize);
 }
 
-} // end anonymous namespace
+/* Append all recorded trace events to traceFile, where they are picked up by the bridge. */
+void WriteTraceEvents()
+{
+    FILE *file = fopen(traceFile, "ab");
+    if (file == nullptr)
+    {
+        printf("WRAPPER: Can't open trace file %s\n", traceFile);
+        return;
+    }
 
-// Main entry point
-int main()
+    // The bridge appends our events to its own ones
+    bool needSeparator = true;
+    trace::WriteEvents(file, needSeparator);
+    fclose(file);
+}
+
+/* Random token of a new session, see msg::StaticData::Hello. Returns false if no random numbers are available. */
+bool NewSessionToken(uint64_t &token)
 {
-    if (!sock::StartupWinSock())
+    unsigned int high, low;
+    if (rand_s(&high) != 0 || rand_s(&low) != 0)
     {
-        return 1;
+        return false;
     }
+    token = (uint64_t)high << 32 | low;
+    return true;
+}
+
+std::shared_ptr<Session> OpenSession(ConnectionId requestConnection, uint64_t token, uint32_t clientPid,
+                                     unsigned library)
+{
+    std::lock_guard<std::mutex> guard(sessionMutex);
 
-    // Wait for connection from Bridge DLL that will send requests and receive responses
-    requestSocket = WaitForClient(sock::requestPort);
-    if (requestSocket == INVALID_SOCKET)
+    // Without --daemon, the wrapper belongs to the client that started it
+    if (!daemonMode && sessionsOpened > 0)
     {
-        printf("WRAPPER: Could not connect to Message Client\n");
-        return Shutdown(2);
+        return nullptr;
+    }
+
+    auto const session = std::make_shared<Session>(nextSessionId++, token, clientPid, requestConnection, library);
+    sessions[session->id] = session;
+    sessionsOpened++;
+    return session;
+}
+
+void CloseSession(Session const &session)
+{
+    printf("WRAPPER: Session %u ended because other end hung up.\n", session.id);
+
+    if (daemonMode && session.id == tracingSessionId && trace::IsEnabled())
+    {
+        // The bridge merges our events once the session is over
+        WriteTraceEvents();
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(sessionMutex);
+        sessions.erase(session.id);
+        for (std::deque<msg::MessageData> const &pending : session.pending)
+        {
+            for (msg::MessageData const &message : pending) metrics::Dequeued(message.id);
+        }
+        // Its objects are freed by the main thread, see ServeRequests()
+        endedSessions.push_back(session.id);
     }
+    sessionChanged.notify_all();
+}
 
-    // Wait for connection from Bridge DLL that will receive callbacks
-    callbackSocket = WaitForClient(sock::callbackPort);
-    if (callbackSocket == INVALID_SOCKET)
+/* Handle the Hello message that identifies a new connection. */
+void AcceptConnection(ConnectionId connection, msg::MessageData const &hello)
+{
+    switch (hello.staticData.Hello.channel)
     {
-        printf("WRAPPER: Could not connect to Callback Client\n");
-        return Shutdown(3);
+        case msg::CHANNEL_Request:
+        {
+            int const library = FindLibrary(hello);
+            if (library < 0)
+            {
+                printf("WRAPPER: Refusing session of client %u for a library that isn't hosted\n",
+                       hello.staticData.Hello.clientPid);
+                reactor.Close(connection);
+                return;
+            }
+
+            uint64_t token;
+            if (!NewSessionToken(token))
+            {
+                printf("WRAPPER: Refusing session of client %u, can't create its token\n",
+                       hello.staticData.Hello.clientPid);
+                reactor.Close(connection);
+                return;
+            }
+
+            std::shared_ptr<Session> const session =
+                OpenSession(connection, token, hello.staticData.Hello.clientPid, library);
+            if (!session)
+            {
+                printf("WRAPPER: Refusing session of client %u, not running as daemon\n",
+                       hello.staticData.Hello.clientPid);
+                reactor.Close(connection);
+                return;
+            }
+
+            if (!daemonMode) metrics::SetPeerPid(session->clientPid);
+            printf("WRAPPER: Session %u opened by client %u for %s\n", session->id, session->clientPid,
+                   libraries[library].name.c_str());
+
+            requestConnections[connection] = session;
+            SendHelloResponse(connection, session->id, session->token);
+        } break;
+        case msg::CHANNEL_Callback:
+        {
+            std::shared_ptr<Session> session;
+            {
+                std::lock_guard<std::mutex> guard(sessionMutex);
+                auto const it = sessions.find(hello.staticData.Hello.sessionId);
+                if (it != sessions.end()) session = it->second;
+            }
+
+            // Session ids are sequential, so in daemon mode another client could guess them and take over the callbacks
+            if (!session || session->callbackConnection.load() != 0 || session->token != hello.staticData.Hello.token)
+            {
+                printf("WRAPPER: Refusing callback connection of client %u for session %u\n",
+                       hello.staticData.Hello.clientPid, hello.staticData.Hello.sessionId);
+                reactor.Close(connection);
+                return;
+            }
+
+            // Queue the answer before any callback can be sent on this connection
+            callbackConnections[connection] = session;
+            SendHelloResponse(connection, session->id, 0);
+            reactor.TrackMessages(connection, &CallbackSent);
+            session->callbackConnection.store(connection);
+        } break;
+        default:
+        {
+            printf("WRAPPER: Unknown channel %d\n", hello.staticData.Hello.channel);
+            reactor.Close(connection);
+        } break;
     }
+}
 
-    char incoming[msg::MSG_MAX_SIZE];
+/*
+ * Count a request of the session that was executed or dropped. Must hold sessionMutex.
+ *
+ * Reading the session's requests is paused while it has all its credits outstanding, so a client that ignores them
+ * can't queue requests without bound. Each request that is done makes room for the next.
+ */
+void RequestDone(Session &session)
+{
+    if (sessionCredits != 0 && session.outstanding-- == sessionCredits)
+    {
+        reactor.ResumeReading(session.requestConnection);
+    }
+}
 
-    // Wait for incoming requests and respond to them
-    while (true)
+/* Answer a Cancel of a request that was dropped, in place of the request's response. */
+void SendCancelResponse(Session const &session, uint32_t callId)
+{
+    msg::MessageData response = {};
+    msg::InitMessageData(response, msg::MSGID_Cancel, msg::DIRECTION_Response);
+    response.callId = callId;
+
+    char buf[msg::MSG_HEADER_SIZE];
+    int responseSize;
+    msg::SerializeMessage(response, buf, responseSize);
+    reactor.Send(session.requestConnection, buf, responseSize);
+}
+
+/* Queue a request of the session, or remove a queued one if it was cancelled. */
+void QueueRequest(Session &session, msg::MessageData const &message)
+{
+    if (message.id == msg::MSGID_Cancel)
     {
-        int recvBytes;
-        if (!sock::Receive(requestSocket, incoming, sizeof(incoming), recvBytes))
+        // The client doesn't wait for the call anymore. If it is already executing, the client discards the response.
+        bool dropped = false;
         {
-            if (recvBytes == 0) {
-                printf("WRAPPER: Shutdown because other end hung up.\n");
-                return Shutdown(0);
+            std::lock_guard<std::mutex> guard(sessionMutex);
+            for (std::deque<msg::MessageData> &pending : session.pending)
+            {
+                auto const it = std::find_if(pending.begin(), pending.end(), [&message](msg::MessageData const &m)
+                {
+                    return m.callId == message.callId;
+                });
+                if (it != pending.end())
+                {
+                    DBG_LOG("WRAPPER: Cancelled call %u of session %u\n", message.callId, session.id);
+                    metrics::Dequeued(it->id);
+                    pending.erase(it);
+                    RequestDone(session);
+                    dropped = true;
+                    break;
+                }
             }
+        }
+
+        if (dropped) SendCancelResponse(session, message.callId);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(sessionMutex);
+        session.pending[message.lane].push_back(message);
+        metrics::Queued(message.id);
+        if (sessionCredits != 0 && ++session.outstanding == sessionCredits)
+        {
+            reactor.PauseReading(session.requestConnection);
+        }
+    }
+    sessionChanged.notify_all();
+}
+
+void ConnectionHandler::OnFrame(ConnectionId connection, char const *frame, int length)
+{
+    if (callbackConnections.count(connection) > 0)
+    {
+        // Nothing is expected from clients on their callback connection
+        return;
+    }
+
+    msg::MessageData message = {};
+    {
+        trace::Span span("Parse");
+        if (!ParseMessage(message, msg::DIRECTION_Request, frame, length))
+        {
+            printf("WRAPPER: ParseMessage() Error (length: %d)\n", length);
+            return;
+        }
+    }
+
+    auto const it = requestConnections.find(connection);
+    if (it != requestConnections.end())
+    {
+        QueueRequest(*it->second, message);
+    }
+    else if (message.id == msg::MSGID_Hello)
+    {
+        AcceptConnection(connection, message);
+    }
+    else
+    {
+        printf("WRAPPER: Dropping connection that didn't start with Hello\n");
+        reactor.Close(connection);
+    }
+}
+
+void ConnectionHandler::OnClose(ConnectionId connection)
+{
+    auto const request = requestConnections.find(connection);
+    if (request != requestConnections.end())
+    {
+        CloseSession(*request->second);
+        requestConnections.erase(request);
+        return;
+    }
 
-            printf("WRAPPER: Receive() Error: %d\n", recvBytes);
-            return Shutdown(recvBytes);
+    auto const callbacks = callbackConnections.find(connection);
+    if (callbacks != callbackConnections.end())
+    {
+        std::shared_ptr<Session> const session = callbacks->second.lock();
+        if (session)
+        {
+            // The connection failed or the client didn't read its callbacks, which can't be delivered anymore
+            printf("WRAPPER: Ending session %u, whose callback connection was lost\n", session->id);
+            session->callbackConnection.store(0);
+            reactor.Abort(session->requestConnection);
         }
+        callbackConnections.erase(callbacks);
+    }
+}
+
+/* Next session with pending requests in lane after the one served last, wrapping around. Must hold sessionMutex. */
+std::shared_ptr<Session> NextSession(msg::Lane lane, uint32_t lastServed)
+{
+    for (auto it = sessions.upper_bound(lastServed); it != sessions.end(); ++it)
+    {
+        if (!it->second->pending[lane].empty()) return it->second;
+    }
+    for (auto it = sessions.begin(); it != sessions.end() && it->first <= lastServed; ++it)
+    {
+        if (!it->second->pending[lane].empty()) return it->second;
+    }
+    return nullptr;
+}
+
+/*
+ * Lane to serve next. Control requests go first, unless CONTROL_BURST of them were served in a row while bulk requests
+ * waited. Returns LANE_COUNT if nothing is pending. Must hold sessionMutex.
+ */
+msg::Lane NextLane(uint32_t const (&lastServed)[msg::LANE_COUNT], unsigned controlServed)
+{
+    bool const control = NextSession(msg::LANE_Control, lastServed[msg::LANE_Control]) != nullptr;
+    bool const bulk = NextSession(msg::LANE_Bulk, lastServed[msg::LANE_Bulk]) != nullptr;
+
+    if (control && !(bulk && controlServed >= CONTROL_BURST)) return msg::LANE_Control;
+    if (bulk) return msg::LANE_Bulk;
+    return msg::LANE_COUNT;
+}
+
+/* Give the session a handle for an object the DLL returned. NULL gets handle 0. */
+msg::Handle AddHandle(Session const &session, HandleType type, void *object)
+{
+    if (object == nullptr)
+    {
+        return 0;
+    }
 
-        msg::MessageData message = {};
-        if (!ParseMessage(message, msg::DIRECTION_Request, incoming, recvBytes))
+    // Skip 0 and handles that are still in use after the counter wrapped around
+    while (nextHandle == 0 || handles.count(nextHandle) > 0)
+    {
+        nextHandle++;
+    }
+
+    msg::Handle const handle = nextHandle++;
+    handles[handle] = HandleEntry{object, type, session.id, session.library};
+    return handle;
+}
+
+/* Object behind a handle. nullptr if the handle is unknown, refers to another type or belongs to another session. */
+void *LookupHandle(Session const &session, msg::Handle handle, HandleType type)
+{
+    auto const it = handles.find(handle);
+    if (it == handles.end() || it->second.type != type || it->second.sessionId != session.id)
+    {
+        printf("WRAPPER: Invalid handle %u in session %u\n", handle, session.id);
+        return nullptr;
+    }
+    return it->second.object;
+}
+
+/* Free an object with the function of its library for its type. */
+// TODO: AUTOGEN
+void DestroyObject(HandleEntry const &entry)
+{
+    switch (entry.type)
+    {
+        case HANDLE_Buffer:
+        {
+            auto const destroy = Export<decltype(&DestroyBuffer)>(entry.library, msg::MSGID_DestroyBuffer);
+            if (destroy != nullptr) destroy((Buffer*)entry.object);
+        } break;
+    }
+}
+
+/* Free all objects the client of an ended session didn't free itself. */
+void ReleaseHandles(uint32_t sessionId)
+{
+    unsigned released = 0;
+    for (auto it = handles.begin(); it != handles.end();)
+    {
+        if (it->second.sessionId != sessionId)
         {
-            printf("WRAPPER: ParseMessage() Error (recvBytes: %d)\n", recvBytes);
+            ++it;
             continue;
         }
 
-        // Call requested function and craft response
-        // TODO: AUTOGEN
+        DestroyObject(it->second);
+        it = handles.erase(it);
+        released++;
+    }
 
-        msg::MessageData response = {};
-        InitMessageData(response, message.id, msg::DIRECTION_Response);
+    if (released > 0)
+    {
+        printf("WRAPPER: Freed %u objects left by session %u\n", released, sessionId);
+    }
+}
+
+/* True if array lies within the variable data of message. */
+bool IsInMessage(msg::MessageData const &message, msg::VariableArray const &array)
+{
+    return array.byte_offset >= 0 && array.byte_length >= 0 && array.byte_offset <= (int)message.variableDataLength &&
+           array.byte_length <= (int)message.variableDataLength - array.byte_offset;
+}
+
+/*
+ * Call the requested function and send the response back to the session. A request that can't be executed, e.g.
+ * because its arguments are invalid, is answered with msg::MSGID_Error.
+ */
+void Execute(std::shared_ptr<Session> const &session, msg::MessageData &message)
+{
+    // TODO: AUTOGEN
+
+    // Before the callbacks the request may fire
+    session->requestsStarted.fetch_add(1);
+
+    msg::MessageData response = {};
+    InitMessageData(response, message.id, msg::DIRECTION_Response);
+    response.lane = message.lane;
+    response.callId = message.callId;
+
+    metrics::CallScope callScope(message.id, message.lane);
+    trace::Span callSpan(msg::MsgIdName(message.id), message.callId);
+    trace::FlowStep(message.callId, callSpan.Start());
+    currentCallId.store(message.callId);
+
+    // Libraries are loaded by their first call. If that fails or the function is missing, the session is ended, so the
+    // client gets an error rather than a made-up result.
+    unsigned const library = session->library;
+    unsigned const exportId = ExportOf(message.id);
+    if (exportId < EXPORTS_PER_LIBRARY &&
+        (!LoadExports(library) || exportTable[library * EXPORTS_PER_LIBRARY + exportId] == nullptr))
+    {
+        printf("WRAPPER: Ending session %u, which called unavailable %s\n", session->id, msg::MsgIdName(message.id));
+        currentCallId.store(0);
+        reactor.Abort(session->requestConnection);
+        return;
+    }
 
-        switch (message.id)
+    bool valid = true;
+    switch (message.id)
+    {
+        case msg::MSGID_Callback: // fall-through
+        case msg::MSGID_Hello:
+        case msg::MSGID_Cancel:
+        case msg::MSGID_MemoryReport:
+        case msg::MSGID_Error:
+            printf("WRAPPER: Received unexpected MsgId: %d. This is ignored.\n", message.id);
+            currentCallId.store(0);
+            return;
+        case msg::MSGID_ClockSync:
+        {
+            response.staticData.ClockSyncResponse.wrapperTime = trace::Now();
+        } break;
+        case msg::MSGID_TraceStart:
         {
-            case msg::MSGID_Callback: // fall-through
-                printf("WRAPPER: Received unexpected MsgId: %d. This is ignored.\n", message.id);
-                continue;
-            case msg::MSGID_Invert:
+            msg::VariableArray const path = message.staticData.TraceStart.path;
+            int const pathLen = path.byte_length;
+            if (pathLen <= 0 || pathLen > (int)sizeof(traceFile) || !IsInMessage(message, path))
             {
-                response.staticData.InvertResponse = Invert(message.staticData.Invert.input);
-            } break;
-            case msg::MSGID_Interleave:
+                printf("WRAPPER: Invalid trace path length %d\n", pathLen);
+                valid = false;
+                break;
+            }
+
+            if (trace::IsEnabled())
             {
-                char* const s1 = &message.variableData[message.staticData.Interleave.s1.byte_offset];
-                int size1 = message.staticData.Interleave.s1.byte_length;
-                char* const s2 = &message.variableData[message.staticData.Interleave.s2.byte_offset];
-                int size2 = message.staticData.Interleave.s2.byte_length;
-                char output[msg::MSG_MAX_SIZE];
-                Interleave(s1, size1, s2, size2, output);
+                // The daemon records a single trace, for the session that asked first
+                break;
+            }
 
-                // FIXME: Doesn't work if first string has trailing /0
-                int const outputLength = strnlen(output, msg::MSG_MAX_SIZE - 1) + 1;
+            std::memcpy(traceFile, &message.variableData[path.byte_offset], pathLen);
+            traceFile[pathLen - 1] = '\0';
+            tracingSessionId = session->id;
+            trace::Enable("wrapper.exe", message.staticData.TraceStart.clockOffset);
+            DBG_LOG("WRAPPER: Tracing to %s\n", traceFile);
+        } break;
+        case msg::MSGID_Invert:
+        {
+            response.staticData.InvertResponse =
+                Export<decltype(&Invert)>(library, msg::MSGID_Invert)(message.staticData.Invert.input);
+        } break;
+        case msg::MSGID_InvertMap:
+        {
+            int const count = message.staticData.InvertMap.count;
+            msg::VariableArray const in = message.staticData.InvertMap.input;
+            if (count < 0 || in.byte_length != (int)(count * sizeof(bool)) || !IsInMessage(message, in))
+            {
+                printf("WRAPPER: Invalid InvertMap data length %d for %d elements\n", in.byte_length, count);
+                valid = false;
+                break;
+            }
 
-                response.staticData.InterleaveResponse.out.byte_offset = 0;
-                response.staticData.InterleaveResponse.out.byte_length = outputLength;
+            auto const invert = Export<decltype(&Invert)>(library, msg::MSGID_Invert);
+            bool const *const inputs = (bool const*)&message.variableData[in.byte_offset];
+            bool *const results = (bool*)response.variableData;
+            MapElements(msg::MSGID_Invert, count, [=](int begin, int end)
+            {
+                for (int i = begin; i < end; i++) results[i] = invert(inputs[i]);
+            });
 
-                std::memcpy(response.variableData, output, outputLength);
-                response.variableDataLength = outputLength;
-            } break;
-            case msg::MSGID_SetCallback:
+            response.staticData.InvertMapResponse.result.byte_offset = 0;
+            response.staticData.InvertMapResponse.result.byte_length = in.byte_length;
+            response.variableDataLength = in.byte_length;
+        } break;
+        case msg::MSGID_Interleave:
+        {
+            msg::VariableArray const in1 = message.staticData.Interleave.s1;
+            msg::VariableArray const in2 = message.staticData.Interleave.s2;
+            if (!IsInMessage(message, in1) || !IsInMessage(message, in2))
             {
-                SetCallback(&Callback);
-            } break;
-            default: assert(false);
+                printf("WRAPPER: Invalid Interleave data lengths %d and %d\n", in1.byte_length, in2.byte_length);
+                valid = false;
+                break;
+            }
+
+            char* const s1 = &message.variableData[in1.byte_offset];
+            int size1 = in1.byte_length;
+            char* const s2 = &message.variableData[in2.byte_offset];
+            int size2 = in2.byte_length;
+            char output[msg::MSG_MAX_SIZE] = {};
+            Export<decltype(&Interleave)>(library, msg::MSGID_Interleave)(s1, size1, s2, size2, output);
+
+            // FIXME: Doesn't work if first string has trailing /0
+            int const outputLength = strnlen(output, msg::MSG_MAX_VARIABLE_SIZE - 1) + 1;
+
+            response.staticData.InterleaveResponse.out.byte_offset = 0;
+            response.staticData.InterleaveResponse.out.byte_length = outputLength;
+
+            std::memcpy(response.variableData, output, outputLength);
+            response.variableDataLength = outputLength;
+        } break;
+        case msg::MSGID_ScaleRecords:
+        {
+            // The records are in our layout already, they just need to be aligned
+            int const count = message.staticData.ScaleRecords.count;
+            msg::VariableArray const in = message.staticData.ScaleRecords.records;
+            if (count < 0 || in.byte_length != (int)(count * sizeof(Record)) || !IsInMessage(message, in))
+            {
+                printf("WRAPPER: Invalid record data length %d for %d records\n", in.byte_length, count);
+                valid = false;
+                break;
+            }
+
+            alignas(Record) char records[msg::MSG_MAX_SIZE];
+            std::memcpy(records, &message.variableData[in.byte_offset], in.byte_length);
+            Export<decltype(&ScaleRecords)>(library, msg::MSGID_ScaleRecords)(
+                (Record*)records, count, message.staticData.ScaleRecords.factor);
+
+            response.staticData.ScaleRecordsResponse.records.byte_offset = 0;
+            response.staticData.ScaleRecordsResponse.records.byte_length = in.byte_length;
+            std::memcpy(response.variableData, records, in.byte_length);
+            response.variableDataLength = in.byte_length;
+        } break;
+        case msg::MSGID_CreateBuffer:
+        {
+            Buffer* const buffer = Export<decltype(&CreateBuffer)>(library, msg::MSGID_CreateBuffer)(
+                message.staticData.CreateBuffer.size);
+            response.staticData.CreateBufferResponse.buffer = AddHandle(*session, HANDLE_Buffer, buffer);
+        } break;
+        case msg::MSGID_WriteBuffer:
+        {
+            Buffer* const buffer = (Buffer*)LookupHandle(*session, message.staticData.WriteBuffer.buffer, HANDLE_Buffer);
+            msg::VariableArray const data = message.staticData.WriteBuffer.data;
+            if (buffer == nullptr || !IsInMessage(message, data))
+            {
+                valid = false;
+                break;
+            }
+
+            response.staticData.WriteBufferResponse.written = Export<decltype(&WriteBuffer)>(library, msg::MSGID_WriteBuffer)(
+                buffer, message.staticData.WriteBuffer.offset, &message.variableData[data.byte_offset], data.byte_length);
+        } break;
+        case msg::MSGID_ReadBuffer:
+        {
+            Buffer* const buffer = (Buffer*)LookupHandle(*session, message.staticData.ReadBuffer.buffer, HANDLE_Buffer);
+            int const size = std::min(message.staticData.ReadBuffer.size, (int32_t)msg::MSG_MAX_VARIABLE_SIZE);
+            if (buffer == nullptr || size < 0)
+            {
+                valid = false;
+                break;
+            }
+
+            // Only the requested slice is sent back
+            int const read = std::max(Export<decltype(&ReadBuffer)>(library, msg::MSGID_ReadBuffer)(
+                buffer, message.staticData.ReadBuffer.offset, response.variableData, size), 0);
+            response.staticData.ReadBufferResponse.read = read;
+            response.staticData.ReadBufferResponse.data.byte_offset = 0;
+            response.staticData.ReadBufferResponse.data.byte_length = read;
+            response.variableDataLength = read;
+        } break;
+        case msg::MSGID_DestroyBuffer:
+        {
+            msg::Handle const handle = message.staticData.DestroyBuffer.buffer;
+            Buffer* const buffer = (Buffer*)LookupHandle(*session, handle, HANDLE_Buffer);
+            if (buffer == nullptr)
+            {
+                valid = false;
+                break;
+            }
+
+            handles.erase(handle);
+            Export<decltype(&DestroyBuffer)>(library, msg::MSGID_DestroyBuffer)(buffer);
+        } break;
+        case msg::MSGID_SetCallback:
+        {
+            {
+                std::lock_guard<std::mutex> guard(callbackTargetMutex);
+                callbackSessions[library] = session;
+            }
+            Export<decltype(&SetCallback)>(library, msg::MSGID_SetCallback)(libraryCallbacks[library]);
+        } break;
+        default: assert(false);
+    }
+
+    currentCallId.store(0);
+    if (valid)
+    {
+        callScope.Succeeded();
+    }
+    else
+    {
+        // The client fails the call rather than taking a made-up result
+        InitMessageData(response, msg::MSGID_Error, msg::DIRECTION_Response);
+        response.lane = message.lane;
+        response.callId = message.callId;
+    }
+
+    DBG_LOG("WRAPPER: Sending response for message %d to session %u\n", message.id, session->id);
+    trace::Span span("SendResponse", message.callId);
+    char buf[msg::MSG_MAX_SIZE];
+    int responseSize;
+    msg::SerializeMessage(response, buf, responseSize);
+    // Fails if the client hung up, which ends the session in the event loop
+    reactor.Send(session->requestConnection, buf, responseSize, response.lane == msg::LANE_Control);
+}
+
+/* Send the memory usage of the wrapper to all sessions, at most every MEMORY_REPORT_INTERVAL_US. */
+void ReportMemory()
+{
+    static int64_t lastReport = 0;
+    int64_t const now = trace::Now();
+    if (lastReport != 0 && now - lastReport < MEMORY_REPORT_INTERVAL_US) return;
+    lastReport = now;
+
+    metrics::MemoryUsage usage;
+    if (!metrics::SampleMemory(usage)) return;
+
+    msg::MessageData report = {};
+    msg::InitMessageData(report, msg::MSGID_MemoryReport, msg::DIRECTION_Response);
+    report.staticData.MemoryReportResponse.workingSetKb = usage.workingSet >> 10;
+    report.staticData.MemoryReportResponse.privateKb = usage.privateBytes >> 10;
+    report.staticData.MemoryReportResponse.addressSpaceUsedKb = usage.addressSpaceUsed >> 10;
+    report.staticData.MemoryReportResponse.addressSpaceTotalKb = usage.addressSpaceTotal >> 10;
+
+    char buf[msg::MSG_MAX_SIZE];
+    int reportSize;
+    msg::SerializeMessage(report, buf, reportSize);
+
+    std::vector<ConnectionId> connections;
+    {
+        std::lock_guard<std::mutex> guard(sessionMutex);
+        for (auto const &entry : sessions)
+        {
+            ConnectionId const connection = entry.second->callbackConnection.load();
+            if (connection != 0) connections.push_back(connection);
+        }
+    }
+
+    for (ConnectionId const connection : connections)
+    {
+        reactor.Send(connection, buf, reportSize);
+    }
+}
+
+/*
+ * Execute queued requests until the wrapper should exit. Sessions with pending requests take turns, one call each, in
+ * every lane.
+ */
+void ServeRequests()
+{
+    uint32_t lastServed[msg::LANE_COUNT] = {};
+    unsigned controlServed = 0;
+
+    while (true)
+    {
+        std::shared_ptr<Session> session;
+        msg::MessageData message;
+        std::vector<uint32_t> ended;
+        bool lastSessionEnded;
+        {
+            std::unique_lock<std::mutex> lock(sessionMutex);
+            msg::Lane lane = msg::LANE_COUNT;
+            sessionChanged.wait(lock, [&lastServed, controlServed, &lane, &lastSessionEnded]()
+            {
+                lastSessionEnded = !daemonMode && sessionsOpened > 0 && sessions.empty();
+                lane = NextLane(lastServed, controlServed);
+                return lastSessionEnded || !endedSessions.empty() || lane != msg::LANE_COUNT;
+            });
+
+            ended.swap(endedSessions);
+            if (lane != msg::LANE_COUNT)
+            {
+                session = NextSession(lane, lastServed[lane]);
+                message = session->pending[lane].front();
+                session->pending[lane].pop_front();
+                metrics::Dequeued(message.id);
+                lastServed[lane] = session->id;
+                controlServed = lane == msg::LANE_Control ? controlServed + 1 : 0;
+            }
+        }
+
+        // Objects are freed here, because the DLL is only ever called by this thread
+        for (uint32_t const sessionId : ended)
+        {
+            ReleaseHandles(sessionId);
+        }
+
+        if (!session)
+        {
+            if (lastSessionEnded) return;
+            continue;
+        }
+
+        {
+            std::lock_guard<std::mutex> guard(callbackTargetMutex);
+            executingSession = session;
+        }
+
+        Execute(session, message);
+
+        {
+            std::lock_guard<std::mutex> guard(callbackTargetMutex);
+            executingSession.reset();
+        }
+        {
+            std::lock_guard<std::mutex> guard(sessionMutex);
+            RequestDone(*session);
+        }
+
+        ReportMemory();
+    }
+}
+
+int Shutdown(int exitArg)
+{
+    mapThreads.Stop();
+    if (trace::IsEnabled()) WriteTraceEvents();
+    metrics::StopPublishing();
+
+    if (listenAddress.transport == sock::TRANSPORT_Unix)
+    {
+        DeleteFileA(listenAddress.path);
+    }
+
+    WSACleanup();
+    return exitArg;
+}
+
+} // end anonymous namespace
+
+// Main entry point
+int main(int argc, char **argv)
+{
+    int port = -1;
+    char const *unixPath = nullptr;
+    char const *readyPipe = nullptr;
+    char const *placementSpec = std::getenv("DLL32TO64_PLACEMENT");
+    char const *mapThreadsEnv = std::getenv("DLL32TO64_MAP_THREADS");
+    unsigned mapThreadCount = mapThreadsEnv != nullptr ? std::strtoul(mapThreadsEnv, nullptr, 10) : 1;
+    char const *threadSafeExports = std::getenv("DLL32TO64_THREAD_SAFE");
+    for (int i = 1; i < argc; i++)
+    {
+        if (std::strcmp(argv[i], "--daemon") == 0) daemonMode = true;
+        else if (std::strcmp(argv[i], "--port") == 0 && i + 1 < argc) port = std::atoi(argv[++i]);
+        else if (std::strcmp(argv[i], "--unix") == 0 && i + 1 < argc) unixPath = argv[++i];
+        else if (std::strcmp(argv[i], "--ready-pipe") == 0 && i + 1 < argc) readyPipe = argv[++i];
+        else if (std::strcmp(argv[i], "--placement") == 0 && i + 1 < argc) placementSpec = argv[++i];
+        else if (std::strcmp(argv[i], "--credits") == 0 && i + 1 < argc)
+        {
+            sessionCredits = std::strtoul(argv[++i], nullptr, 10);
+        }
+        else if (std::strcmp(argv[i], "--map-threads") == 0 && i + 1 < argc)
+        {
+            mapThreadCount = std::strtoul(argv[++i], nullptr, 10);
+        }
+        else if (std::strcmp(argv[i], "--thread-safe") == 0 && i + 1 < argc) threadSafeExports = argv[++i];
+        else if (std::strcmp(argv[i], "--library") == 0 && i + 1 < argc)
+        {
+            if (!AddLibrary(argv[++i])) return 1;
+        }
+        else
+        {
+            printf("Usage: %s [--daemon] [--port <n> | --unix <path>] [--ready-pipe <handle>] [--placement <spec>] "
+                   "[--credits <n>] [--map-threads <n>] [--thread-safe <exports>] [--library <path>...]\n", argv[0]);
+            return 1;
         }
+    }
+
+    if (libraries.empty())
+    {
+        AddLibrary(WRAPPED_DLL);
+    }
+
+    if (placementSpec != nullptr && !placement::Configure(placementSpec))
+    {
+        printf("WRAPPER: Ignoring invalid placement %s\n", placementSpec);
+    }
 
-        DBG_LOG("WRAPPER: Sending response for message %d\n", message.id);
-        static char buf[msg::MSG_MAX_SIZE];
-        int responseSize;
-        msg::SerializeMessage(response, buf, responseSize);
-        // TODO: Handle Send error
-        sock::Send(requestSocket, buf, responseSize);
+    if (threadSafeExports != nullptr && !ParseThreadSafe(threadSafeExports))
+    {
+        return 1;
+    }
+
+    if (unixPath != nullptr)
+    {
+        if (!sock::SetUnixPath(listenAddress, unixPath)) return 1;
+    }
+    else
+    {
+        listenAddress.port = port >= 0 ? port : (daemonMode ? sock::daemonPort : 0);
+    }
+
+    if (!sock::StartupWinSock())
+    {
+        return 1;
+    }
+
+    if (!metrics::StartPublishing(daemonMode ? "daemon" : "wrapper"))
+    {
+        printf("WRAPPER: Could not create metrics segment, Err: %lu\n", GetLastError());
+    }
+
+    int boundPort;
+    if (!reactor.Listen(listenAddress, boundPort))
+    {
+        printf("WRAPPER: Could not listen on %s, Err: %d\n", sock::ToString(listenAddress).c_str(), WSAGetLastError());
+        return Shutdown(2);
+    }
+    listenAddress.port = boundPort;
+    DBG_LOG("WRAPPER: Listening for clients on %s...\n", sock::ToString(listenAddress).c_str());
+
+    if (readyPipe != nullptr)
+    {
+        ReportPort(readyPipe, boundPort);
+    }
+
+    if (daemonMode)
+    {
+        printf("WRAPPER: Serving clients on %s\n", sock::ToString(listenAddress).c_str());
+    }
+
+    std::thread loopThread([]()
+    {
+        if (!placement::Apply(placement::ROLE_WrapperIo))
+        {
+            printf("WRAPPER: Could not place event loop, Err: %lu\n", GetLastError());
+        }
+        reactor.Run();
+    });
+
+    if (!placement::Apply(placement::ROLE_WrapperWorker))
+    {
+        printf("WRAPPER: Could not place worker thread, Err: %lu\n", GetLastError());
+    }
+
+    // Helpers are left to the scheduler, so they don't compete with the worker thread for its CPU
+    if (std::find(std::begin(threadSafe), std::end(threadSafe), true) != std::end(threadSafe))
+    {
+        mapThreads.Start(mapThreadCount);
     }
+    ServeRequests();
 
+    reactor.Stop();
+    loopThread.join();
     return Shutdown(0);
 }
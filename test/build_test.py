@@ -1,5 +1,6 @@
 #!/bin/python
 
+import argparse
 import os
 import subprocess
 
@@ -10,23 +11,32 @@ sys.path.insert(0, os.path.dirname(cwd))
 import build_params as bp
 from build import main as build_dut
 
+parser = argparse.ArgumentParser(description="Build and run the tests.")
+parser.add_argument('--lib', choices=['test', 'synth'], default='test',
+                    help='Library to wrap: test_lib.dll or synth_lib.dll, which is configured by the environment '
+                         'variable SYNTH_LIB (see synth_lib.cpp).')
+args = parser.parse_args()
+
 test_output_path = os.path.join(cwd, 'build')
 os.makedirs(test_output_path, exist_ok=True)
 
-test_lib_path = os.path.join(test_output_path, 'test_lib.dll')
+if args.lib == 'test':
+    test_lib_path = os.path.join(test_output_path, 'test_lib.dll')
 
-print("Building test_lib.dll")
-subprocess.check_output([bp.COMPILER32,
-    os.path.join(cwd, 'test_lib.cpp'),
-    '-shared',
-    '-lws2_32',
-    '-g',
-    '-Og',
-    '-funsigned-char',
-    '-o' + test_lib_path]
-)
+    print("Building test_lib.dll")
+    subprocess.check_output([bp.COMPILER32,
+        os.path.join(cwd, 'test_lib.cpp'),
+        '-shared',
+        '-lws2_32',
+        '-g',
+        '-Og',
+        '-funsigned-char',
+        '-o' + test_lib_path]
+    )
 
-build_dut(dll=test_lib_path, include=cwd, output=test_output_path, debug=True)
+    build_dut(dll=test_lib_path, include=cwd, output=test_output_path, debug=True)
+else:
+    build_dut(output=test_output_path, debug=True, synth=True)
 
 print("Building test_app.exe")
 subprocess.check_output([bp.COMPILER64,
@@ -35,6 +45,7 @@ subprocess.check_output([bp.COMPILER64,
     '-g',
     '-Og',
     '-I' + os.path.join(cwd, '..', 'include'),
+    '-I' + cwd,
     '-L' + test_output_path,
     '-Wl,-Bdynamic',
     '-lbridge',
@@ -42,5 +53,35 @@ subprocess.check_output([bp.COMPILER64,
     '-o' + os.path.join(test_output_path, 'test_app.exe')]
     )
 
+print("Building stress_app.exe")
+subprocess.check_output([bp.COMPILER64,
+    os.path.join(cwd, 'stress_app.cpp'),
+    '-static', '-static-libgcc', '-static-libstdc++',
+    '-O2',
+    '-I' + os.path.join(cwd, '..', 'include'),
+    '-L' + test_output_path,
+    '-Wl,-Bdynamic',
+    '-lbridge',
+    '-Wl,-Bstatic',
+    '-o' + os.path.join(test_output_path, 'stress_app.exe')]
+    )
+
+print("Building reactor_stress.exe")
+src_path = os.path.join(cwd, '..', 'src')
+subprocess.check_output([bp.COMPILER64,
+    os.path.join(cwd, 'reactor_stress.cpp'),
+    os.path.join(src_path, 'common', 'msg_protocol.cpp'),
+    os.path.join(src_path, 'common', 'reactor.cpp'),
+    os.path.join(src_path, 'common', 'socket.cpp'),
+    '-static', '-static-libgcc', '-static-libstdc++',
+    '-g',
+    '-O2',
+    '-I' + src_path,
+    '-I' + os.path.join(cwd, '..', 'vendor', 'plog'),
+    '-lws2_32',
+    '-o' + os.path.join(test_output_path, 'reactor_stress.exe')]
+    )
+
 print("Executing tests")
-subprocess.run(os.path.join(test_output_path, 'test_app.exe'))
\ No newline at end of file
+subprocess.run(os.path.join(test_output_path, 'test_app.exe'))
+subprocess.run(os.path.join(test_output_path, 'reactor_stress.exe'))
\ No newline at end of file
@@ -0,0 +1,109 @@
+#!/bin/python
+"""
+Compare call throughput and latency of stress_app.exe with different placements of the bridge and wrapper threads.
+
+* unpinned:   All threads are left to the scheduler.
+* colocated:  The calling thread, bridge and wrapper run on separate CPUs of the local set, e.g. cores sharing a cache.
+* remote:     The calling thread and bridge run on the local set, the wrapper on the remote set, e.g. another socket or
+              NUMA node.
+
+Build the tests with build_test.py first. Each scenario runs --repeat times, the median is reported.
+"""
+
+import argparse
+import os
+import statistics
+import subprocess
+
+cwd = os.path.dirname(os.path.realpath(__file__))
+
+SCENARIOS = ['unpinned', 'colocated', 'remote']
+
+
+def parse_cpus(arg):
+    return [int(cpu) for cpu in arg.split(',')]
+
+
+def placement_spec(scenario, local, remote):
+    """DLL32TO64_PLACEMENT for a scenario. The calling thread is pinned to local[0] by stress_app."""
+    if scenario == 'unpinned':
+        return None
+
+    bridge = local[1 % len(local)]
+    if scenario == 'colocated':
+        wrapper_io, wrapper_worker = local[2 % len(local)], local[3 % len(local)]
+    else:
+        wrapper_io, wrapper_worker = remote[0], remote[1 % len(remote)]
+
+    return 'bridge-reader={0};bridge-dispatcher={0};wrapper-io={1};wrapper-worker={2}'.format(
+        bridge, wrapper_io, wrapper_worker)
+
+
+def run_stress(exe, scenario, local, remote, calls, payload):
+    """Run stress_app once. Returns calls/s and the p50 and p99 latency per function in us."""
+    env = dict(os.environ)
+    env.pop('DLL32TO64_PLACEMENT', None)
+    spec = placement_spec(scenario, local, remote)
+    command = [exe, '--threads', '1', '--calls', str(calls), '--payload', str(payload)]
+    if spec is not None:
+        env['DLL32TO64_PLACEMENT'] = spec
+        command += ['--pin', str(local[0])]
+
+    output = subprocess.run(command, env=env, check=True, stdout=subprocess.PIPE, universal_newlines=True).stdout
+
+    # Rows look like "<threads> <calls/s> <scaling> | <function> <calls> <p50> <p90> <p99> <max> <errors> <corrupt>",
+    # where the first three columns are only filled for the first function
+    throughput = None
+    latencies = {}
+    for line in output.splitlines():
+        if '|' not in line:
+            continue
+        left, right = line.split('|', 1)
+        columns = right.split()
+        if len(columns) != 8 or not columns[1].isdigit():
+            continue
+        if left.split():
+            throughput = float(left.split()[1])
+        latencies[columns[0]] = (int(columns[2]), int(columns[4]))
+
+    return throughput, latencies
+
+
+def main():
+    cpus = os.cpu_count() or 1
+    half = max(cpus // 2, 1)
+    default_local = ','.join(str(cpu) for cpu in range(min(4, half)))
+    default_remote = ','.join(str(cpu) for cpu in range(max(cpus - 4, half), cpus)) or default_local
+
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--exe', default=os.path.join(cwd, 'build', 'stress_app.exe'), help='Path to stress_app.exe')
+    parser.add_argument('--local', type=parse_cpus, default=parse_cpus(default_local),
+                        help='CPUs close to the calling thread. Defaults to ' + default_local)
+    parser.add_argument('--remote', type=parse_cpus, default=parse_cpus(default_remote),
+                        help='CPUs far from the calling thread. Defaults to ' + default_remote)
+    parser.add_argument('--calls', type=int, default=200000, help='Calls per run')
+    parser.add_argument('--payload', type=int, default=64, help='Interleave payload in bytes')
+    parser.add_argument('--repeat', type=int, default=3, help='Runs per scenario')
+    args = parser.parse_args()
+
+    if set(args.local) & set(args.remote):
+        print('Warning: local and remote CPUs overlap, remote placement is not remote')
+
+    print('{:<10} {:>12} {:>14} {:>14} {:>16} {:>16}'.format(
+        'placement', 'calls/s', 'Invert p50', 'Invert p99', 'Interleave p50', 'Interleave p99'))
+
+    for scenario in SCENARIOS:
+        runs = [run_stress(args.exe, scenario, args.local, args.remote, args.calls, args.payload)
+                for _ in range(args.repeat)]
+
+        def median_latency(function, index):
+            return statistics.median(run[1].get(function, (0, 0))[index] for run in runs)
+
+        print('{:<10} {:>12.0f} {:>12.0f}us {:>12.0f}us {:>14.0f}us {:>14.0f}us'.format(
+            scenario, statistics.median(run[0] for run in runs),
+            median_latency('Invert', 0), median_latency('Invert', 1),
+            median_latency('Interleave', 0), median_latency('Interleave', 1)))
+
+
+if __name__ == '__main__':
+    main()
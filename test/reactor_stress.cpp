@@ -0,0 +1,127 @@
+/**
+ * Stress test of sock::Reactor's wake-ups.
+ *
+ * Several threads keep pausing and resuming reading of a connection, each of which wakes the loop, while a client
+ * sends messages. After every round, a message held back while reading was paused must be handed out once it's resumed,
+ * and Stop() must end the loop. Both need the loop to be woken up, which fails if a wake-up got lost on the way.
+ *
+ * Usage: reactor_stress [--threads <n>] [--rounds <n>]
+ */
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <future>
+#include <thread>
+#include <vector>
+
+#include "common/msg_protocol.h"
+#include "common/reactor.h"
+#include "common/socket.h"
+
+namespace {
+    // Wake-ups per thread and round
+    int const WAKES_PER_ROUND = 20000;
+    // A loop that doesn't react within this time missed its wake-up
+    auto const REACTION_TIMEOUT = std::chrono::seconds(5);
+
+    class CountingHandler : public sock::Reactor::Handler {
+    public:
+        void OnFrame(sock::Reactor::ConnectionId, char const*, int) override {
+            frames++;
+        }
+
+        void OnClose(sock::Reactor::ConnectionId) override {}
+
+        std::atomic<int> frames{0};
+    };
+
+    bool WaitForFrames(CountingHandler const &handler, int count) {
+        auto const deadline = std::chrono::steady_clock::now() + REACTION_TIMEOUT;
+        while (handler.frames.load() < count) {
+            if (std::chrono::steady_clock::now() > deadline) return false;
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        return true;
+    }
+}
+
+int main(int argc, char **argv) {
+    int threadCount = 8;
+    int rounds = 20;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--threads") == 0) threadCount = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "--rounds") == 0) rounds = atoi(argv[i + 1]);
+    }
+
+    if (!sock::StartupWinSock()) return 1;
+
+    CountingHandler handler;
+    sock::Reactor reactor(handler);
+    sock::Address address;
+    if (!reactor.Listen(address, address.port)) {
+        printf("Can't listen\n");
+        return 1;
+    }
+    std::future<void> loop = std::async(std::launch::async, [&reactor] { reactor.Run(); });
+
+    SOCKET client;
+    if (!sock::Connect(client, address)) {
+        printf("Can't connect\n");
+        return 1;
+    }
+
+    msg::MessageData message;
+    msg::InitMessageData(message, msg::MSGID_Invert, msg::DIRECTION_Request);
+    char frame[msg::MSG_MAX_SIZE];
+    int frameSize;
+    msg::SerializeMessage(message, frame, frameSize);
+
+    // The first connection of a reactor gets id 1
+    sock::Reactor::ConnectionId const connection = 1;
+    if (!sock::Send(client, frame, frameSize) || !WaitForFrames(handler, 1)) {
+        fprintf(stderr, "FAILED: First message wasn't handed out\n");
+        return 1;
+    }
+
+    for (int round = 0; round < rounds; round++) {
+        std::vector<std::thread> threads;
+        for (int t = 0; t < threadCount; t++) {
+            threads.emplace_back([&reactor, connection] {
+                for (int i = 0; i < WAKES_PER_ROUND; i++) {
+                    reactor.PauseReading(connection);
+                    reactor.ResumeReading(connection);
+                }
+            });
+        }
+
+        // Messages arriving meanwhile may be held back, but never for good
+        sock::Send(client, frame, frameSize);
+        for (auto &thread : threads) {
+            thread.join();
+        }
+
+        // Only a wake-up makes the loop hand out a message that arrived while reading was paused
+        reactor.PauseReading(connection);
+        sock::Send(client, frame, frameSize);
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        reactor.ResumeReading(connection);
+        if (!WaitForFrames(handler, round * 2 + 3)) {
+            fprintf(stderr, "FAILED: Round %d: Loop doesn't hand out messages anymore\n", round);
+            // The loop thread can't be joined
+            std::_Exit(1);
+        }
+    }
+
+    reactor.Stop();
+    if (loop.wait_for(REACTION_TIMEOUT) != std::future_status::ready) {
+        fprintf(stderr, "FAILED: Loop didn't stop\n");
+        std::_Exit(1);
+    }
+
+    closesocket(client);
+    printf("Passed: %d rounds of %d threads\n", rounds, threadCount);
+    return 0;
+}
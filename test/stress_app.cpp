@@ -0,0 +1,437 @@
+/**
+ * Load generator for bridge.dll.
+ *
+ * Runs a mix of calls of the test_lib exports from a growing number of threads, each for a fixed duration, and reports
+ * throughput, its scaling with the number of threads, latency percentiles and errors. Every result is validated, so
+ * responses that are corrupted or delivered to the wrong caller are detected.
+ *
+ * Usage: stress_app [--threads 1,2,4,8] [--duration <s> | --calls <n>] [--mix <invert>,<interleave>,<callback>]
+ *                   [--payload <bytes>] [--shims] [--pin <cpu>,<cpu>...] [--bulk <bytes>] [--single-lane]
+ *                   [--recycle <calls>] [--limit <calls>] [--map <elements>]
+ *
+ *   --threads   Thread counts to run, one after the other. Defaults to 1,2,4,8.
+ *   --duration  Seconds each thread count runs. Defaults to 5.
+ *   --calls     Run a fixed number of calls per thread instead, e.g. as a PGO training workload (see build.py --pgo).
+ *   --mix       Relative weights of Invert, Interleave and SetCallback calls. Defaults to 10,10,0. SetCallback takes
+ *               2.5s per call in test_lib.
+ *   --payload   Total length of both Interleave strings in bytes, at most 2000. Defaults to 64.
+ *   --shims     Allow local shims (see Dll32To64_SetShimMode()). By default, all calls go to the wrapper.
+ *   --pin       Pin the calling threads to these CPUs, one each in turn, e.g. to compare placements of bridge and
+ *               wrapper threads (see Dll32To64_SetPlacement() and placement_bench.py).
+ *   --bulk      Keep writing a buffer of this size from another thread during each round, to measure how much the
+ *               other calls are held up by a large transfer. Its WriteBuffer calls are not counted in calls/s.
+ *   --single-lane  Send all calls on the bulk lane, as a baseline for --bulk (see Dll32To64_SetLane()).
+ *   --recycle   Replace the wrapper after this many calls (see Dll32To64_SetRecyclePolicy()), to check that no call
+ *               fails while it's switched and how much latency that adds. Not combined with --bulk, whose buffer keeps
+ *               the wrapper from being recycled.
+ *   --limit     Admit at most this many calls of all threads at once (see Dll32To64_SetAdmissionLimit()). The others
+ *               wait in the bridge, so this shows the latency added by queueing; none may be rejected.
+ *   --map       Replace each Invert call with an InvertMap call over this many elements (see dll32to64_map.h), to
+ *               compare the cost per element with single calls.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#include "dll32to64.h"
+#include "dll32to64_map.h"
+
+#include "test_lib.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+enum Op {
+    OP_Invert,
+    OP_Interleave,
+    OP_Callback,
+    OP_Bulk,  // Only run by the bulk thread, see --bulk
+    OP_COUNT,
+};
+
+char const* const opNames[OP_COUNT] = {"Invert", "Interleave", "SetCallback", "WriteBuffer"};
+
+// Larger than any response Interleave can return
+size_t const INTERLEAVE_OUT_SIZE = 4096;
+
+struct Options {
+    std::vector<int> threads{1, 2, 4, 8};
+    int durationS = 5;
+    int calls = 0;  // Per thread, 0 to run for durationS
+    unsigned weights[OP_COUNT] = {10, 10, 0, 0};
+    int payload = 64;
+    bool shims = false;
+    std::vector<int> pin;
+    int bulk = 0;
+    bool singleLane = false;
+    unsigned recycle = 0;
+    unsigned limit = 0;
+    int map = 0;
+};
+
+/* Results of a single thread. */
+struct ThreadStats {
+    std::vector<uint32_t> latencyUs[OP_COUNT];
+    unsigned errors[OP_COUNT] = {};
+    unsigned corrupted[OP_COUNT] = {};
+};
+
+// Callbacks received per value. Each SetCallback call triggers the values 0 to 4 once.
+std::atomic<unsigned> callbackValues[5];
+std::atomic<unsigned> unexpectedCallbacks(0);
+// Callbacks of a storm of synth_lib.dll, which have the value -1
+std::atomic<unsigned> stormCallbacks(0);
+
+void StressCallback(int val) {
+    if (val == -1) {
+        stormCallbacks++;
+        return;
+    }
+    if (val < 0 || val >= 5) {
+        unexpectedCallbacks++;
+        return;
+    }
+    callbackValues[val]++;
+}
+
+std::vector<int> ParseList(char const* arg) {
+    std::vector<int> values;
+    for (char const* p = arg; *p != '\0';) {
+        values.push_back(std::atoi(p));
+        p = std::strchr(p, ',');
+        if (p == nullptr) break;
+        p++;
+    }
+    return values;
+}
+
+bool ParseOptions(int argc, char** argv, Options& options) {
+    for (int i = 1; i < argc; i++) {
+        bool const hasValue = i + 1 < argc;
+        if (std::strcmp(argv[i], "--threads") == 0 && hasValue) {
+            options.threads = ParseList(argv[++i]);
+        }
+        else if (std::strcmp(argv[i], "--duration") == 0 && hasValue) {
+            options.durationS = std::atoi(argv[++i]);
+        }
+        else if (std::strcmp(argv[i], "--calls") == 0 && hasValue) {
+            options.calls = std::atoi(argv[++i]);
+        }
+        else if (std::strcmp(argv[i], "--mix") == 0 && hasValue) {
+            std::vector<int> const weights = ParseList(argv[++i]);
+            if (weights.size() != OP_Bulk) return false;
+            for (int op = 0; op < OP_Bulk; op++) {
+                options.weights[op] = std::max(weights[op], 0);
+            }
+        }
+        else if (std::strcmp(argv[i], "--payload") == 0 && hasValue) {
+            options.payload = std::atoi(argv[++i]);
+        }
+        else if (std::strcmp(argv[i], "--shims") == 0) {
+            options.shims = true;
+        }
+        else if (std::strcmp(argv[i], "--pin") == 0 && hasValue) {
+            options.pin = ParseList(argv[++i]);
+        }
+        else if (std::strcmp(argv[i], "--bulk") == 0 && hasValue) {
+            options.bulk = std::atoi(argv[++i]);
+        }
+        else if (std::strcmp(argv[i], "--single-lane") == 0) {
+            options.singleLane = true;
+        }
+        else if (std::strcmp(argv[i], "--recycle") == 0 && hasValue) {
+            options.recycle = std::strtoul(argv[++i], nullptr, 10);
+        }
+        else if (std::strcmp(argv[i], "--limit") == 0 && hasValue) {
+            options.limit = std::strtoul(argv[++i], nullptr, 10);
+        }
+        else if (std::strcmp(argv[i], "--map") == 0 && hasValue) {
+            options.map = std::atoi(argv[++i]);
+        }
+        else {
+            return false;
+        }
+    }
+
+    unsigned totalWeight = 0;
+    for (unsigned const weight : options.weights) totalWeight += weight;
+
+    bool threadsValid = !options.threads.empty();
+    for (int const threads : options.threads) threadsValid = threadsValid && threads > 0;
+    for (int const cpu : options.pin) threadsValid = threadsValid && cpu >= 0 && cpu < 64;
+
+    return threadsValid && totalWeight > 0 && options.durationS > 0 && options.calls >= 0 && options.payload >= 2 && options.payload <= 2000 &&
+           options.bulk >= 0 && options.map >= 0;
+}
+
+/* Result Interleave must return. */
+void ExpectedInterleave(std::string const& s1, std::string const& s2, std::string& expected) {
+    expected.clear();
+    size_t const common = std::min(s1.size(), s2.size());
+    for (size_t i = 0; i < common; i++) {
+        expected += s1[i];
+        expected += s2[i];
+    }
+    expected += s1.substr(common);
+    expected += s2.substr(common);
+}
+
+/* Random string without 0 bytes, which would end Interleave's output early. */
+void FillRandom(std::mt19937& rng, std::string& s, size_t length) {
+    s.resize(length);
+    for (char& c : s) c = 'A' + rng() % 58;
+}
+
+void PinThread(int cpu) {
+#ifdef _WIN32
+    if (SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu) == 0) {
+        std::printf("Could not pin thread to CPU %d\n", cpu);
+    }
+#else
+    (void)cpu;
+#endif
+}
+
+void RunThread(int index, Options const& options, Clock::time_point end, ThreadStats& stats) {
+    if (!options.pin.empty()) PinThread(options.pin[index % options.pin.size()]);
+
+    std::mt19937 rng(index * 7919 + 1);
+    unsigned totalWeight = 0;
+    for (unsigned const weight : options.weights) totalWeight += weight;
+
+    std::string s1, s2, expected;
+    std::vector<char> out(INTERLEAVE_OUT_SIZE);
+    std::unique_ptr<bool[]> mapInputs(new bool[options.map]);
+    std::unique_ptr<bool[]> mapResults(new bool[options.map]);
+    uint32_t sequence = 0;
+
+    while (options.calls > 0 ? sequence < (uint32_t)options.calls : Clock::now() < end) {
+        // Pick the next operation according to the weights
+        unsigned pick = rng() % totalWeight;
+        int op = 0;
+        while (pick >= options.weights[op]) {
+            pick -= options.weights[op];
+            op++;
+        }
+
+        // Inputs that differ per thread and call, so a response that reaches the wrong caller doesn't validate
+        bool const input = (sequence++ + index) % 2 == 0;
+        if (op == OP_Interleave) {
+            size_t const size1 = 1 + rng() % (options.payload - 1);
+            FillRandom(rng, s1, size1);
+            FillRandom(rng, s2, options.payload - size1);
+            std::snprintf(&s1[0], s1.size(), "%d:%u", index, sequence);
+            std::replace(s1.begin(), s1.end(), '\0', '#');
+            ExpectedInterleave(s1, s2, expected);
+        }
+        for (int i = 0; i < options.map; i++) {
+            mapInputs[i] = (i + sequence) % 2 == 0;
+        }
+
+        Clock::time_point const start = Clock::now();
+        bool valid = true;
+        switch (op) {
+            case OP_Invert:
+                if (options.map > 0) {
+                    InvertMap(mapInputs.get(), mapResults.get(), options.map);
+                    for (int i = 0; i < options.map; i++) valid = valid && mapResults[i] == !mapInputs[i];
+                }
+                else {
+                    valid = Invert(input) == !input;
+                }
+                break;
+            case OP_Interleave:
+                Interleave(s1.data(), s1.size(), s2.data(), s2.size(), out.data());
+                valid = std::memcmp(out.data(), expected.data(), expected.size()) == 0;
+                break;
+            case OP_Callback:
+                SetCallback(StressCallback);
+                break;
+        }
+        Clock::time_point const done = Clock::now();
+
+        if (Dll32To64_GetLastError() != DLL32TO64_ERROR_NONE) {
+            stats.errors[op]++;
+            continue;
+        }
+        if (!valid) {
+            stats.corrupted[op]++;
+        }
+        stats.latencyUs[op].push_back(
+            (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(done - start).count());
+    }
+}
+
+/* Write a buffer of options.bulk bytes over and over until stop is set. */
+void RunBulkThread(Options const& options, std::atomic<bool> const& stop, ThreadStats& stats) {
+    Buffer* const buffer = CreateBuffer(options.bulk);
+    if (buffer == nullptr) {
+        stats.errors[OP_Bulk]++;
+        return;
+    }
+
+    std::vector<char> data(options.bulk);
+    for (size_t i = 0; i < data.size(); i++) data[i] = (char)i;
+
+    while (!stop.load()) {
+        Clock::time_point const start = Clock::now();
+        int const written = WriteBuffer(buffer, 0, data.data(), options.bulk);
+        Clock::time_point const done = Clock::now();
+
+        if (Dll32To64_GetLastError() != DLL32TO64_ERROR_NONE) {
+            stats.errors[OP_Bulk]++;
+            continue;
+        }
+        if (written != options.bulk) {
+            stats.corrupted[OP_Bulk]++;
+        }
+        stats.latencyUs[OP_Bulk].push_back(
+            (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(done - start).count());
+    }
+
+    DestroyBuffer(buffer);
+}
+
+uint32_t Percentile(std::vector<uint32_t> const& sorted, double p) {
+    if (sorted.empty()) return 0;
+    size_t const index = std::min((size_t)(p * sorted.size()), sorted.size() - 1);
+    return sorted[index];
+}
+
+/* Run all threads for the configured duration or number of calls. Returns the number of successful calls per second. */
+double RunRound(int threads, Options const& options, ThreadStats& total) {
+    std::vector<ThreadStats> stats(threads + 1);
+    std::vector<std::thread> workers;
+    std::atomic<bool> stopBulk(false);
+    std::thread bulkThread;
+    if (options.bulk > 0) {
+        bulkThread = std::thread(RunBulkThread, std::cref(options), std::cref(stopBulk), std::ref(stats[threads]));
+    }
+
+    Clock::time_point const start = Clock::now();
+    Clock::time_point const end = start + std::chrono::seconds(options.durationS);
+
+    for (int i = 0; i < threads; i++) {
+        workers.emplace_back(RunThread, i, std::cref(options), end, std::ref(stats[i]));
+    }
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    double const seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    stopBulk.store(true);
+    if (bulkThread.joinable()) bulkThread.join();
+
+    size_t calls = 0;
+    for (ThreadStats const& s : stats) {
+        for (int op = 0; op < OP_COUNT; op++) {
+            total.latencyUs[op].insert(total.latencyUs[op].end(), s.latencyUs[op].begin(), s.latencyUs[op].end());
+            total.errors[op] += s.errors[op];
+            total.corrupted[op] += s.corrupted[op];
+            if (op != OP_Bulk) calls += s.latencyUs[op].size();
+        }
+    }
+    return calls / seconds;
+}
+
+}
+
+int main(int argc, char** argv) {
+    Options options;
+    if (!ParseOptions(argc, argv, options)) {
+        std::printf("Usage: %s [--threads 1,2,4,8] [--duration <s> | --calls <n>] "
+                    "[--mix <invert>,<interleave>,<callback>] [--payload <bytes>] [--shims] [--pin <cpus>] "
+                    "[--bulk <bytes>] [--single-lane] [--recycle <calls>] [--limit <calls>] "
+                    "[--map <elements>]\n", argv[0]);
+        return 1;
+    }
+
+    if (options.recycle > 0) {
+        Dll32To64_SetRecyclePolicy(options.recycle, 0);
+    }
+
+    if (options.limit > 0) {
+        // Every calling thread has at most one call in flight, so the queue never fills up
+        Dll32To64_SetAdmissionLimit(nullptr, options.limit, UINT_MAX);
+    }
+
+    if (options.singleLane) {
+        Dll32To64_SetLane(nullptr, DLL32TO64_LANE_BULK);
+    }
+
+    if (!options.shims) {
+        Dll32To64_SetShimMode(nullptr, DLL32TO64_SHIM_OFF, 0);
+    }
+
+    std::printf("%8s %12s %8s | %-12s %9s %9s %9s %9s %9s %7s %9s\n", "threads", "calls/s", "scaling",
+                "function", "calls", "p50 us", "p90 us", "p99 us", "max us", "errors", "corrupt");
+
+    bool failed = false;
+    double baseline = 0;
+    unsigned callbackCalls = 0;
+    for (int const threads : options.threads) {
+        ThreadStats total;
+        double const throughput = RunRound(threads, options, total);
+        if (baseline == 0) baseline = throughput;
+
+        bool first = true;
+        for (int op = 0; op < OP_COUNT; op++) {
+            std::vector<uint32_t>& latencies = total.latencyUs[op];
+            if (op == OP_Bulk ? options.bulk == 0 : options.weights[op] == 0) continue;
+
+            std::sort(latencies.begin(), latencies.end());
+            if (first) {
+                std::printf("%8d %12.0f %7.2fx | ", threads, throughput, baseline > 0 ? throughput / baseline : 0.0);
+            }
+            else {
+                std::printf("%8s %12s %8s | ", "", "", "");
+            }
+            first = false;
+
+            std::printf("%-12s %9zu %9u %9u %9u %9u %7u %9u\n", opNames[op], latencies.size(),
+                        Percentile(latencies, 0.5), Percentile(latencies, 0.9), Percentile(latencies, 0.99),
+                        latencies.empty() ? 0 : latencies.back(), total.errors[op], total.corrupted[op]);
+
+            failed = failed || total.errors[op] > 0 || total.corrupted[op] > 0;
+        }
+
+        // Callbacks without errors are the ones whose 5 callbacks must arrive
+        callbackCalls += total.latencyUs[OP_Callback].size();
+    }
+
+    // Callbacks are delivered asynchronously, give the last ones time to arrive
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+    for (int val = 0; val < 5; val++) {
+        if (callbackValues[val].load() != callbackCalls) {
+            std::printf("Callback %d received %u times, expected %u\n", val, callbackValues[val].load(), callbackCalls);
+            failed = true;
+        }
+    }
+    if (stormCallbacks.load() > 0) {
+        std::printf("%u storm callbacks\n", stormCallbacks.load());
+    }
+    if (unexpectedCallbacks.load() > 0) {
+        std::printf("%u callbacks with unexpected values\n", unexpectedCallbacks.load());
+        failed = true;
+    }
+
+    Dll32To64_Shutdown();
+
+    std::printf(failed ? "FAILED\n" : "OK\n");
+    return failed ? 1 : 0;
+}
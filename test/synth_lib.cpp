@@ -0,0 +1,415 @@
+/**
+ * Synthetic drop-in replacement for test_lib.dll, which models the behavior of production libraries.
+ *
+ * It exports the same functions with the same results as test_lib, so bridge.dll, test_app and stress_app work with it
+ * unchanged. How long calls take, how the library copes with threads and how it calls back are configured by the
+ * environment variable SYNTH_LIB of the process loading it (wrapper.exe inherits it from its client):
+ *
+ *   SYNTH_LIB="service=exp:50;WriteBuffer.perkb=20;hang=0.001:5000;threading=single;storm=2000:1000:4"
+ *
+ * Entries are separated by ';' and apply in order. Entries starting with `<Export>.` only apply to that export, all
+ * others to all exports.
+ *
+ *   service=<dist>       Time each call takes, in us. <dist> is `fixed:<us>`, `uniform:<min>:<max>`, `exp:<mean>` or
+ *                        `lognormal:<median>:<sigma>`. Defaults to fixed:0.
+ *   perkb=<us>           Additional time per KB of payload, e.g. the bytes written by WriteBuffer.
+ *   hang=<p>:<ms>        With probability p, a call hangs for ms before it returns, e.g. to test deadlines.
+ *   threading=<mode>     How the library copes with threads:
+ *                          free        Calls may run concurrently (default).
+ *                          serialized  Calls wait for each other on a lock inside the library.
+ *                          single      Concurrent calls abort the process, like a library that isn't thread-safe.
+ *                          affine      Calls from any but the first calling thread abort the process.
+ *   callbacks=<n>:<us>   SetCallback calls back n times with the values 0 to n-1, us apart. Defaults to 5:0.
+ *   storm=<rate>:<ms>[:<threads>]
+ *                        After each SetCallback, threads call back with the value -1 at a total rate per second, for ms.
+ *   seed=<n>             Seed of the random numbers, so runs can be repeated.
+ *
+ * Waits shorter than 2ms are spun, because the sleep granularity of Windows is too coarse for them.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "test_lib.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+enum Export {
+    EXPORT_Invert,
+    EXPORT_Interleave,
+    EXPORT_SetCallback,
+    EXPORT_ScaleRecords,
+    EXPORT_CreateBuffer,
+    EXPORT_WriteBuffer,
+    EXPORT_ReadBuffer,
+    EXPORT_DestroyBuffer,
+    EXPORT_COUNT,
+};
+
+char const* const exportNames[EXPORT_COUNT] = {
+    "Invert", "Interleave", "SetCallback", "ScaleRecords", "CreateBuffer", "WriteBuffer", "ReadBuffer", "DestroyBuffer",
+};
+
+enum Threading {
+    THREADING_Free,
+    THREADING_Serialized,
+    THREADING_Single,
+    THREADING_Affine,
+};
+
+struct Distribution {
+    enum Kind { DIST_Fixed, DIST_Uniform, DIST_Exp, DIST_Lognormal } kind = DIST_Fixed;
+    double a = 0;
+    double b = 0;
+};
+
+struct ExportConfig {
+    Distribution service;
+    double perKbUs = 0;
+    double hangProbability = 0;
+    unsigned hangMs = 0;
+};
+
+struct Config {
+    ExportConfig exports[EXPORT_COUNT];
+    Threading threading = THREADING_Free;
+    unsigned callbacks = 5;
+    unsigned callbackIntervalUs = 0;
+    double stormRate = 0;
+    unsigned stormMs = 0;
+    unsigned stormThreads = 1;
+    unsigned seed = 1;
+};
+
+std::vector<std::string> Split(std::string const& s, char separator) {
+    std::vector<std::string> parts;
+    size_t start = 0;
+    while (true) {
+        size_t const end = s.find(separator, start);
+        parts.push_back(s.substr(start, end == std::string::npos ? std::string::npos : end - start));
+        if (end == std::string::npos) return parts;
+        start = end + 1;
+    }
+}
+
+bool ParseNumber(std::string const& s, double& value) {
+    char* end;
+    value = std::strtod(s.c_str(), &end);
+    return !s.empty() && *end == '\0' && value >= 0;
+}
+
+bool ParseDistribution(std::string const& s, Distribution& dist) {
+    std::vector<std::string> const parts = Split(s, ':');
+    std::string const& kind = parts[0];
+    size_t const params = parts.size() - 1;
+
+    if (kind == "fixed" && params == 1) dist.kind = Distribution::DIST_Fixed;
+    else if (kind == "uniform" && params == 2) dist.kind = Distribution::DIST_Uniform;
+    else if (kind == "exp" && params == 1) dist.kind = Distribution::DIST_Exp;
+    else if (kind == "lognormal" && params == 2) dist.kind = Distribution::DIST_Lognormal;
+    else return false;
+
+    dist.b = 0;
+    return ParseNumber(parts[1], dist.a) && (params < 2 || ParseNumber(parts[2], dist.b));
+}
+
+/* Apply a `<key>=<value>` entry to the exports selected by its prefix. */
+bool ParseEntry(std::string const& entry, Config& config) {
+    size_t const equals = entry.find('=');
+    if (equals == std::string::npos) return false;
+
+    std::string key = entry.substr(0, equals);
+    std::string const value = entry.substr(equals + 1);
+    std::vector<std::string> const params = Split(value, ':');
+
+    int first = 0;
+    int last = EXPORT_COUNT - 1;
+    size_t const dot = key.find('.');
+    if (dot != std::string::npos) {
+        std::string const name = key.substr(0, dot);
+        first = std::find_if(exportNames, exportNames + EXPORT_COUNT,
+                             [&name](char const* n) { return name == n; }) - exportNames;
+        if (first == EXPORT_COUNT) return false;
+        last = first;
+        key = key.substr(dot + 1);
+    }
+
+    bool const global = dot == std::string::npos;
+    double a, b, c;
+    if (key == "service") {
+        Distribution dist;
+        if (!ParseDistribution(value, dist)) return false;
+        for (int e = first; e <= last; e++) config.exports[e].service = dist;
+    }
+    else if (key == "perkb") {
+        if (!ParseNumber(value, a)) return false;
+        for (int e = first; e <= last; e++) config.exports[e].perKbUs = a;
+    }
+    else if (key == "hang") {
+        if (params.size() != 2 || !ParseNumber(params[0], a) || !ParseNumber(params[1], b) || a > 1) return false;
+        for (int e = first; e <= last; e++) {
+            config.exports[e].hangProbability = a;
+            config.exports[e].hangMs = (unsigned)b;
+        }
+    }
+    else if (key == "threading" && global) {
+        if (value == "free") config.threading = THREADING_Free;
+        else if (value == "serialized") config.threading = THREADING_Serialized;
+        else if (value == "single") config.threading = THREADING_Single;
+        else if (value == "affine") config.threading = THREADING_Affine;
+        else return false;
+    }
+    else if (key == "callbacks" && global) {
+        if (params.size() != 2 || !ParseNumber(params[0], a) || !ParseNumber(params[1], b)) return false;
+        config.callbacks = (unsigned)a;
+        config.callbackIntervalUs = (unsigned)b;
+    }
+    else if (key == "storm" && global) {
+        c = 1;
+        if (params.size() < 2 || params.size() > 3 || !ParseNumber(params[0], a) || !ParseNumber(params[1], b) ||
+            (params.size() == 3 && (!ParseNumber(params[2], c) || c < 1))) {
+            return false;
+        }
+        config.stormRate = a;
+        config.stormMs = (unsigned)b;
+        config.stormThreads = (unsigned)c;
+    }
+    else if (key == "seed" && global) {
+        if (!ParseNumber(value, a)) return false;
+        config.seed = (unsigned)a;
+    }
+    else {
+        return false;
+    }
+
+    return true;
+}
+
+Config LoadConfig() {
+    Config config;
+    char const* const spec = std::getenv("SYNTH_LIB");
+    if (spec == nullptr) return config;
+
+    for (std::string entry : Split(spec, ';')) {
+        entry.erase(std::remove_if(entry.begin(), entry.end(), [](char c) { return std::isspace(c); }), entry.end());
+        if (!entry.empty() && !ParseEntry(entry, config)) {
+            std::fprintf(stderr, "synth_lib: Ignoring invalid entry %s\n", entry.c_str());
+        }
+    }
+    return config;
+}
+
+Config const& GetConfig() {
+    static Config const config = LoadConfig();
+    return config;
+}
+
+std::mt19937& Random() {
+    static std::atomic<unsigned> threads(0);
+    thread_local std::mt19937 engine(GetConfig().seed * 7919 + threads++);
+    return engine;
+}
+
+double Sample(Distribution const& dist) {
+    switch (dist.kind) {
+        case Distribution::DIST_Fixed:
+            return dist.a;
+        case Distribution::DIST_Uniform:
+            return std::uniform_real_distribution<double>(std::min(dist.a, dist.b), std::max(dist.a, dist.b))(Random());
+        case Distribution::DIST_Exp:
+            return dist.a > 0 ? std::exponential_distribution<double>(1 / dist.a)(Random()) : 0;
+        case Distribution::DIST_Lognormal:
+            return dist.a > 0 ? std::lognormal_distribution<double>(std::log(dist.a), dist.b)(Random()) : 0;
+    }
+    return 0;
+}
+
+/* Wait for us microseconds. Sleeps are only precise to a few ms, the rest is spun. */
+void Wait(double us) {
+    if (us <= 0) return;
+
+    Clock::time_point const end = Clock::now() + std::chrono::microseconds((long long)us);
+    if (us > 2000) std::this_thread::sleep_for(std::chrono::microseconds((long long)us - 2000));
+    while (Clock::now() < end) {}
+}
+
+std::mutex serializedMutex;
+std::atomic<int> callsInside(0);
+std::atomic<std::thread::id> firstThread;
+
+/* Enforces the configured thread-safety and takes the configured time for the duration of a call. */
+class Call {
+public:
+    Call(Export e, size_t payloadBytes) : config_(GetConfig()) {
+        switch (config_.threading) {
+            case THREADING_Free:
+                break;
+            case THREADING_Serialized:
+                lock_ = std::unique_lock<std::mutex>(serializedMutex);
+                break;
+            case THREADING_Single:
+                if (callsInside.fetch_add(1) != 0) Abort(e, "called concurrently");
+                break;
+            case THREADING_Affine: {
+                std::thread::id expected;
+                if (!firstThread.compare_exchange_strong(expected, std::this_thread::get_id()) &&
+                    expected != std::this_thread::get_id()) {
+                    Abort(e, "called from another thread");
+                }
+            } break;
+        }
+
+        ExportConfig const& exportConfig = config_.exports[e];
+        double us = Sample(exportConfig.service) + exportConfig.perKbUs * payloadBytes / 1024;
+        if (exportConfig.hangProbability > 0 &&
+            std::uniform_real_distribution<double>()(Random()) < exportConfig.hangProbability) {
+            us += exportConfig.hangMs * 1000.0;
+        }
+        Wait(us);
+    }
+
+    ~Call() {
+        if (config_.threading == THREADING_Single) callsInside--;
+    }
+
+private:
+    static void Abort(Export e, char const* reason) {
+        std::fprintf(stderr, "synth_lib: %s %s, which the library doesn't support\n", exportNames[e], reason);
+        std::abort();
+    }
+
+    Config const& config_;
+    std::unique_lock<std::mutex> lock_;
+};
+
+void StormTask(TCallback cb, double rate, unsigned ms) {
+    Clock::time_point const end = Clock::now() + std::chrono::milliseconds(ms);
+    double const intervalUs = 1000000 / rate;
+    Clock::time_point next = Clock::now();
+    while (next < end) {
+        cb(-1);
+        next += std::chrono::microseconds((long long)intervalUs);
+        Wait(std::chrono::duration<double, std::micro>(next - Clock::now()).count());
+    }
+}
+
+}
+
+bool Invert(bool input) {
+    Call call(EXPORT_Invert, sizeof(input));
+    return !input;
+}
+
+void Interleave(char const* s1, int size1, char const* s2, int size2, char* out) {
+    Call call(EXPORT_Interleave, size1 + size2);
+
+    int const sMin = std::min(size1, size2);
+    int outIdx = 0;
+    for (int i = 0; i < sMin; i++) {
+        out[outIdx++] = s1[i];
+        out[outIdx++] = s2[i];
+    }
+
+    if (size1 > sMin) memcpy(&out[outIdx], &s1[sMin], size1 - sMin);
+    if (size2 > sMin) memcpy(&out[outIdx], &s2[sMin], size2 - sMin);
+}
+
+void SetCallback(TCallback cb)
+{
+    Call call(EXPORT_SetCallback, 0);
+    Config const& config = GetConfig();
+
+    // Storms keep going after SetCallback returned, like events of a device
+    if (config.stormRate > 0 && config.stormMs > 0)
+    {
+        for (unsigned i = 0; i < config.stormThreads; i++)
+        {
+            std::thread(StormTask, cb, config.stormRate / config.stormThreads, config.stormMs).detach();
+        }
+    }
+
+    std::thread cbThread([cb, &config]()
+    {
+        for (unsigned i = 0; i < config.callbacks; i++)
+        {
+            if (i > 0) Wait(config.callbackIntervalUs);
+            cb(i);
+        }
+    });
+    cbThread.join();
+}
+
+void ScaleRecords(Record* records, int count, double factor)
+{
+    Call call(EXPORT_ScaleRecords, count > 0 ? count * sizeof(Record) : 0);
+
+    for (int i = 0; i < count; i++)
+    {
+        records[i].value *= factor;
+        records[i].flags |= 1;
+        records[i].count++;
+    }
+}
+
+struct Buffer
+{
+    std::vector<char> data;
+};
+
+Buffer* CreateBuffer(int size)
+{
+    Call call(EXPORT_CreateBuffer, 0);
+
+    if (size < 0)
+    {
+        return NULL;
+    }
+    return new Buffer{std::vector<char>(size)};
+}
+
+// Number of bytes of a buffer that can be accessed starting at offset, at most size
+static int Accessible(Buffer const* buffer, int offset, int size)
+{
+    if (offset < 0 || size < 0 || offset > (int)buffer->data.size())
+    {
+        return 0;
+    }
+    return std::min(size, (int)buffer->data.size() - offset);
+}
+
+int WriteBuffer(Buffer* buffer, int offset, char const* data, int size)
+{
+    Call call(EXPORT_WriteBuffer, std::max(size, 0));
+
+    int const count = Accessible(buffer, offset, size);
+    memcpy(buffer->data.data() + offset, data, count);
+    return count;
+}
+
+int ReadBuffer(Buffer* buffer, int offset, char* out, int size)
+{
+    Call call(EXPORT_ReadBuffer, std::max(size, 0));
+
+    int const count = Accessible(buffer, offset, size);
+    memcpy(out, buffer->data.data() + offset, count);
+    return count;
+}
+
+void DestroyBuffer(Buffer* buffer)
+{
+    Call call(EXPORT_DestroyBuffer, 0);
+    delete buffer;
+}
@@ -1,8 +1,13 @@
+#include <atomic>
 #include <cassert>
 #include <cstring>
+#include <memory>
+#include <thread>
 #include <vector>
 
 #include "dll32to64.h"
+#include "dll32to64_async.h"
+#include "dll32to64_map.h"
 
 #include "test_lib.h"
 
@@ -12,13 +17,29 @@ namespace {
     void TestCallback(int v) {
         cbVals.push_back(v);
     }
+
+    std::atomic<int> completions(0);
+
+    void CountCompletion(Dll32To64_Call*, void* context) {
+        assert(context == &completions);
+        completions++;
+    }
 }
 
 int main() {
     Dll32To64_EnableLogging("C:/Users/Toto/");
+    Dll32To64_EnableTracing("C:/Users/Toto/");
+    assert(Dll32To64_SetDefaultTimeout(nullptr, 10000));
+    assert(!Dll32To64_SetDefaultTimeout("NoSuchFunction", 10000));
+    // Only wrapped functions can be configured, not internal messages
+    assert(!Dll32To64_SetDefaultTimeout("Hello", 10000));
 
     assert(!Invert(true));
+    assert(Dll32To64_GetLastError() == DLL32TO64_ERROR_NONE);
     assert(Invert(false));
+    assert(Dll32To64_SetShimMode("Invert", DLL32TO64_SHIM_ON, 0));
+    assert(!Invert(true));
+    assert(!Dll32To64_SetShimMode("Interleave", DLL32TO64_SHIM_ON, 0));
 
     char s1[] = "First";
     int s1Len = strlen(s1);
@@ -28,10 +49,139 @@ int main() {
     Interleave(s1, s1Len, s2, s2Len, interleaved);
     assert(0 == memcmp(interleaved, "FSiercsotnd", s1Len + s2Len));
 
+    // Arguments that don't fit into a request aren't sent, and the call fails
+    std::vector<char> large(3000, 'x');
+    std::vector<char> largeOut(2 * large.size());
+    Interleave(large.data(), large.size(), large.data(), large.size(), largeOut.data());
+    assert(Dll32To64_GetLastError() == DLL32TO64_ERROR_ARGUMENTS);
+
+    // Up to the largest arguments that fit, and not a byte more
+    int limit = 0;
+    for (int size = large.size(); size > 0 && limit == 0; size--) {
+        Interleave(large.data(), size - size / 2, large.data(), size / 2, largeOut.data());
+        if (Dll32To64_GetLastError() == DLL32TO64_ERROR_NONE) limit = size;
+    }
+    assert(limit > 0);
+    assert(0 == memcmp(largeOut.data(), large.data(), limit));
+    Interleave(large.data(), limit + 1 - (limit + 1) / 2, large.data(), (limit + 1) / 2, largeOut.data());
+    assert(Dll32To64_GetLastError() == DLL32TO64_ERROR_ARGUMENTS);
+
     SetCallback(TestCallback);
     std::vector<int> expected{0, 1, 2, 3, 4};
     assert(cbVals == expected);
 
+    // Replacing the wrapper doesn't fail any calls
+    Dll32To64_SetRecyclePolicy(20, 0);
+    for (int i = 0; i < 100; i++) {
+        Interleave(s1, s1Len, s2, s2Len, interleaved);
+        assert(Dll32To64_GetLastError() == DLL32TO64_ERROR_NONE);
+        assert(0 == memcmp(interleaved, "FSiercsotnd", s1Len + s2Len));
+    }
+    Dll32To64_SetRecyclePolicy(0, 0);
+    // Callbacks fired by registering them with the new wrapper don't reach the client again
+    assert(cbVals == expected);
+
+    std::vector<Record> records(50);
+    for (size_t i = 0; i < records.size(); i++) {
+        records[i] = Record{i, (double)i, 0, i};
+    }
+    ScaleRecords(records.data(), records.size(), 2.0);
+    for (size_t i = 0; i < records.size(); i++) {
+        assert(records[i].id == i && records[i].value == 2.0 * i && records[i].flags == 1 && records[i].count == i + 1);
+    }
+
+    // The buffer stays in the wrapper, only slices of it are transferred
+    std::unique_ptr<Buffer, decltype(&DestroyBuffer)> buffer(CreateBuffer(10000), &DestroyBuffer);
+    assert(buffer);
+    std::vector<char> pattern(10000);
+    for (size_t i = 0; i < pattern.size(); i++) {
+        pattern[i] = (char)(i % 251);
+    }
+    assert(WriteBuffer(buffer.get(), 0, pattern.data(), pattern.size()) == 10000);
+    char slice[16];
+    assert(ReadBuffer(buffer.get(), 5000, slice, sizeof(slice)) == 16);
+    assert(0 == memcmp(slice, &pattern[5000], sizeof(slice)));
+    assert(ReadBuffer(buffer.get(), 9990, slice, sizeof(slice)) == 10);
+    Buffer* const destroyed = buffer.get();
+    buffer.reset();
+    // The wrapper rejects objects the session doesn't hold
+    ReadBuffer(destroyed, 0, slice, sizeof(slice));
+    assert(Dll32To64_GetLastError() == DLL32TO64_ERROR_ARGUMENTS);
+
+    // Not destroyed explicitly, freed when the session ends
+    assert(CreateBuffer(100) != NULL);
+
+    // Many calls in flight from a single thread
+    assert(Dll32To64_SetShimMode("Invert", DLL32TO64_SHIM_OFF, 0));
+    bool results[200];
+    std::vector<Dll32To64_Call*> calls;
+    for (int i = 0; i < 200; i++) {
+        calls.push_back(InvertAsync(i % 2 == 0, &results[i]));
+    }
+    for (int i = 0; i < 200; i++) {
+        assert(Dll32To64_Wait(calls[i], DLL32TO64_INFINITE));
+        assert(Dll32To64_GetCallError(calls[i]) == DLL32TO64_ERROR_NONE);
+        assert(results[i] == (i % 2 != 0));
+        Dll32To64_Release(calls[i]);
+    }
+
+    // Calls beyond the admission limit wait in the bridge, and are rejected once the queue is full
+    assert(Dll32To64_SetAdmissionLimit("Invert", 1, 10));
+    assert(!Dll32To64_SetAdmissionLimit("NoSuchFunction", 1, 0));
+    assert(!Dll32To64_SetAdmissionLimit("Callback", 1, 0));
+    calls.clear();
+    for (int i = 0; i < 20; i++) {
+        calls.push_back(InvertAsync(i % 2 == 0, &results[i]));
+    }
+    Dll32To64_Load load;
+    assert(Dll32To64_GetLoad("Invert", &load) && load.inFlight <= 1 && load.queued <= 10);
+    unsigned long long rejected = 0;
+    for (int i = 0; i < 20; i++) {
+        assert(Dll32To64_Wait(calls[i], DLL32TO64_INFINITE));
+        Dll32To64_Error const error = Dll32To64_GetCallError(calls[i]);
+        assert(error == DLL32TO64_ERROR_NONE ? results[i] == (i % 2 != 0) : error == DLL32TO64_ERROR_OVERLOADED);
+        if (error == DLL32TO64_ERROR_OVERLOADED) rejected++;
+        Dll32To64_Release(calls[i]);
+    }
+    assert(Dll32To64_GetLoad("Invert", &load) && load.inFlight == 0 && load.queued == 0 && load.rejected == rejected);
+    assert(Dll32To64_SetAdmissionLimit("Invert", 0, 0));
+
+    // Map calls are split into several requests if they don't fit into one
+    std::unique_ptr<bool[]> mapInputs(new bool[5000]);
+    std::unique_ptr<bool[]> mapResults(new bool[5000]);
+    for (int i = 0; i < 5000; i++) {
+        mapInputs[i] = i % 3 == 0;
+    }
+    InvertMap(mapInputs.get(), mapResults.get(), 5000);
+    assert(Dll32To64_GetLastError() == DLL32TO64_ERROR_NONE);
+    for (int i = 0; i < 5000; i++) {
+        assert(mapResults[i] == !mapInputs[i]);
+    }
+
+    // Lanes can be chosen per function
+    assert(Dll32To64_SetLane("Invert", DLL32TO64_LANE_BULK));
+    assert(!Dll32To64_SetLane("NoSuchFunction", DLL32TO64_LANE_CONTROL));
+    assert(!Dll32To64_SetLane("ClockSync", DLL32TO64_LANE_BULK));
+    assert(!Invert(true));
+    assert(Dll32To64_SetLane("Invert", DLL32TO64_LANE_CONTROL));
+
+    // Reads that are split into several requests complete once
+    Buffer* asyncBuffer = NULL;
+    Dll32To64_Call* call = CreateBufferAsync(5000, &asyncBuffer);
+    assert(Dll32To64_Wait(call, DLL32TO64_INFINITE) && asyncBuffer != NULL);
+    Dll32To64_Release(call);
+    std::vector<char> asyncOut(5000, 1);
+    int read = 0;
+    call = ReadBufferAsync(asyncBuffer, 0, asyncOut.data(), asyncOut.size(), &read);
+    if (!Dll32To64_OnComplete(call, &CountCompletion, &completions)) completions++;
+    assert(Dll32To64_Wait(call, DLL32TO64_INFINITE));
+    Dll32To64_Release(call);
+    assert(read == 5000 && asyncOut == std::vector<char>(5000, 0));
+    DestroyBuffer(asyncBuffer);
+    // The completion may still be running when Dll32To64_Wait() returns
+    while (completions == 0) std::this_thread::yield();
+    assert(completions == 1);
+
     Dll32To64_Shutdown();
     return 0;
 }
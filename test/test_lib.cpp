@@ -2,6 +2,7 @@
 #include <cstring>
 #include <chrono>
 #include <thread>
+#include <vector>
 
 #include "test_lib.h"
 
@@ -55,3 +56,56 @@ void SetCallback(TCallback proc)
     std::thread cbThread(CallbackTask, proc);
     cbThread.join();
 }
+
+void ScaleRecords(Record* records, int count, double factor)
+{
+    for (int i = 0; i < count; i++)
+    {
+        records[i].value *= factor;
+        records[i].flags |= 1;
+        records[i].count++;
+    }
+}
+
+struct Buffer
+{
+    std::vector<char> data;
+};
+
+Buffer* CreateBuffer(int size)
+{
+    if (size < 0)
+    {
+        return NULL;
+    }
+    return new Buffer{std::vector<char>(size)};
+}
+
+// Number of bytes of a buffer that can be accessed starting at offset, at most size
+static int Accessible(Buffer const* buffer, int offset, int size)
+{
+    if (offset < 0 || size < 0 || offset > (int)buffer->data.size())
+    {
+        return 0;
+    }
+    return std::min(size, (int)buffer->data.size() - offset);
+}
+
+int WriteBuffer(Buffer* buffer, int offset, char const* data, int size)
+{
+    int const count = Accessible(buffer, offset, size);
+    memcpy(buffer->data.data() + offset, data, count);
+    return count;
+}
+
+int ReadBuffer(Buffer* buffer, int offset, char* out, int size)
+{
+    int const count = Accessible(buffer, offset, size);
+    memcpy(out, buffer->data.data() + offset, count);
+    return count;
+}
+
+void DestroyBuffer(Buffer* buffer)
+{
+    delete buffer;
+}
@@ -1,7 +1,23 @@
+#ifndef TEST_LIB_H
+#define TEST_LIB_H
+
+#include <cstddef>
+
 #define EXPORT __declspec(dllexport)
 
 typedef void (*TCallback)(int val);
 
+// Struct whose layout differs between 32 and 64 bit
+struct Record {
+    size_t id;
+    double value;
+    long flags;
+    size_t count;
+};
+
+// Object owned by the DLL that is only accessed through the functions below
+struct Buffer;
+
 extern "C" {
 // Simple function with only a single input value and a simple return
 EXPORT bool Invert(bool input);
@@ -11,4 +27,22 @@ EXPORT void Interleave(char const* s1, int size1, char const* s2, int size2, cha
 
 // Passing a callback to the DLL. This will be called 5 times with an incrementing index as the argument by the DLL.
 EXPORT void SetCallback(TCallback cb);
+
+// Multiplies the value of each record by factor, sets bit 0 of its flags and increments its count.
+EXPORT void ScaleRecords(Record* records, int count, double factor);
+
+// Creates a zero-filled buffer of the given size. Returns NULL if size is negative.
+EXPORT Buffer* CreateBuffer(int size);
+
+// Copies data into the buffer, starting at offset. Returns the number of bytes written, which is less than size if the
+// buffer ends before.
+EXPORT int WriteBuffer(Buffer* buffer, int offset, char const* data, int size);
+
+// Copies up to size bytes starting at offset from the buffer into out. Returns the number of bytes read.
+EXPORT int ReadBuffer(Buffer* buffer, int offset, char* out, int size);
+
+// Frees the buffer.
+EXPORT void DestroyBuffer(Buffer* buffer);
 }
+
+#endif